@@ -0,0 +1,142 @@
+#include "AllocationTracker.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#if JUCE_WINDOWS
+ #include <malloc.h>
+#endif
+
+#if PITCHSCALER_TRACK_ALLOCATIONS
+
+namespace
+{
+    thread_local int forbiddenDepth = 0;
+    std::atomic<int> violationCount { 0 };
+
+    void reportHeapAccess()
+    {
+        if (forbiddenDepth == 0) return;
+
+        ++violationCount;
+
+        // Drop the guard while asserting, the assertion machinery is
+        // free to allocate and must not recurse back in here
+        const int depth = forbiddenDepth;
+        forbiddenDepth = 0;
+        jassertfalse; // heap touched on a thread that promised not to
+        forbiddenDepth = depth;
+    }
+
+    void* trackedAllocate(std::size_t size)
+    {
+        reportHeapAccess();
+        if (void* p = std::malloc(size == 0 ? 1 : size)) return p;
+        throw std::bad_alloc();
+    }
+
+    void trackedFree(void* p) noexcept
+    {
+        if (p == nullptr) return;
+        reportHeapAccess();
+        std::free(p);
+    }
+
+    void* trackedAllocateAligned(std::size_t size, std::align_val_t alignment)
+    {
+        reportHeapAccess();
+        const std::size_t align = static_cast<std::size_t>(alignment);
+        if (size == 0) size = 1;
+       #if JUCE_WINDOWS
+        if (void* p = _aligned_malloc(size, align)) return p;
+       #else
+        // aligned_alloc wants the size to be a multiple of the alignment
+        size = (size + align - 1) / align * align;
+        if (void* p = std::aligned_alloc(align, size)) return p;
+       #endif
+        throw std::bad_alloc();
+    }
+
+    void trackedFreeAligned(void* p) noexcept
+    {
+        if (p == nullptr) return;
+        reportHeapAccess();
+       #if JUCE_WINDOWS
+        _aligned_free(p);
+       #else
+        std::free(p);
+       #endif
+    }
+}
+
+AllocationTracker::ScopedNoHeapAllocation::ScopedNoHeapAllocation()
+{
+    ++forbiddenDepth;
+}
+
+AllocationTracker::ScopedNoHeapAllocation::~ScopedNoHeapAllocation()
+{
+    --forbiddenDepth;
+}
+
+int AllocationTracker::getViolationCount()
+{
+    return violationCount.load();
+}
+
+void* operator new(std::size_t size) { return trackedAllocate(size); }
+void* operator new[](std::size_t size) { return trackedAllocate(size); }
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    try { return trackedAllocate(size); } catch (...) { return nullptr; }
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    try { return trackedAllocate(size); } catch (...) { return nullptr; }
+}
+
+void operator delete(void* p) noexcept { trackedFree(p); }
+void operator delete[](void* p) noexcept { trackedFree(p); }
+void operator delete(void* p, std::size_t) noexcept { trackedFree(p); }
+void operator delete[](void* p, std::size_t) noexcept { trackedFree(p); }
+void operator delete(void* p, const std::nothrow_t&) noexcept { trackedFree(p); }
+void operator delete[](void* p, const std::nothrow_t&) noexcept { trackedFree(p); }
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+    return trackedAllocateAligned(size, alignment);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment)
+{
+    return trackedAllocateAligned(size, alignment);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    try { return trackedAllocateAligned(size, alignment); } catch (...) { return nullptr; }
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept
+{
+    try { return trackedAllocateAligned(size, alignment); } catch (...) { return nullptr; }
+}
+
+void operator delete(void* p, std::align_val_t) noexcept { trackedFreeAligned(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { trackedFreeAligned(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { trackedFreeAligned(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { trackedFreeAligned(p); }
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept { trackedFreeAligned(p); }
+void operator delete[](void* p, std::align_val_t, const std::nothrow_t&) noexcept { trackedFreeAligned(p); }
+
+#else
+
+int AllocationTracker::getViolationCount()
+{
+    return 0;
+}
+
+#endif
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <JuceHeader.h>
+
+// In debug builds the global operator new/delete, including the
+// std::align_val_t overloads, are replaced so that any heap traffic on
+// a thread holding a ScopedNoHeapAllocation trips a jassert. Define
+// PITCHSCALER_TRACK_ALLOCATIONS=0 to switch it off.
+//
+// Only operator new/delete can be replaced portably, so anything that
+// calls malloc, posix_memalign or _aligned_malloc directly is not
+// seen. That includes everything RubberBand allocates through
+// allocate() and allocate_and_zero(): the stretcher is linked in as a
+// prebuilt library, and its process/retrieve path is instead kept off
+// the heap by the library's own real-time rules. A clean run with the
+// tracker on says nothing about those allocations.
+#ifndef PITCHSCALER_TRACK_ALLOCATIONS
+ #define PITCHSCALER_TRACK_ALLOCATIONS JUCE_DEBUG
+#endif
+
+namespace AllocationTracker
+{
+    // Marks the current thread as one that must not touch the heap
+    // for as long as the object is alive. Scopes may be nested.
+    class ScopedNoHeapAllocation
+    {
+    public:
+       #if PITCHSCALER_TRACK_ALLOCATIONS
+        ScopedNoHeapAllocation();
+        ~ScopedNoHeapAllocation();
+       #else
+        ScopedNoHeapAllocation() {}
+       #endif
+
+        ScopedNoHeapAllocation(const ScopedNoHeapAllocation&) = delete;
+        ScopedNoHeapAllocation& operator=(const ScopedNoHeapAllocation&) = delete;
+    };
+
+    // Number of allocations or deallocations caught inside a
+    // ScopedNoHeapAllocation since startup. Always 0 when tracking is
+    // compiled out.
+    int getViolationCount();
+}
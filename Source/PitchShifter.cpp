@@ -1,41 +1,118 @@
 #include "PitchShifter.h"
 #include "RubberBandStretcher.h"
+#include "common/VectorOps.h"
 
-PitchShifter::PitchShifter(int sampleRate, size_t channels)
+namespace {
+
+// Range of the pitch shift in octaves. The lowest is as far down as
+// the parameters reach; the highest is what updateRatio() allows
+const double LowestShift = -2.0;
+const double HighestShift = 2.0 + 1.0 + 100.0 / 1200.0;
+
+// Fastest the wet compensation delay may move, in samples per sample
+const double WetDelaySlew = 0.25;
+
+RubberBand::RubberBandStretcher::Options stretcherOptions(size_t channels,
+                                                          LatencyMode latencyMode,
+                                                          Engine engine)
+{
+    // At 0 semitones the stretcher settles into a plain delay line
+    // and stops processing until the pitch is moved again
+    RubberBand::RubberBandStretcher::Options options =
+        RubberBand::RubberBandStretcher::OptionProcessRealTime |
+        RubberBand::RubberBandStretcher::OptionProcessUnityBypass |
+        RubberBand::RubberBandStretcher::OptionPitchHighConsistency;
+
+    if (latencyMode == LatencyMode::Minimal) {
+        options |= RubberBand::RubberBandStretcher::OptionWindowShort;
+    }
+
+    if (engine == Engine::Finer) {
+        options |= RubberBand::RubberBandStretcher::OptionEngineFiner;
+    }
+
+    // Beyond stereo, analyse the channels together so that surround
+    // and ambisonic layouts stay phase-coherent and the finer engine
+    // classifies once per hop instead of once per channel. Stereo
+    // keeps its independent analysis, which is how it has always
+    // sounded.
+    if (channels > 2) {
+        options |= RubberBand::RubberBandStretcher::OptionChannelsTogether;
+    }
+
+    return options;
+}
+
+}
+
+PitchShifter::PitchShifter(int sampleRate, size_t channels, size_t blockSize,
+                           LatencyMode latencyMode, Engine engine)
     : m_latency(nullptr), m_cents(nullptr), m_semitones(nullptr),
     m_octaves(nullptr), m_crispness(nullptr), m_formant(nullptr),
     m_wet(nullptr), m_dry(nullptr), m_ratio(1.0), m_prevRatio(1.0),
-    m_currentCrispness(-1), m_blockSize(1024),
+    m_currentCrispness(-1), m_currentFormant(-1), m_underruns(0),
+    m_maxDelay(0), m_wetDelay(0.0), m_wetDelayWrite(0), m_wetDelaySize(0),
+    m_ratioRampLength(sampleRate / 20), m_gainRampLength(sampleRate / 50),
+    m_blockSize(blockSize > 0 ? blockSize : 1024),
     m_reserve(8192), m_bufsize(0), m_minfill(0),
     m_stretcher(new RubberBand::RubberBandStretcher(
-        sampleRate, channels,
-        RubberBand::RubberBandStretcher::OptionProcessRealTime |
-        RubberBand::RubberBandStretcher::OptionPitchHighConsistency)),
-    m_sampleRate(sampleRate), m_channels(channels) {
+        sampleRate, channels, stretcherOptions(channels, latencyMode, engine))),
+    m_sampleRate(sampleRate), m_channels(channels),
+    m_latencyMode(latencyMode) {
+
+    // The stretcher's delay grows as the pitch goes down. The
+    // pre-roll has to cover what it holds back before it can emit a
+    // hop, plus its delay, at the lowest pitch the ratio can reach.
+    // At any higher pitch the wet output is delayed by the
+    // difference, so that the latency stays the same throughout and
+    // the dry path stays in line with it
+    m_stretcher->setPitchScale(pow(2.0, HighestShift));
+    int minDelay = stretcherDelay();
+    m_stretcher->setPitchScale(pow(2.0, LowestShift));
+    m_maxDelay = stretcherDelay();
+    size_t required = m_stretcher->getSamplesRequired() + m_maxDelay;
+    if (m_latencyMode == LatencyMode::Safe) {
+        m_reserve = std::max(m_reserve, required);
+    } else {
+        m_reserve = required;
+    }
+    m_stretcher->setPitchScale(1.0);
+
     m_input = new float* [m_channels];
     m_output = new float* [m_channels];
 
-    m_outputBuffer = new RubberBand::RingBuffer<float> *[m_channels];
     m_delayMixBuffer = new RubberBand::RingBuffer<float> *[m_channels];
     m_scratch = new float* [m_channels];
+    m_wetGains = RubberBand::allocate<float>(m_blockSize);
+    m_dryGains = RubberBand::allocate<float>(m_blockSize);
+    m_dryBlock = RubberBand::allocate_and_zero<float>(m_blockSize);
     m_inptrs = new float* [m_channels];
+    m_outptrs = new float* [m_channels];
+
+    // The dry path only ever holds the latency plus one chunk; the
+    // wet output stays inside the stretcher until it is retrieved
+    // straight into the host buffer, so no output ring is needed
+    m_bufsize = getLatency() + m_blockSize + 1;
+
+    m_wetDelaySize = m_maxDelay - minDelay + 2;
+    m_wetDelayBuffer = RubberBand::allocate_channels<float>(m_channels, m_wetDelaySize);
 
-    m_bufsize = m_blockSize + m_reserve + 8192;
+    m_stretcher->setMaxProcessSize(m_blockSize);
 
     for (size_t c = 0; c < m_channels; ++c) {
 
         m_input[c] = 0;
         m_output[c] = 0;
 
-        m_outputBuffer[c] = new RubberBand::RingBuffer<float>(m_bufsize);
         m_delayMixBuffer[c] = new RubberBand::RingBuffer<float>(m_bufsize);
 
-        m_scratch[c] = new float[m_bufsize];
-        for (size_t i = 0; i < m_bufsize; ++i) {
+        m_scratch[c] = new float[m_blockSize];
+        for (size_t i = 0; i < m_blockSize; ++i) {
             m_scratch[c][i] = 0.f;
         }
 
         m_inptrs[c] = 0;
+        m_outptrs[c] = 0;
     }
 
     activateImpl();
@@ -45,12 +122,15 @@ PitchShifter::~PitchShifter()
 {
     delete m_stretcher;
     for (size_t c = 0; c < m_channels; ++c) {
-        delete m_outputBuffer[c];
         delete m_delayMixBuffer[c];
         delete[] m_scratch[c];
     }
-    delete[] m_outputBuffer;
     delete[] m_delayMixBuffer;
+    RubberBand::deallocate_channels(m_wetDelayBuffer, m_channels);
+    RubberBand::deallocate(m_dryBlock);
+    RubberBand::deallocate(m_dryGains);
+    RubberBand::deallocate(m_wetGains);
+    delete[] m_outptrs;
     delete[] m_inptrs;
     delete[] m_scratch;
     delete[] m_output;
@@ -61,39 +141,52 @@ void PitchShifter::activateImpl()
 {
     updateRatio();
     m_prevRatio = m_ratio;
+    m_ratioRamp.reset(log2(m_ratio));
+    m_wetRamp.reset(m_wet ? *m_wet : 1.0);
+    m_dryRamp.reset(m_dry ? *m_dry : 0.0);
     m_stretcher->reset();
     m_stretcher->setPitchScale(m_ratio);
 
-    for (size_t c = 0; c < m_channels; ++c) {
-        m_outputBuffer[c]->reset();
-    }
-
     for (size_t c = 0; c < m_channels; ++c) {
         m_delayMixBuffer[c]->reset();
         m_delayMixBuffer[c]->zero(getLatency());
+        RubberBand::v_zero(m_wetDelayBuffer[c], m_wetDelaySize);
     }
 
+    m_wetDelay = m_maxDelay - stretcherDelay();
+    m_wetDelayWrite = 0;
+
     for (size_t c = 0; c < m_channels; ++c) {
-        for (size_t i = 0; i < m_bufsize; ++i) {
+        for (size_t i = 0; i < m_blockSize; ++i) {
             m_scratch[c][i] = 0.f;
         }
     }
 
     m_minfill = 0;
 
-    m_stretcher->process(m_scratch, m_reserve, false);
+    size_t fed = 0;
+    while (fed < m_reserve) {
+        size_t chunk = std::min(m_reserve - fed, m_blockSize);
+        m_stretcher->process(m_scratch, chunk, false);
+        fed += chunk;
+    }
 }
 
 void PitchShifter::runImpl(uint32_t count)
 {
-    for (size_t c = 0; c < m_channels; ++c) {
-        m_delayMixBuffer[c]->write(m_input[c], count);
+    size_t offset = 0;
+
+    updateRamps();
+
+    if (m_latency) {
+        *m_latency = getLatency();
     }
 
-    size_t offset = 0;
+    updateCrispness();
+    updateFormant();
 
     // We have to break up the input into chunks like this because
-    // insamples could be arbitrarily large and our output buffer is
+    // insamples could be arbitrarily large and our delay buffer is
     // of limited size
 
     while (offset < count) {
@@ -103,98 +196,138 @@ void PitchShifter::runImpl(uint32_t count)
             block = count - offset;
         }
 
+        // While the pitch is gliding, the stretcher is fed in short
+        // segments so that each one gets its own ratio
+        if (m_ratioRamp.isRamping() && block > RatioSegmentSize) {
+            block = RatioSegmentSize;
+        }
+
+        double ratio = m_ratioRamp.isRamping() ? pow(2.0, m_ratioRamp.current) : m_ratio;
+        if (ratio != m_prevRatio) {
+            m_stretcher->setPitchScale(ratio);
+            m_prevRatio = ratio;
+        }
+        m_ratioRamp.advance(int(block));
+
+        for (size_t c = 0; c < m_channels; ++c) {
+            m_delayMixBuffer[c]->write(m_input[c] + offset, block);
+        }
+
         runImpl(block, offset);
 
-        offset += block;
-    }
+        m_wetRamp.fill(m_wetGains, int(block));
+        m_wetRamp.advance(int(block));
+        m_dryRamp.fill(m_dryGains, int(block));
+        m_dryRamp.advance(int(block));
 
-    float mix = 0.0;
-    if (m_wet) mix = 1-*m_wet;
+        // The delay buffer was primed with the latency's worth of
+        // silence, so it always has at least a chunk to give back
 
-    for (size_t c = 0; c < m_channels; ++c) {
-            for (size_t i = 0; i < count; ++i) {
-                float dry = m_delayMixBuffer[c]->readOne();
-                m_output[c][i] *= (1-mix);
-                m_output[c][i] += *m_dry * dry;
-            }
-       
-    }
+        for (size_t c = 0; c < m_channels; ++c) {
+            m_delayMixBuffer[c]->read(m_dryBlock, int(block));
+            RubberBand::v_mix_with_gains(m_output[c] + offset, m_dryBlock,
+                                         m_wetGains, m_dryGains, int(block));
+        }
 
-   
+        offset += block;
+    }
 }
 
 void PitchShifter::runImpl(uint32_t count, uint32_t offset)
 {
-    updateRatio();
-    if (m_ratio != m_prevRatio) {
-        m_stretcher->setPitchScale(m_ratio);
-        m_prevRatio = m_ratio;
-    }
+    const int samples = count;
 
-    if (m_latency) {
-        *m_latency = getLatency();
+    // The chunk is never larger than the maximum process size the
+    // stretcher was set up for, so it can take it all at once.
+    // Asking it how much it needs doesn't help here: the pre-roll
+    // keeps output waiting in it, and the finer engine asks for
+    // nothing at all while there is any
+
+    for (size_t c = 0; c < m_channels; ++c) {
+        m_inptrs[c] = &(m_input[c][offset]);
     }
 
-    updateCrispness();
-    updateFormant();
+    m_stretcher->process(m_inptrs, samples, false);
 
-    const int samples = count;
-    int processed = 0;
-    size_t outTotal = 0;
+    // All of this chunk's input has been consumed, so its span of the
+    // host buffer is free to receive the output in place
 
-    while (processed < samples) {
+    int avail = m_stretcher->available();
+    if (avail < samples) {
+        ++m_underruns;
+    }
+    int chunk = std::max(0, std::min(avail, samples));
 
-        // never feed more than the minimum necessary number of
-        // samples at a time; ensures nothing will overflow internally
-        // and we don't need to call setMaxProcessSize
+    for (size_t c = 0; c < m_channels; ++c) {
+        m_outptrs[c] = &(m_output[c][offset]);
+    }
 
-        int toCauseProcessing = m_stretcher->getSamplesRequired();
-        int inchunk = std::min(samples - processed, toCauseProcessing);
+    size_t actual = m_stretcher->retrieve(m_outptrs, chunk);
 
-        for (size_t c = 0; c < m_channels; ++c) {
-            m_inptrs[c] = &(m_input[c][offset + processed]);
+    for (size_t c = 0; c < m_channels; ++c) {
+        for (size_t i = actual; i < size_t(samples); ++i) {
+            m_outptrs[c][i] = 0.f;
         }
+    }
 
-        m_stretcher->process(m_inptrs, inchunk, false);
+    delayWet(offset, samples);
 
-        processed += inchunk;
+    size_t fill = m_stretcher->available();
+    if (fill < m_minfill || m_minfill == 0) {
+        m_minfill = fill;
+        //        cerr << "minfill = " << m_minfill << endl;
+    }
+}
+
+void PitchShifter::delayWet(size_t offset, int count)
+{
+    // Ease the delay towards the stretcher's current shortfall from
+    // its delay at the lowest pitch, rather than jumping, reading
+    // between samples while it moves so that pitch changes don't click
 
-        int avail = m_stretcher->available();
-        int writable = m_outputBuffer[0]->getWriteSpace();
+    double target = m_maxDelay - stretcherDelay();
 
-        int outchunk = avail;
-        if (outchunk > writable) {
-            std::cerr << "RubberBandPitchShifter::runImpl: buffer is not large enough: size = " << m_outputBuffer[0]->getSize() << ", chunk = " << outchunk << ", space = " << writable << " (buffer contains " << m_outputBuffer[0]->getReadSpace() << " unread)" << std::endl;
-            outchunk = writable;
+    for (int i = 0; i < count; ++i) {
+
+        if (m_wetDelay < target) {
+            m_wetDelay = std::min(target, m_wetDelay + WetDelaySlew);
+        } else if (m_wetDelay > target) {
+            m_wetDelay = std::max(target, m_wetDelay - WetDelaySlew);
         }
 
-        size_t actual = m_stretcher->retrieve(m_scratch, outchunk);
-        outTotal += actual;
+        int whole = int(m_wetDelay);
+        float frac = float(m_wetDelay - whole);
+        int r0 = m_wetDelayWrite - whole;
+        if (r0 < 0) r0 += m_wetDelaySize;
+        int r1 = (r0 > 0 ? r0 : m_wetDelaySize) - 1;
 
         for (size_t c = 0; c < m_channels; ++c) {
-            m_outputBuffer[c]->write(m_scratch[c], actual);
+            float* buf = m_wetDelayBuffer[c];
+            float& sample = m_output[c][offset + i];
+            buf[m_wetDelayWrite] = sample;
+            sample = buf[r0] + (buf[r1] - buf[r0]) * frac;
         }
-    }
 
-    for (size_t c = 0; c < m_channels; ++c) {
-        int toRead = m_outputBuffer[c]->getReadSpace();
-        if (toRead < samples && c == 0) {
-            std::cerr << "RubberBandPitchShifter::runImpl: buffer underrun: required = " << samples << ", available = " << toRead << std::endl;
+        if (++m_wetDelayWrite == m_wetDelaySize) {
+            m_wetDelayWrite = 0;
         }
-        int chunk = std::min(toRead, samples);
-        m_outputBuffer[c]->read(&(m_output[c][offset]), chunk);
     }
+}
 
-    size_t fill = m_outputBuffer[0]->getReadSpace();
-    if (fill < m_minfill || m_minfill == 0) {
-        m_minfill = fill;
-        //        cerr << "minfill = " << m_minfill << endl;
-    }
+int PitchShifter::stretcherDelay() const
+{
+    return int(m_stretcher->getStartDelay()) -
+        int(m_stretcher->getPreferredStartPad());
 }
 
 int PitchShifter::getLatency() const
 {
-    return m_reserve;
+    return int(m_reserve) + m_maxDelay;
+}
+
+int PitchShifter::getUnderrunCount() const
+{
+    return m_underruns;
 }
 
 void PitchShifter::updateRatio()
@@ -211,10 +344,63 @@ void PitchShifter::updateRatio()
     if (cents < -100.0) cents = -100.0;
     if (cents > 100.0) cents = 100.0;
 
-    m_ratio = pow(2.0,
-        octaves +
-        semitones / 12.0 +
-        cents / 1200.0);
+    double shift = octaves + semitones / 12.0 + cents / 1200.0;
+    if (shift < LowestShift) shift = LowestShift;
+
+    m_ratio = pow(2.0, shift);
+}
+
+void PitchShifter::updateRamps()
+{
+    // Parameters only change between host blocks, so each change starts
+    // a ramp at the top of the block it arrives in
+
+    updateRatio();
+    m_ratioRamp.setTarget(log2(m_ratio), m_ratioRampLength);
+    m_wetRamp.setTarget(m_wet ? *m_wet : 1.0, m_gainRampLength);
+    m_dryRamp.setTarget(m_dry ? *m_dry : 0.0, m_gainRampLength);
+}
+
+void PitchShifter::Ramp::reset(double value)
+{
+    current = value;
+    target = value;
+    step = 0.0;
+    remaining = 0;
+}
+
+void PitchShifter::Ramp::setTarget(double value, int length)
+{
+    if (value == target) return;
+    if (length <= 0) {
+        reset(value);
+        return;
+    }
+    target = value;
+    step = (target - current) / length;
+    remaining = length;
+}
+
+void PitchShifter::Ramp::fill(float* values, int count) const
+{
+    int ramped = std::min(count, remaining);
+    for (int i = 0; i < ramped; ++i) {
+        values[i] = float(current + step * i);
+    }
+    for (int i = ramped; i < count; ++i) {
+        values[i] = float(target);
+    }
+}
+
+void PitchShifter::Ramp::advance(int count)
+{
+    if (count >= remaining) {
+        current = target;
+        remaining = 0;
+    } else {
+        current += step * count;
+        remaining -= count;
+    }
 }
 
 void PitchShifter::updateCrispness()
@@ -250,8 +436,13 @@ void PitchShifter::updateCrispness()
 
 void PitchShifter::updateFormant()
 {
+    int f = m_formant ? 1 : 0;
+    if (f == m_currentFormant) return;
+
     RubberBand::RubberBandStretcher* s = m_stretcher;
     s->setFormantOption(m_formant ? RubberBand::RubberBandStretcher::OptionFormantPreserved : RubberBand::RubberBandStretcher::OptionFormantShifted);
+
+    m_currentFormant = f;
 }
 
 void PitchShifter::loadSettings(Settings& settings)
@@ -265,10 +456,10 @@ void PitchShifter::loadSettings(Settings& settings)
 	m_formant = settings.formant_value;
 }
 
-void PitchShifter::processBlock(Settings& settings, int num_samples, std::vector<float*> channel_pointers)
+void PitchShifter::processBlock(Settings& settings, int num_samples, float* const* channel_pointers)
 {
 	loadSettings(settings);
-	for (int channel = 0; channel < channel_pointers.size(); ++channel) {
+	for (size_t channel = 0; channel < m_channels; ++channel) {
 		m_input[channel] = channel_pointers[channel];
 		m_output[channel] = channel_pointers[channel];
 	}
@@ -18,16 +18,43 @@ namespace RubberBand {
 	class RubberBandStretcher;
 }
 
+enum class LatencyMode
+{
+    Minimal,    // short window, reserve sized for the lowest pitch
+    Balanced,   // standard window, reserve sized for the lowest pitch
+    Safe        // standard window with a reserve of at least 8192 samples
+};
+
+enum class Engine
+{
+    Faster,     // R2 engine, the long-standing default
+    Finer       // R3 engine, higher quality at several times the CPU cost
+};
+
 class PitchShifter
 {
 public:
-	PitchShifter(int sampleRate, size_t channels);
+	PitchShifter(int sampleRate, size_t channels, size_t blockSize,
+                 LatencyMode latencyMode = LatencyMode::Safe,
+                 Engine engine = Engine::Faster);
 	~PitchShifter();
 
-    void processBlock(Settings& settings, int num_samples, std::vector<float*> channel_pointers);
+    void processBlock(Settings& settings, int num_samples, float* const* channel_pointers);
+
+    // Delay in samples between input and output, the same at any pitch
+    int getLatency() const;
+
+    // Number of chunks since construction for which the stretcher had
+    // less output ready than the chunk needed, and which were padded
+    // out with silence
+    int getUnderrunCount() const;
 
 
 protected:
+	enum {
+		RatioSegmentSize = 128
+	};
+
 	enum {
 		LatencyPort = 0,
 		CentsPort = 1,
@@ -44,15 +71,32 @@ protected:
 		PortCountStereo = OutputPort2 + 1
 	};
 
+    // Linear ramp towards a target value, advanced a chunk at a time
+    struct Ramp
+    {
+        double current = 0.0;
+        double target = 0.0;
+        double step = 0.0;
+        int remaining = 0;
+
+        void reset(double value);
+        void setTarget(double value, int length);
+        // Writes the values for the next count samples without advancing
+        void fill(float* values, int count) const;
+        void advance(int count);
+        bool isRamping() const { return remaining > 0; }
+    };
+
     void loadSettings(Settings& settings);
     void activateImpl();
     void runImpl(uint32_t count);
     void runImpl(uint32_t count, uint32_t offset);
     void updateRatio();
+    void updateRamps();
     void updateCrispness();
     void updateFormant();
-
-    int getLatency() const;
+    void delayWet(size_t offset, int count);
+    int stretcherDelay() const;
 
     float** m_input;
     float** m_output;
@@ -67,6 +111,23 @@ protected:
     double m_ratio;
     double m_prevRatio;
     int m_currentCrispness;
+    int m_currentFormant;
+    int m_underruns;
+
+    // The stretcher's delay beyond its start pad is greatest at the
+    // lowest pitch; the wet output is delayed by however far short of
+    // that it currently is
+    int m_maxDelay;
+    double m_wetDelay;
+    int m_wetDelayWrite;
+    int m_wetDelaySize;
+    float** m_wetDelayBuffer;
+
+    Ramp m_ratioRamp;   // log2 of the pitch ratio
+    Ramp m_wetRamp;
+    Ramp m_dryRamp;
+    int m_ratioRampLength;
+    int m_gainRampLength;
 
     size_t m_blockSize;
     size_t m_reserve;
@@ -74,13 +135,17 @@ protected:
     size_t m_minfill;
 
     RubberBand::RubberBandStretcher* m_stretcher;
-    RubberBand::RingBuffer<float>** m_outputBuffer;
     RubberBand::RingBuffer<float>** m_delayMixBuffer;
     float** m_scratch;
+    float* m_wetGains;
+    float* m_dryGains;
+    float* m_dryBlock;
     float** m_inptrs;
+    float** m_outptrs;
 
     int m_sampleRate;
     size_t m_channels;
+    LatencyMode m_latencyMode;
 
 private:
 
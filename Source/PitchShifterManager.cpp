@@ -0,0 +1,217 @@
+#include "PitchShifterManager.h"
+#include "common/Scavenger.h"
+
+bool PitchShifterManager::Config::operator==(const Config& other) const
+{
+    return sampleRate == other.sampleRate &&
+        channels == other.channels &&
+        blockSize == other.blockSize &&
+        latencyMode == other.latencyMode &&
+        engine == other.engine;
+}
+
+PitchShifterManager::PitchShifterManager()
+    : juce::Thread("PitchShifter builder"),
+    m_incoming(nullptr), m_pending(nullptr),
+    m_scavenger(new RubberBand::Scavenger<PitchShifter>()),
+    m_channels(0), m_fadeBufferSize(0), m_fadeLength(1), m_fadePosition(0),
+    m_muteSwap(false), m_latency(0), m_swapCount(0)
+{
+    startThread();
+}
+
+PitchShifterManager::~PitchShifterManager()
+{
+    signalThreadShouldExit();
+    notify();
+    stopThread(-1);
+
+    delete m_pending.exchange(nullptr);
+    delete m_incoming;
+}
+
+PitchShifter* PitchShifterManager::createShifter(const Config& config) const
+{
+    return new PitchShifter(config.sampleRate, config.channels, config.blockSize,
+                            config.latencyMode, config.engine);
+}
+
+void PitchShifterManager::prepare(const Config& config)
+{
+    const juce::ScopedLock sl(m_configLock);
+
+    m_requested = config;
+
+    // Nothing is being processed, so the old instances can go
+    // straight away and the new one is installed in their place. A
+    // replacement still fading in, or waiting to, is dropped with them,
+    // and as m_built describes that rather than the running shifter, a
+    // new one is needed even if the config has not changed
+    PitchShifter* pending = m_pending.exchange(nullptr);
+    bool replacing = pending != nullptr || m_incoming != nullptr;
+    delete pending;
+    delete m_incoming;
+    m_incoming = nullptr;
+
+    if (m_active == nullptr || replacing || config != m_built) {
+        m_active.reset(createShifter(config));
+        m_built = config;
+        m_latency = m_active->getLatency();
+    }
+
+    if (config.channels != m_channels) {
+        m_channels = config.channels;
+        m_fadeBufferSize = 0;
+    }
+
+    // The fade buffers hold a copy of the input for the incoming
+    // shifter, which processes in place just like the running one
+
+    if (config.blockSize > m_fadeBufferSize) {
+        m_fadeBufferSize = config.blockSize;
+        m_fadeBuffers.assign(m_channels, std::vector<float>(m_fadeBufferSize, 0.f));
+        m_fadePointers.resize(m_channels);
+        for (size_t c = 0; c < m_channels; ++c) {
+            m_fadePointers[c] = m_fadeBuffers[c].data();
+        }
+        m_offsetPointers.assign(m_channels, nullptr);
+    }
+
+    m_fadeLength = juce::jmax(1, config.sampleRate / 50);
+}
+
+void PitchShifterManager::configure(const Config& config)
+{
+    const juce::ScopedLock sl(m_configLock);
+
+    if (config == m_requested || m_channels == 0) return;
+
+    // A channel count change has to wait for prepare()
+    if (config.channels != m_channels) return;
+
+    m_requested = config;
+    notify();
+}
+
+void PitchShifterManager::run()
+{
+    while (!threadShouldExit()) {
+
+        wait(500);
+
+        // Instances that finished fading out are kept for a couple of
+        // seconds before being deleted here
+        m_scavenger->scavenge();
+
+        Config config;
+        {
+            const juce::ScopedLock sl(m_configLock);
+            if (m_requested == m_built) continue;
+            config = m_requested;
+        }
+
+        PitchShifter* next = createShifter(config);
+
+        {
+            const juce::ScopedLock sl(m_configLock);
+
+            // Superseded while it was being built: drop it and go
+            // round again for the newer one, if prepare() has not
+            // already installed that
+            if (config != m_requested || config == m_built) {
+                delete next;
+                notify();
+                continue;
+            }
+
+            m_built = config;
+
+            // A replacement the audio thread never picked up was never
+            // used, so it can be deleted right here
+            delete m_pending.exchange(next);
+        }
+
+        if (onShifterReady) {
+            onShifterReady();
+        }
+    }
+}
+
+void PitchShifterManager::processBlock(Settings& settings, int num_samples, float* const* channel_pointers)
+{
+    if (m_incoming == nullptr) {
+        m_incoming = m_pending.exchange(nullptr);
+
+        // A fresh shifter only puts out its pre-roll silence until its
+        // latency has gone by, so it runs unheard for that long before
+        // the fade starts
+        if (m_incoming) {
+            m_fadePosition = -m_incoming->getLatency();
+            m_muteSwap = m_incoming->getLatency() != m_active->getLatency();
+        }
+    }
+
+    if (m_incoming == nullptr) {
+        m_active->processBlock(settings, num_samples, channel_pointers);
+        return;
+    }
+
+    // The fade buffers are only as long as the prepared block size, but
+    // hosts are free to send more than that
+    int offset = 0;
+    while (offset < num_samples) {
+        int chunk = juce::jmin(num_samples - offset, int(m_fadeBufferSize));
+        for (size_t c = 0; c < m_channels; ++c) {
+            m_offsetPointers[c] = channel_pointers[c] + offset;
+        }
+        crossfadeBlock(settings, chunk, m_offsetPointers.data());
+        offset += chunk;
+    }
+
+    if (m_fadePosition >= m_fadeLength) {
+        m_scavenger->claim(m_active.release());
+        m_active.reset(m_incoming);
+        m_incoming = nullptr;
+        m_latency = m_active->getLatency();
+        ++m_swapCount;
+    }
+}
+
+void PitchShifterManager::crossfadeBlock(Settings& settings, int num_samples, float* const* channel_pointers)
+{
+    for (size_t c = 0; c < m_channels; ++c) {
+        std::copy(channel_pointers[c], channel_pointers[c] + num_samples, m_fadePointers[c]);
+    }
+
+    m_active->processBlock(settings, num_samples, channel_pointers);
+    m_incoming->processBlock(settings, num_samples, m_fadePointers.data());
+
+    // Both instances are fed the same input for the whole block, so the
+    // incoming one keeps running normally once the fade has completed
+    for (size_t c = 0; c < m_channels; ++c) {
+        float* out = channel_pointers[c];
+        const float* in = m_fadePointers[c];
+        for (int i = 0; i < num_samples; ++i) {
+            float gain = juce::jlimit(0.f, 1.f, float(m_fadePosition + i) / float(m_fadeLength));
+            if (!m_muteSwap) {
+                out[i] += gain * (in[i] - out[i]);
+            } else if (gain < 0.5f) {
+                out[i] *= 1.f - 2.f * gain;
+            } else {
+                out[i] = in[i] * (2.f * gain - 1.f);
+            }
+        }
+    }
+
+    m_fadePosition = juce::jmin(m_fadeLength, m_fadePosition + num_samples);
+}
+
+int PitchShifterManager::getLatency() const
+{
+    return m_latency.load();
+}
+
+unsigned int PitchShifterManager::getSwapCount() const
+{
+    return m_swapCount.load();
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <JuceHeader.h>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <vector>
+#include "PitchShifter.h"
+
+namespace RubberBand {
+    template <typename T> class Scavenger;
+}
+
+// Owns the PitchShifter the audio thread is running and builds its
+// replacements on a background thread. A finished replacement is
+// published through an atomic pointer, warmed up and then crossfaded
+// in by the audio thread over 20ms, and the instance it replaces is
+// handed to a Scavenger so that it is freed off the audio thread.
+// When the replacement has a different latency the two outputs are
+// not aligned, so instead of a crossfade the output dips to silence
+// and comes back up from the replacement over the same 20ms.
+class PitchShifterManager : private juce::Thread
+{
+public:
+    struct Config
+    {
+        int sampleRate = 0;
+        size_t channels = 0;
+        size_t blockSize = 0;
+        LatencyMode latencyMode = LatencyMode::Safe;
+        Engine engine = Engine::Faster;
+
+        bool operator==(const Config& other) const;
+        bool operator!=(const Config& other) const { return !(*this == other); }
+    };
+
+    PitchShifterManager();
+    ~PitchShifterManager() override;
+
+    // Message thread, with processBlock not running. Nothing is playing,
+    // so anything that differs from the running shifter (sample rate,
+    // block size, channel count) is installed directly, with the latency
+    // and fade length to match; only configure() changes are built on
+    // the background thread and crossfaded in.
+    void prepare(const Config& config);
+
+    // Message thread. Asks for a replacement if the config differs from
+    // the last one asked for.
+    void configure(const Config& config);
+
+    // Audio thread
+    void processBlock(Settings& settings, int num_samples, float* const* channel_pointers);
+
+    // Latency of the shifter the audio thread is running. This only
+    // changes when a replacement has finished fading in, which is when
+    // the host should be told about it
+    int getLatency() const;
+
+    // Goes up by one each time a replacement has finished fading in.
+    // Written on the audio thread, readable from any.
+    unsigned int getSwapCount() const;
+
+    // Called on the background thread when a replacement is ready
+    std::function<void()> onShifterReady;
+
+private:
+    void run() override;
+    PitchShifter* createShifter(const Config& config) const;
+    void crossfadeBlock(Settings& settings, int num_samples, float* const* channel_pointers);
+
+    juce::CriticalSection m_configLock;
+    Config m_requested;
+    Config m_built;
+
+    std::unique_ptr<PitchShifter> m_active;
+    PitchShifter* m_incoming;
+    std::atomic<PitchShifter*> m_pending;
+    std::unique_ptr<RubberBand::Scavenger<PitchShifter>> m_scavenger;
+
+    std::vector<std::vector<float>> m_fadeBuffers;
+    std::vector<float*> m_fadePointers;
+    std::vector<float*> m_offsetPointers;
+    size_t m_channels;
+    size_t m_fadeBufferSize;
+    int m_fadeLength;
+    int m_fadePosition;
+    bool m_muteSwap;
+
+    std::atomic<int> m_latency;
+    std::atomic<unsigned int> m_swapCount;
+
+    JUCE_DECLARE_NON_COPYABLE (PitchShifterManager)
+};
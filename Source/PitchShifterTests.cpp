@@ -0,0 +1,137 @@
+#include <JuceHeader.h>
+#include "PitchShifter.h"
+
+#include <cmath>
+#include <vector>
+
+// Impulses through PitchShifter::processBlock across the pitch range,
+// checking that the wet output arrives at the latency the plugin
+// reports, the same as the dry output does. Registered with JUCE's
+// UnitTestRunner, under the "PitchScaler" category. Built into debug
+// builds only, so that release plugins do not carry it; define
+// PITCHSCALER_BUILD_TESTS=1 to include it anyway.
+#ifndef PITCHSCALER_BUILD_TESTS
+ #define PITCHSCALER_BUILD_TESTS JUCE_DEBUG
+#endif
+
+#if PITCHSCALER_BUILD_TESTS
+
+class PitchShifterTests : public juce::UnitTest
+{
+public:
+    PitchShifterTests() : juce::UnitTest("PitchShifter", "PitchScaler") {}
+
+    void runTest() override
+    {
+        const LatencyMode modes[] = {
+            LatencyMode::Minimal, LatencyMode::Balanced, LatencyMode::Safe
+        };
+        const char* modeNames[] = { "minimal", "balanced", "safe" };
+        const Engine engines[] = { Engine::Faster, Engine::Finer };
+        const char* engineNames[] = { "faster", "finer" };
+
+        for (int e = 0; e < 2; ++e) {
+            for (int m = 0; m < 3; ++m) {
+                beginTest(juce::String("latency, ") + engineNames[e] +
+                          " engine, " + modeNames[m] + " mode");
+                for (int shift : { -24, -12, -5, 0, 7, 12, 24 }) {
+                    checkWetLatency(modes[m], engines[e], shift);
+                }
+                checkDryLatency(modes[m], engines[e]);
+            }
+        }
+    }
+
+private:
+    enum {
+        SampleRate = 44100,
+        BlockSize = 256,
+        Period = 30000,
+        Impulses = 6,
+        Settling = 2
+    };
+
+    // The wet output is the pitch-shifted impulse, smeared over a
+    // window or so, so its position is taken as the centre of its
+    // energy, averaged over several impulses. The stretcher's delay
+    // at a given pitch is only known approximately, so this allows
+    // about 25ms either way
+    static constexpr double tolerance = 1024.0;
+
+    void checkWetLatency(LatencyMode mode, Engine engine, int shift)
+    {
+        PitchShifter shifter(SampleRate, 1, BlockSize, mode, engine);
+        const int latency = shifter.getLatency();
+
+        auto wet = run(shifter, shift, 1.f, 0.f);
+
+        // Skipping the first impulses, which meet the pitch and the
+        // wet compensation delay still on their way from unity
+        double centre = 0.0;
+        for (int k = Settling; k < Impulses; ++k) {
+            centre += energyCentre(wet, k * Period + Period / 2);
+        }
+        centre /= Impulses - Settling;
+        expectWithinAbsoluteError(centre, double(latency), tolerance,
+                                  "wet impulse at shift " +
+                                  juce::String(shift));
+
+        expectEquals(shifter.getUnderrunCount(), 0,
+                     "underruns at shift " + juce::String(shift));
+    }
+
+    // The dry path is a plain delay of the reported latency, at the
+    // lowest pitch as at any other
+    void checkDryLatency(LatencyMode mode, Engine engine)
+    {
+        PitchShifter shifter(SampleRate, 1, BlockSize, mode, engine);
+        const int latency = shifter.getLatency();
+
+        auto dry = run(shifter, -24, 0.f, 1.f);
+
+        for (int k = 0; k < Impulses; ++k) {
+            int at = k * Period + Period / 2 + latency;
+            expect(at < int(dry.size()) && dry[at] == 1.f, "dry impulse");
+        }
+    }
+
+    // Output for an impulse in the middle of each period
+    static std::vector<float> run(PitchShifter& shifter, int shift,
+                                  float wet, float dry)
+    {
+        Settings settings { float(shift / 12), float(shift % 12), 0.f,
+                            wet, dry, 3.f, false };
+
+        const int total = (Impulses + 1) * Period;
+        std::vector<float> block(BlockSize), out;
+        out.reserve(total);
+        float* channel = block.data();
+
+        for (int i = 0; i + BlockSize <= total; i += BlockSize) {
+            for (int j = 0; j < BlockSize; ++j) {
+                block[j] = ((i + j) % Period == Period / 2) ? 1.f : 0.f;
+            }
+            shifter.processBlock(settings, BlockSize, &channel);
+            out.insert(out.end(), block.begin(), block.end());
+        }
+
+        return out;
+    }
+
+    // Energy-weighted mean offset from the given input position, over
+    // the period that follows it
+    static double energyCentre(const std::vector<float>& out, int from)
+    {
+        double energy = 0.0, weighted = 0.0;
+        for (int i = from; i < from + Period && i < int(out.size()); ++i) {
+            double x = double(out[i]) * out[i];
+            energy += x;
+            weighted += x * (i - from);
+        }
+        return energy > 0.0 ? weighted / energy : -1.0;
+    }
+};
+
+static PitchShifterTests pitchShifterTests;
+
+#endif
@@ -37,6 +37,17 @@ PitchScalerAudioProcessorEditor::PitchScalerAudioProcessorEditor (PitchScalerAud
     {
         addAndMakeVisible(comp);
     }
+
+    // the items have to exist before the attachment picks one
+    latencyModeBox.addItemList(audioProcessor.apvts.getParameter("Latency Mode")->getAllValueStrings(), 1);
+    latencyModeAttachment = std::make_unique<APVTS::ComboBoxAttachment>(audioProcessor.apvts, "Latency Mode", latencyModeBox);
+    engineBox.addItemList(audioProcessor.apvts.getParameter("Engine")->getAllValueStrings(), 1);
+    engineAttachment = std::make_unique<APVTS::ComboBoxAttachment>(audioProcessor.apvts, "Engine", engineBox);
+
+    dspLoadLabel.setJustificationType(juce::Justification::centred);
+    dspLoadLabel.setFont(juce::Font(12.f));
+    startTimerHz(4);
+
     setSize (700, 500);
 
     sliderEditor();
@@ -187,7 +198,11 @@ void PitchScalerAudioProcessorEditor::resized()
     //set bounds for crispiness slider
     auto crispynessArea = bounds.removeFromRight(bounds.getWidth() * 0.5);
     auto toggleButtonArea = crispynessArea.removeFromLeft(crispynessArea.getWidth() * 0.2);
+    auto optionsArea = crispynessArea.removeFromBottom(72);
     crispynessSlider.setBounds(crispynessArea);
+    latencyModeBox.setBounds(optionsArea.removeFromTop(24).reduced(sliderSpacing, 0));
+    engineBox.setBounds(optionsArea.removeFromTop(24).reduced(sliderSpacing, 0));
+    dspLoadLabel.setBounds(optionsArea);
     formantToggle.setBounds(toggleButtonArea);
 
 
@@ -251,7 +266,10 @@ std::vector<juce::Component*> PitchScalerAudioProcessorEditor::getComps()
         &drySlider,
         &wetSlider,
         &crispynessSlider,
-        &formantToggle
+        &formantToggle,
+        &latencyModeBox,
+        &engineBox,
+        &dspLoadLabel
 
     };
 }
@@ -333,6 +351,13 @@ void PitchScalerAudioProcessorEditor::sliderValueFormantManipulator()
 
 
 
+}
+
+void PitchScalerAudioProcessorEditor::timerCallback()
+{
+    auto load = audioProcessor.getDspLoad();
+    dspLoadLabel.setText(juce::String(load.averageMs, 2) + " / " + juce::String(load.worstMs, 2)
+        + " of " + juce::String(load.budgetMs, 2) + " ms", juce::dontSendNotification);
 }
 
 std::shared_ptr<SpectrumAnalyzerComponent> PitchScalerAudioProcessorEditor::getSpectrumAnalyzerComponent() {
@@ -19,7 +19,8 @@
 /**
 */
 
-class PitchScalerAudioProcessorEditor  : public juce::AudioProcessorEditor
+class PitchScalerAudioProcessorEditor  : public juce::AudioProcessorEditor,
+                                         private juce::Timer
 {
 public:
     PitchScalerAudioProcessorEditor (PitchScalerAudioProcessor&);
@@ -32,6 +33,7 @@ public:
 
 
 private:
+    void timerCallback() override;
     void sliderEditor();
     void sliderValueManipulator();
     void sliderValueFormantManipulator();
@@ -51,6 +53,9 @@ private:
         wetSlider;
     juce::Slider crispynessSlider;
     juce::ToggleButton formantToggle;
+    juce::ComboBox latencyModeBox;
+    juce::ComboBox engineBox;
+    juce::Label dspLoadLabel;
 
     using APVTS = juce::AudioProcessorValueTreeState;
     using Attachment = APVTS::SliderAttachment;
@@ -65,6 +70,8 @@ private:
         wetSliderAttachment,
         crispynessSliderAttachment;
         APVTS::ButtonAttachment  formantToggleAttachment;
+    std::unique_ptr<APVTS::ComboBoxAttachment> latencyModeAttachment;
+    std::unique_ptr<APVTS::ComboBoxAttachment> engineAttachment;
 
 
     std::vector<juce::Component*> getComps();
@@ -8,6 +8,7 @@
 
 #include "PluginProcessor.h"
 #include "PluginEditor.h"
+#include "AllocationTracker.h"
 
 //==============================================================================
 PitchScalerAudioProcessor::PitchScalerAudioProcessor()
@@ -22,11 +23,21 @@ PitchScalerAudioProcessor::PitchScalerAudioProcessor()
                        )
 #endif
 {
+    // Replacements take over on the audio thread, which must not call
+    // into the host or the message queue: the timer watches for them
+    // and reports the new latency from the message thread
+    startTimerHz(10);
 
+    apvts.addParameterListener("Latency Mode", this);
+    apvts.addParameterListener("Engine", this);
 }
 
 PitchScalerAudioProcessor::~PitchScalerAudioProcessor()
 {
+    apvts.removeParameterListener("Latency Mode", this);
+    apvts.removeParameterListener("Engine", this);
+    stopTimer();
+    cancelPendingUpdate();
 }
 
 //==============================================================================
@@ -94,9 +105,80 @@ void PitchScalerAudioProcessor::changeProgramName (int index, const juce::String
 //==============================================================================
 void PitchScalerAudioProcessor::prepareToPlay (double sampleRate, int samplesPerBlock)
 {
-    pitchShifter = std::make_unique<PitchShifter>(
-        sampleRate, getTotalNumInputChannels());
+    octaveShiftParam = apvts.getRawParameterValue("Octave Shift");
+    semitoneShiftParam = apvts.getRawParameterValue("Semitone Shift");
+    centShiftParam = apvts.getRawParameterValue("Cent Shift");
+    octaveFormantParam = apvts.getRawParameterValue("Octave Formant");
+    semitoneFormantParam = apvts.getRawParameterValue("Semitone Formant");
+    centFormantParam = apvts.getRawParameterValue("Cent Formant");
+    crispynessParam = apvts.getRawParameterValue("Crispyness");
+    formantToggleParam = apvts.getRawParameterValue("Formant Toggle");
+    latencyModeParam = apvts.getRawParameterValue("Latency Mode");
+    engineParam = apvts.getRawParameterValue("Engine");
+    wetParam = apvts.getParameter("Wet Amount");
+    dryParam = apvts.getParameter("Dry Amount");
+
+    channelPointers.assign(getTotalNumInputChannels(), nullptr);
+
+    currentSampleRate = sampleRate;
+    currentBlockSize = samplesPerBlock;
+
+    shifterManager.prepare(getShifterConfig());
+    setLatencySamples(shifterManager.getLatency());
+
+    blockTimeTotalMs = 0.0;
+    blocksTimed = 0;
+    averageBlockMs = 0.f;
+    worstBlockMs = 0.f;
+}
+
+PitchShifterManager::Config PitchScalerAudioProcessor::getShifterConfig() const
+{
+    PitchShifterManager::Config config;
+    config.sampleRate = juce::roundToInt(currentSampleRate);
+    config.channels = size_t(getTotalNumInputChannels());
+    config.blockSize = size_t(currentBlockSize);
+    config.latencyMode = static_cast<LatencyMode>(juce::roundToInt(latencyModeParam->load()));
+    config.engine = static_cast<Engine>(juce::roundToInt(engineParam->load()));
+    return config;
+}
+
+void PitchScalerAudioProcessor::parameterChanged (const juce::String& parameterID, float newValue)
+{
+    // May arrive on the audio thread; the new config is handed over
+    // from the message thread instead
+    triggerAsyncUpdate();
+}
+
+void PitchScalerAudioProcessor::handleAsyncUpdate()
+{
+    // Nothing to rebuild until the host has told us the sample rate
+    if (currentSampleRate <= 0.0)
+        return;
 
+    shifterManager.configure(getShifterConfig());
+}
+
+void PitchScalerAudioProcessor::timerCallback()
+{
+    // The latency only moves once a rebuilt shifter has taken over on
+    // the audio thread, which bumps the swap count
+    const auto swapCount = shifterManager.getSwapCount();
+    if (swapCount != reportedSwapCount)
+    {
+        reportedSwapCount = swapCount;
+        setLatencySamples(shifterManager.getLatency());
+    }
+}
+
+PitchScalerAudioProcessor::DspLoad PitchScalerAudioProcessor::getDspLoad() const
+{
+    DspLoad load;
+    load.averageMs = averageBlockMs.load();
+    load.worstMs = worstBlockMs.load();
+    if (currentSampleRate > 0.0)
+        load.budgetMs = float(1000.0 * currentBlockSize / currentSampleRate);
+    return load;
 }
 
 void PitchScalerAudioProcessor::releaseResources()
@@ -112,12 +194,10 @@ bool PitchScalerAudioProcessor::isBusesLayoutSupported (const BusesLayout& layou
     juce::ignoreUnused (layouts);
     return true;
   #else
-    // This is the place where you check if the layout is supported.
-    // In this template code we only support mono or stereo.
-    // Some plugin hosts, such as certain GarageBand versions, will only
-    // load plugins that support stereo bus layouts.
-    if (layouts.getMainOutputChannelSet() != juce::AudioChannelSet::mono()
-     && layouts.getMainOutputChannelSet() != juce::AudioChannelSet::stereo())
+    // Any channel set will do, from mono through surround and
+    // ambisonic layouts, as long as there is one; the shifter is
+    // built for however many channels the host asks for.
+    if (layouts.getMainOutputChannelSet().isDisabled())
         return false;
 
     // This checks if the input layout matches the output layout
@@ -134,6 +214,7 @@ bool PitchScalerAudioProcessor::isBusesLayoutSupported (const BusesLayout& layou
 void PitchScalerAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer, juce::MidiBuffer& midiMessages)
 {
     juce::ScopedNoDenormals noDenormals;
+    AllocationTracker::ScopedNoHeapAllocation noHeapAllocation;
     auto totalNumInputChannels  = getTotalNumInputChannels();
     auto totalNumOutputChannels = getTotalNumOutputChannels();
 
@@ -153,28 +234,47 @@ void PitchScalerAudioProcessor::processBlock (juce::AudioBuffer<float>& buffer,
     // Alternatively, you can process the samples with the channels
     // interleaved by keeping the same state.
 
-    std::string suffix = apvts.getParameter("Formant Toggle")->getValue() ? " Formant" : " Shift";
+    const bool formant = formantToggleParam->load() >= 0.5f;
 
-    Settings settings {apvts.getRawParameterValue("Octave" + suffix)->load(),
-    	apvts.getRawParameterValue("Semitone" + suffix)->load(),
-    	apvts.getRawParameterValue("Cent" + suffix)->load(),
-    	apvts.getParameter("Wet Amount")->getValue(),
-        apvts.getParameter("Dry Amount")->getValue(),
-		apvts.getRawParameterValue("Crispyness")->load(),
+    Settings settings {(formant ? octaveFormantParam : octaveShiftParam)->load(),
+    	(formant ? semitoneFormantParam : semitoneShiftParam)->load(),
+    	(formant ? centFormantParam : centShiftParam)->load(),
+    	wetParam->getValue(),
+        dryParam->getValue(),
+		crispynessParam->load(),
         false
      };
 
-    std::vector<float*> channel_pointers;
     for (int channel = 0; channel < totalNumInputChannels; ++channel)
     {
-        channel_pointers.emplace_back(buffer.getWritePointer(channel));
+        channelPointers[channel] = buffer.getWritePointer(channel);
     }
 
     if (auto s = spectrumAnalyzerComponent.lock()) {
         s->addBuffer(buffer, Input);
     }
 
-    pitchShifter->processBlock(settings, buffer.getNumSamples(), channel_pointers);
+    const auto startTicks = juce::Time::getHighResolutionTicks();
+
+    shifterManager.processBlock(settings, buffer.getNumSamples(), channelPointers.data());
+
+    // Timings restart whenever a rebuilt shifter has taken over; the
+    // host is told its latency by timerCallback
+    if (shifterManager.getSwapCount() != lastSwapCount)
+    {
+        lastSwapCount = shifterManager.getSwapCount();
+        blockTimeTotalMs = 0.0;
+        blocksTimed = 0;
+        worstBlockMs = 0.f;
+    }
+
+    const auto blockMs = 1000.0 * juce::Time::highResolutionTicksToSeconds(
+        juce::Time::getHighResolutionTicks() - startTicks);
+    blockTimeTotalMs += blockMs;
+    ++blocksTimed;
+    averageBlockMs = float(blockTimeTotalMs / double(blocksTimed));
+    if (blockMs > worstBlockMs.load())
+        worstBlockMs = float(blockMs);
 
     if (auto s = spectrumAnalyzerComponent.lock()) {
         s->addBuffer(buffer, Output);
@@ -235,6 +335,9 @@ juce::AudioProcessorValueTreeState::ParameterLayout PitchScalerAudioProcessor::c
     layout.add(std::make_unique<juce::AudioParameterFloat>("Crispyness", "Crispyness", juce::NormalisableRange<float>(0.f, 3.f, 1.f, 1.f), 0.f));
     layout.add(std::make_unique<juce::AudioParameterBool>("Formant Toggle", "Formant Toggle", false));
 
+    layout.add(std::make_unique<juce::AudioParameterChoice>("Latency Mode", "Latency Mode", juce::StringArray{ "Minimal", "Balanced", "Safe" }, 2));
+    layout.add(std::make_unique<juce::AudioParameterChoice>("Engine", "Engine", juce::StringArray{ "Faster", "Finer" }, 0));
+
 
     return layout;
 }
@@ -10,7 +10,7 @@
 
 #include <JuceHeader.h>
 #include "PluginProcessor.h"
-#include "PitchShifter.h"
+#include "PitchShifterManager.h"
 #include "SpectrumAnalyzerComponent.h"
 
 
@@ -21,6 +21,9 @@ class PitchScalerAudioProcessor  : public juce::AudioProcessor
                             #if JucePlugin_Enable_ARA
                              , public juce::AudioProcessorARAExtension
                             #endif
+                             , private juce::AudioProcessorValueTreeState::Listener
+                             , private juce::AsyncUpdater
+                             , private juce::Timer
 {
 public:
     //==============================================================================
@@ -60,12 +63,58 @@ public:
     void getStateInformation (juce::MemoryBlock& destData) override;
     void setStateInformation (const void* data, int sizeInBytes) override;
 
+    // Time spent inside the shifter per block since the current engine
+    // was swapped in, next to the time the host allows for a block
+    struct DspLoad
+    {
+        float averageMs = 0.f;
+        float worstMs = 0.f;
+        float budgetMs = 0.f;
+    };
+
+    DspLoad getDspLoad() const;
+
     static juce::AudioProcessorValueTreeState::ParameterLayout createParameterLayout();
     juce::AudioProcessorValueTreeState apvts{*this, nullptr, "parameters", createParameterLayout()};
 
 private:
+    void parameterChanged (const juce::String& parameterID, float newValue) override;
+    void handleAsyncUpdate() override;
+    void timerCallback() override;
+    PitchShifterManager::Config getShifterConfig() const;
+
+    PitchShifterManager shifterManager;
+    double currentSampleRate = 0.0;
+    int currentBlockSize = 0;
+
+    // Looked up once in prepareToPlay so that processBlock never has to
+    // build parameter IDs or search the tree by name
+    std::atomic<float>* octaveShiftParam = nullptr;
+    std::atomic<float>* semitoneShiftParam = nullptr;
+    std::atomic<float>* centShiftParam = nullptr;
+    std::atomic<float>* octaveFormantParam = nullptr;
+    std::atomic<float>* semitoneFormantParam = nullptr;
+    std::atomic<float>* centFormantParam = nullptr;
+    std::atomic<float>* crispynessParam = nullptr;
+    std::atomic<float>* formantToggleParam = nullptr;
+    std::atomic<float>* latencyModeParam = nullptr;
+    std::atomic<float>* engineParam = nullptr;
+    juce::RangedAudioParameter* wetParam = nullptr;
+    juce::RangedAudioParameter* dryParam = nullptr;
+
+    std::vector<float*> channelPointers;
+
+    // Written by the audio thread only
+    double blockTimeTotalMs = 0.0;
+    juce::int64 blocksTimed = 0;
+    unsigned int lastSwapCount = 0;
+    std::atomic<float> averageBlockMs { 0.f };
+    std::atomic<float> worstBlockMs { 0.f };
+
+    // Message thread only: the swap count the host's latency was last
+    // set for
+    unsigned int reportedSwapCount = 0;
 
-    std::unique_ptr<PitchShifter> pitchShifter;
     std::weak_ptr<SpectrumAnalyzerComponent> spectrumAnalyzerComponent;
 
     //==============================================================================
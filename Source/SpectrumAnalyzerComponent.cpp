@@ -1,112 +1,191 @@
 #include "SpectrumAnalyzerComponent.h"
 
-SpectrumAnalyzerComponent::SpectrumAnalyzerComponent(): forwardFFT(fftOrder), window(fftSize, juce::dsp::WindowingFunction<float>::hann) {
+SpectrumAnalyzerComponent::SpectrumAnalyzerComponent():
+    fftOrder(0), fftSize(0), fftSizeDecibels(0.f),
+    input(juce::Colours::white), output(juce::Colours::green) {
     setOpaque(false);
     setAudioChannels(2, 0);
-    startTimerHz(30);
+    scopeX.fill(0);
+    setFftOrder(defaultFftOrder);
+    setFrameRate(30);
     setSize(700, 500);
-    scopeData_input.fill(0);
-    scopeData_output.fill(0);
 }
 SpectrumAnalyzerComponent::~SpectrumAnalyzerComponent()
 {
     shutdownAudio();
 }
 
+void SpectrumAnalyzerComponent::setFftOrder(int order) {
+    order = juce::jlimit((int) minFftOrder, (int) maxFftOrder, order);
+    if (order == fftOrder)
+        return;
+
+    fftOrder = order;
+    fftSize = 1 << fftOrder;
+    fftSizeDecibels = juce::Decibels::gainToDecibels((float) fftSize);
+    forwardFFT = std::make_unique<juce::dsp::FFT>(fftOrder);
+    window = std::make_unique<juce::dsp::WindowingFunction<float>>(fftSize, juce::dsp::WindowingFunction<float>::hann);
+
+    for (auto* curve : { &input, &output })
+    {
+        curve->history.assign(fftSize, 0.f);
+        curve->fftData.assign(2 * fftSize, 0.f);
+    }
+
+    // The scope is skewed towards the low end, so that each octave
+    // gets a similar share of the width
+    for (int i = 0; i < scopeSize; ++i)
+    {
+        auto skewedProportionX = 1.0f - std::exp (std::log (1.0f - (float) i / (float) scopeSize) * 0.2f);
+        scopeBins[i] = juce::jlimit (0, fftSize / 2, (int) (skewedProportionX * (float) fftSize * 0.5f));
+    }
+}
+
+void SpectrumAnalyzerComponent::setFrameRate(int framesPerSecond) {
+    startTimerHz(juce::jlimit(1, 60, framesPerSecond));
+}
+
 void SpectrumAnalyzerComponent::paint(juce::Graphics& g) {
-    g.setColour(juce::Colour::fromFloatRGBA(0.f, 0.f, 0.f, 0.8f));
-    g.fillRect(g.getClipBounds());
-    g.setColour(juce::Colours::white);
-    drawFrame(g);
+    if (spectrumImage.isValid())
+        g.drawImageAt(spectrumImage, 0, 0);
+}
+
+void SpectrumAnalyzerComponent::resized() {
+    const auto width = getWidth();
+
+    for (int i = 0; i < scopeSize; ++i)
+        scopeX[i] = juce::jmap ((float) i, 0.0f, (float) (scopeSize - 1), 0.0f, (float) width);
+
+    if (getLocalBounds().isEmpty())
+    {
+        spectrumImage = {};
+        return;
+    }
+
+    spectrumImage = juce::Image(juce::Image::ARGB, width, getHeight(), true);
+    updatePath(input);
+    updatePath(output);
+    renderImage(getLocalBounds());
 }
 
 void SpectrumAnalyzerComponent::addBuffer(const juce::AudioBuffer<float>& buffer, Direction dir) {
     if (buffer.getNumChannels() > 0)
     {
-        auto* channelData = buffer.getReadPointer(0);
-        for (auto i = 0; i < buffer.getNumSamples(); ++i) {
-            pushNextSampleIntoFifo (channelData[i], dir);
-        }
+        // A single block copy; if the timer has fallen behind, whatever
+        // does not fit is dropped rather than waited for
+        auto& fifo = dir == Input ? input.fifo : output.fifo;
+        const int count = juce::jmin(buffer.getNumSamples(), fifo.getWriteSpace());
+        fifo.write(buffer.getReadPointer(0), count);
     }
 }
 
 void SpectrumAnalyzerComponent::timerCallback() {
-    if (nextFFTBlockReady_input)
+    if (! isShowing() || ! spectrumImage.isValid())
     {
-        drawNextFrameOfSpectrum(fftData_input, scopeData_input);
-        nextFFTBlockReady_input = false;
+        // Nobody is looking, so throw the audio away rather than
+        // analysing it, and keep the rings from filling up
+        for (auto* curve : { &input, &output })
+            curve->fifo.skip(curve->fifo.getReadSpace());
+        return;
     }
-    if (nextFFTBlockReady_output)
+
+    juce::Rectangle<int> dirty;
+
+    for (auto* curve : { &input, &output })
     {
-        drawNextFrameOfSpectrum(fftData_output, scopeData_output);
-        nextFFTBlockReady_output = false;
+        if (! pullFromFifo(*curve))
+            continue;
+
+        drawNextFrameOfSpectrum(*curve);
+
+        // The area to redraw has to cover where the curve was as well
+        // as where it is now
+        dirty = dirty.getUnion(curve->path.getBounds().getSmallestIntegerContainer());
+        updatePath(*curve);
+        dirty = dirty.getUnion(curve->path.getBounds().getSmallestIntegerContainer());
     }
-    repaint();
+
+    dirty = dirty.expanded(2).getIntersection(getLocalBounds());
+    if (dirty.isEmpty())
+        return;
+
+    renderImage(dirty);
+    repaint(dirty);
 }
 
-void SpectrumAnalyzerComponent::pushNextSampleIntoFifo (float sample, Direction dir) noexcept
+bool SpectrumAnalyzerComponent::pullFromFifo (Curve& curve)
 {
-    // if the fifo contains enough data, set a flag to say
-    // that the next frame should now be rendered..
-    std::array<float, fftSize> & queue = dir == Input ? fifo_input : fifo_output;
-    std::array<float, 2 * fftSize> & data = dir == Input ? fftData_input : fftData_output;
-    unsigned int& index = dir == Input ? fifoIndex_input : fifoIndex_output;
-    bool& nextFFTBlockReady = dir == Input ? nextFFTBlockReady_input : nextFFTBlockReady_output;
-
-    if (index == fftSize)               // [11]
+    auto& fifo = curve.fifo;
+    auto& history = curve.history;
+
+    int available = fifo.getReadSpace();
+    if (available == 0)
+        return false;
+
+    // Only the latest fftSize samples are ever shown
+    if (available > fftSize)
     {
-        if (! nextFFTBlockReady)            // [12]
-        {
-            data.fill(0);
-            std::copy(queue.begin(), queue.end(), data.begin());
-            nextFFTBlockReady = true;
-        }
-
-        index = 0;
+        fifo.skip(available - fftSize);
+        available = fftSize;
     }
-    queue[index++] = sample;             // [12]
+
+    std::copy(history.begin() + available, history.end(), history.begin());
+    fifo.read(history.data() + fftSize - available, available);
+    return true;
 }
 
-void SpectrumAnalyzerComponent::drawNextFrameOfSpectrum(std::array<float, 2 * fftSize>& data, std::array<float, scopeSize>& scope)
+void SpectrumAnalyzerComponent::drawNextFrameOfSpectrum(Curve& curve)
 {
+    auto& data = curve.fftData;
+
+    std::copy(curve.history.begin(), curve.history.end(), data.begin());
+    std::fill(data.begin() + fftSize, data.end(), 0.f);
+
     // first apply a windowing function to our data
-    window.multiplyWithWindowingTable (data.data(), fftSize);       // [1]
+    window->multiplyWithWindowingTable (data.data(), (size_t) fftSize);       // [1]
 
     // then render our FFT data..
-    forwardFFT.performFrequencyOnlyForwardTransform (data.data());  // [2]
+    forwardFFT->performFrequencyOnlyForwardTransform (data.data());  // [2]
 
     auto mindB = -100.0f;
     auto maxdB =    0.0f;
 
     for (int i = 0; i < scopeSize; ++i)                         // [3]
     {
-        auto skewedProportionX = 1.0f - std::exp (std::log (1.0f - (float) i / (float) scopeSize) * 0.2f);
-        auto fftDataIndex = juce::jlimit (0, fftSize / 2, (int) (skewedProportionX * (float) fftSize * 0.5f));
-        auto level = juce::jmap (juce::jlimit (mindB, maxdB, juce::Decibels::gainToDecibels (data[fftDataIndex])
-                                               - juce::Decibels::gainToDecibels ((float) fftSize)),
+        auto level = juce::jmap (juce::jlimit (mindB, maxdB, juce::Decibels::gainToDecibels (data[scopeBins[i]])
+                                               - fftSizeDecibels),
                                  mindB, maxdB, 0.0f, 1.0f);
 
-        scope[i] = level;                                   // [4]
+        curve.scope[i] = level;                                   // [4]
     }
 }
 
-void SpectrumAnalyzerComponent::drawFrame (juce::Graphics& g)
+void SpectrumAnalyzerComponent::updatePath (Curve& curve)
 {
+    const auto height = (float) getHeight();
+
+    curve.path.clear();
+    curve.path.preallocateSpace(3 * scopeSize);
+    curve.path.startNewSubPath(scopeX[0], juce::jmap (curve.scope[0], 0.0f, 1.0f, height, 0.0f));
+
     for (int i = 1; i < scopeSize; ++i)
+        curve.path.lineTo(scopeX[i], juce::jmap (curve.scope[i], 0.0f, 1.0f, height, 0.0f));
+}
+
+void SpectrumAnalyzerComponent::renderImage (juce::Rectangle<int> area)
+{
+    spectrumImage.clear(area);
+
+    juce::Graphics g(spectrumImage);
+    g.reduceClipRegion(area);
+
+    g.setColour(juce::Colour::fromFloatRGBA(0.f, 0.f, 0.f, 0.8f));
+    g.fillRect(area);
+
+    const juce::PathStrokeType stroke(1.0f);
+    for (auto* curve : { &input, &output })
     {
-        auto width  = getLocalBounds().getWidth();
-        auto height = getLocalBounds().getHeight();
-
-        g.setColour(juce::Colours::white);
-        g.drawLine ({ (float) juce::jmap (i - 1, 0, scopeSize - 1, 0, width),
-            juce::jmap (scopeData_input[i - 1], 0.0f, 1.0f, (float) height, 0.0f),
-            (float) juce::jmap (i,     0, scopeSize - 1, 0, width),
-            juce::jmap (scopeData_input[i],     0.0f, 1.0f, (float) height, 0.0f) });
-
-        g.setColour(juce::Colours::green);
-        g.drawLine ({ (float) juce::jmap (i - 1, 0, scopeSize - 1, 0, width),
-            juce::jmap (scopeData_output[i - 1], 0.0f, 1.0f, (float) height, 0.0f),
-            (float) juce::jmap (i,     0, scopeSize - 1, 0, width),
-            juce::jmap (scopeData_output[i],     0.0f, 1.0f, (float) height, 0.0f) });
+        g.setColour(curve->colour);
+        g.strokePath(curve->path, stroke);
     }
 }
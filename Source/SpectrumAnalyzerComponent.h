@@ -2,6 +2,7 @@
 
 #include <JuceHeader.h>
 #include <juce_dsp/juce_dsp.h>
+#include "common/RingBuffer.h"
 
 enum Direction {
     Input,
@@ -10,9 +11,13 @@ enum Direction {
 
 enum
 {
-    fftOrder  = 11,             // [1]
-    fftSize   = 1 << fftOrder,  // [2]
-    scopeSize = 512 // [3]
+    minFftOrder     = 8,
+    maxFftOrder     = 14,
+    defaultFftOrder = 11,
+    scopeSize       = 512,
+    // Enough for a full frame at the largest order plus a few timer
+    // ticks' worth of audio at high sample rates
+    fifoSize        = 4 << maxFftOrder
 };
 
 class SpectrumAnalyzerComponent: public juce::AudioAppComponent, private juce::Timer {
@@ -20,28 +25,58 @@ public:
     SpectrumAnalyzerComponent();
     ~SpectrumAnalyzerComponent() override;
     void paint(juce::Graphics& g) override;
+    void resized() override;
     void addBuffer(const juce::AudioBuffer<float>& buffer, Direction dir);
     void getNextAudioBlock (const juce::AudioSourceChannelInfo& bufferToFill) override {}
     void timerCallback() override;
-    void pushNextSampleIntoFifo (float sample, Direction dir) noexcept;
-    void drawNextFrameOfSpectrum(std::array<float, 2 * fftSize>& data, std::array<float, scopeSize>& scope);
-    void drawFrame (juce::Graphics& g);
     void prepareToPlay (int, double) override {}
     void releaseResources() override          {}
 
+    // Message thread. The order is clamped to [minFftOrder, maxFftOrder].
+    void setFftOrder(int order);
+    int getFftOrder() const { return fftOrder; }
+
+    // Message thread. Frames are only computed and painted while the
+    // component is showing.
+    void setFrameRate(int framesPerSecond);
+
 private:
-    juce::dsp::FFT forwardFFT;                      // [4]
-    juce::dsp::WindowingFunction<float> window;     // [5]
-
-    std::array<float, fftSize> fifo_input;                           // [6]
-    std::array<float, 2 * fftSize> fftData_input;                    // [7]
-    std::array<float, fftSize>  fifo_output;                           // [6]
-    std::array<float, 2 * fftSize> fftData_output;                    // [7]
-    std::array<float, scopeSize> scopeData_input;                    // [10]
-    std::array<float, scopeSize> scopeData_output;                    // [10]
-
-    unsigned int fifoIndex_input = 0;                              // [8]
-    unsigned int fifoIndex_output = 0;                              // [8]
-    bool nextFFTBlockReady_input = false;                 // [9]
-    bool nextFFTBlockReady_output = false;                 // [9]
+    struct Curve
+    {
+        explicit Curve(juce::Colour c) : fifo(fifoSize), colour(c) { scope.fill(0); }
+
+        // Written by the audio thread in addBuffer and read by the
+        // timer, one writer and one reader, so no locking is needed
+        RubberBand::RingBuffer<float> fifo;
+
+        // Everything below is message thread only
+        std::vector<float> history; // the most recent fftSize samples
+        std::vector<float> fftData;
+        std::array<float, scopeSize> scope;
+        juce::Path path;
+        juce::Colour colour;
+    };
+
+    bool pullFromFifo (Curve& curve);
+    void drawNextFrameOfSpectrum (Curve& curve);
+    void updatePath (Curve& curve);
+    void renderImage (juce::Rectangle<int> area);
+
+    std::unique_ptr<juce::dsp::FFT> forwardFFT;
+    std::unique_ptr<juce::dsp::WindowingFunction<float>> window;
+    int fftOrder;
+    int fftSize;
+    float fftSizeDecibels;
+
+    // FFT bin shown at each scope point, rebuilt when the order changes
+    std::array<int, scopeSize> scopeBins;
+
+    // x position of each scope point, rebuilt when the size changes
+    std::array<float, scopeSize> scopeX;
+
+    Curve input;
+    Curve output;
+
+    // The curves as last drawn; paint() only blits this
+    juce::Image spectrumImage;
 };
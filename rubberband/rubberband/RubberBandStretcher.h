@@ -143,6 +143,17 @@ public:
      *   \li \c OptionProcessRealTime - Run the stretcher in real-time
      *   mode.  In this mode only process() should be called, and the
      *   stretcher adjusts dynamically in response to the input audio.
+     *
+     *   \li \c OptionProcessUnityBypass - May be combined with
+     *   \c OptionProcessRealTime. Once the time ratio and pitch scale
+     *   have both been exactly 1.0 for half a second, the stretcher
+     *   crossfades to passing its input straight through, at the
+     *   same delay, and stops processing, so that it uses almost no
+     *   CPU. As soon as either ratio changes, it restarts processing
+     *   from its recent input and crossfades back. The restart is
+     *   spread over the next few process() calls, each processing at
+     *   most a few times its own input, and the new ratios take
+     *   effect once it is complete.
      * 
      * The Process setting is likely to depend on your architecture:
      * non-real-time operation on seekable files: Offline; real-time
@@ -252,15 +263,18 @@ public:
      *   means using one processing thread per audio channel in
      *   offline mode if the stretcher is able to determine that more
      *   than one CPU is available, and one thread only in realtime
-     *   mode.  The R3 engine does not currently have a multi-threaded
-     *   mode, but if one is introduced in future, this option may use
-     *   it. This is the default.
+     *   mode.  In the R3 engine it means analysing and resynthesising
+     *   each FFT scale of each channel as a separate task on a pool
+     *   of threads in offline mode, if more than one CPU is
+     *   available. This is the default.
      *
      *   \li \c OptionThreadingNever - Never use more than one thread.
      *  
      *   \li \c OptionThreadingAlways - Use multiple threads in any
      *   situation where \c OptionThreadingAuto would do so, except omit
      *   the check for multiple CPUs and instead assume it to be true.
+     *   With the R3 engine this also enables the multi-threaded mode
+     *   in realtime mode.
      *
      * 7. Flags prefixed \c OptionWindow influence the window size for
      * FFT processing. In the R2 engine these affect the resulting
@@ -378,6 +392,18 @@ public:
      *   channel content, but the results may be more appropriate for
      *   many situations making use of stereo mixes.
      *
+     *   \li \c OptionChannelsLinked - May be combined with either of
+     *   the above. In the R3 engine, the classification of
+     *   transients and tonal components, and the phase guidance
+     *   derived from it, are worked out once from the combined
+     *   spectrum of all channels and shared between them, instead of
+     *   separately for each channel. This is cheaper, especially for
+     *   stereo, and keeps the channels' transient handling in step,
+     *   at the cost of some individual fidelity where the channels
+     *   differ widely. It has no effect for a stereo pair processed
+     *   with \c OptionChannelsTogether, which already analyses mid
+     *   and side, or in the R2 engine.
+     *
      * Finally, flags prefixed \c OptionStretch are obsolete flags
      * provided for backward compatibility only. They are ignored by
      * the stretcher.
@@ -386,6 +412,7 @@ public:
 
         OptionProcessOffline       = 0x00000000,
         OptionProcessRealTime      = 0x00000001,
+        OptionProcessUnityBypass   = 0x00000002,
 
         OptionStretchElastic       = 0x00000000, // obsolete
         OptionStretchPrecise       = 0x00000010, // obsolete
@@ -421,6 +448,7 @@ public:
 
         OptionChannelsApart        = 0x00000000,
         OptionChannelsTogether     = 0x10000000,
+        OptionChannelsLinked       = 0x40000000,
 
         OptionEngineFaster         = 0x00000000,
         OptionEngineFiner          = 0x20000000
@@ -57,6 +57,7 @@ enum RubberBandOption {
 
     RubberBandOptionProcessOffline       = 0x00000000,
     RubberBandOptionProcessRealTime      = 0x00000001,
+    RubberBandOptionProcessUnityBypass   = 0x00000002,
 
     RubberBandOptionStretchElastic       = 0x00000000, // obsolete
     RubberBandOptionStretchPrecise       = 0x00000010, // obsolete
@@ -92,6 +93,7 @@ enum RubberBandOption {
 
     RubberBandOptionChannelsApart        = 0x00000000,
     RubberBandOptionChannelsTogether     = 0x10000000,
+    RubberBandOptionChannelsLinked       = 0x40000000,
 
     RubberBandOptionEngineFaster         = 0x00000000,
     RubberBandOptionEngineFiner          = 0x20000000
@@ -23,8 +23,11 @@
 
 #include "faster/R2Stretcher.h"
 #include "finer/R3Stretcher.h"
+#include "common/UnityBypass.h"
 
+#include <cmath>
 #include <iostream>
+#include <memory>
 
 namespace RubberBand {
 
@@ -32,6 +35,7 @@ class RubberBandStretcher::Impl
 {
     R2Stretcher *m_r2;
     R3Stretcher *m_r3;
+    std::unique_ptr<UnityBypass> m_bypass;
 
     class CerrLogger : public RubberBandStretcher::Logger {
     public:
@@ -88,6 +92,22 @@ public:
                               makeRBLog(logger))
               : nullptr)
     {
+        if ((options & OptionProcessRealTime) &&
+            (options & OptionProcessUnityBypass)) {
+            // Half a second at unity before bypassing, and fades of
+            // 20ms either way. The delay at unity is no more than the
+            // start delay now, scaled up by any pitch scale above 1
+            size_t delay = m_r2 ? m_r2->getStartDelay()
+                : m_r3->getStartDelay();
+            m_bypass = std::unique_ptr<UnityBypass>
+                (new UnityBypass(int(channels),
+                                 int(sampleRate / 2),
+                                 int(sampleRate / 50),
+                                 int(ceil(delay * std::max
+                                          (initialPitchScale, 1.0))),
+                                 initialTimeRatio,
+                                 initialPitchScale));
+        }
     }
 
     ~Impl()
@@ -106,12 +126,30 @@ public:
     {
         if (m_r2) m_r2->reset();
         else m_r3->reset();
+        if (m_bypass) {
+            if (m_r2) m_bypass->reset(*m_r2);
+            else m_bypass->reset(*m_r3);
+        }
+    }
+
+    bool isAtUnity() const
+    {
+        if (getTimeRatio() != 1.0 || getPitchScale() != 1.0) {
+            return false;
+        }
+        double formantScale = getFormantScale();
+        return formantScale == 0.0 || formantScale == 1.0;
     }
 
     RTENTRY__
     void
     setTimeRatio(double ratio)
     {
+        if (m_bypass) {
+            if (m_r2) m_bypass->setTimeRatio(*m_r2, ratio);
+            else m_bypass->setTimeRatio(*m_r3, ratio);
+            return;
+        }
         if (m_r2) m_r2->setTimeRatio(ratio);
         else m_r3->setTimeRatio(ratio);
     }
@@ -120,6 +158,11 @@ public:
     void
     setPitchScale(double scale)
     {
+        if (m_bypass) {
+            if (m_r2) m_bypass->setPitchScale(*m_r2, scale);
+            else m_bypass->setPitchScale(*m_r3, scale);
+            return;
+        }
         if (m_r2) m_r2->setPitchScale(scale);
         else m_r3->setPitchScale(scale);
     }
@@ -136,6 +179,7 @@ public:
     double
     getTimeRatio() const
     {
+        if (m_bypass) return m_bypass->getTimeRatio();
         if (m_r2) return m_r2->getTimeRatio();
         else return m_r3->getTimeRatio();
     }
@@ -144,6 +188,7 @@ public:
     double
     getPitchScale() const
     {
+        if (m_bypass) return m_bypass->getPitchScale();
         if (m_r2) return m_r2->getPitchScale();
         else return m_r3->getPitchScale();
     }
@@ -224,6 +269,7 @@ public:
     {
         if (m_r2) m_r2->setMaxProcessSize(samples);
         else m_r3->setMaxProcessSize(samples);
+        if (m_bypass) m_bypass->setMaxProcessSize(samples);
     }
 
     void
@@ -237,6 +283,10 @@ public:
     size_t
     getSamplesRequired() const
     {
+        if (m_bypass) {
+            if (m_r2) return m_bypass->getSamplesRequired(*m_r2);
+            else return m_bypass->getSamplesRequired(*m_r3);
+        }
         if (m_r2) return m_r2->getSamplesRequired();
         else return m_r3->getSamplesRequired();
     }
@@ -254,6 +304,12 @@ public:
     process(const float *const *input, size_t samples,
             bool final)
     {
+        if (m_bypass) {
+            bool atUnity = isAtUnity();
+            if (m_r2) m_bypass->process(*m_r2, input, samples, final, atUnity);
+            else m_bypass->process(*m_r3, input, samples, final, atUnity);
+            return;
+        }
         if (m_r2) m_r2->process(input, samples, final);
         else m_r3->process(input, samples, final);
     }
@@ -262,6 +318,10 @@ public:
     int
     available() const
     {
+        if (m_bypass) {
+            if (m_r2) return m_bypass->available(*m_r2);
+            else return m_bypass->available(*m_r3);
+        }
         if (m_r2) return m_r2->available();
         else return m_r3->available();
     }
@@ -270,6 +330,10 @@ public:
     size_t
     retrieve(float *const *output, size_t samples) const
     {
+        if (m_bypass) {
+            if (m_r2) return m_bypass->retrieve(*m_r2, output, samples);
+            else return m_bypass->retrieve(*m_r3, output, samples);
+        }
         if (m_r2) return m_r2->retrieve(output, samples);
         else return m_r3->retrieve(output, samples);
     }
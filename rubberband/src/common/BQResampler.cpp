@@ -72,6 +72,14 @@ BQResampler::BQResampler(Parameters parameters, int channels) :
     }
 
     int phase_reserve = 2 * int(round(m_initial_rate));
+
+    // The phase table has an entry per input phase, i.e. per unit of
+    // the numerator of the ratio in use. If the ratio is expected to
+    // change, that can be anything up to rational_max: reserve for it
+    // here so that a ratio change never has to grow the table.
+    if (m_dynamism == RatioOftenChanging) {
+        phase_reserve = max(phase_reserve, m_qparams.rational_max + 1);
+    }
     int buffer_reserve = 1000 * m_channels;
     m_state_a.phase_info.reserve(phase_reserve);
     m_state_a.buffer.reserve(buffer_reserve);
@@ -0,0 +1,309 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Rubber Band Library
+    An audio time-stretching and pitch-shifting library.
+    Copyright 2007-2023 Particular Programs Ltd.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+
+    Alternatively, if you have a valid commercial licence for the
+    Rubber Band Library obtained by agreement with the copyright
+    holders, you may redistribute and/or modify it under the terms
+    described in that licence.
+
+    If you wish to distribute code using the Rubber Band Library
+    under terms other than those of the GNU General Public License,
+    you must obtain a valid commercial licence before doing so.
+*/
+
+
+#ifndef RUBBERBAND_MIRRORED_RINGBUFFER_H
+#define RUBBERBAND_MIRRORED_RINGBUFFER_H
+
+#include "sysutils.h"
+#include "Allocators.h"
+#include "VectorOps.h"
+
+#include <iostream>
+#include <algorithm>
+#include <atomic>
+
+namespace RubberBand {
+
+/**
+ * MirroredRingBuffer is a lock-free ring buffer for one writer and
+ * one reader, like RingBuffer, that can also return a pointer to the
+ * next samples in the buffer in place, without copying them out.
+ *
+ * To make that possible, the first few samples of the storage are
+ * duplicated just past its end as they are written, so that any run
+ * of up to the view size starting at the read pointer is contiguous
+ * in memory even where it wraps around. This costs an extra copy of
+ * those samples on each write, which for a view much shorter than
+ * the buffer is a small fraction of what copying the view out on
+ * each read would cost when the same samples are read many times
+ * over.
+ *
+ * MirroredRingBuffer is thread-safe provided only one thread writes
+ * and only one thread reads.
+ */
+template <typename T>
+class MirroredRingBuffer
+{
+public:
+    /**
+     * Create a ring buffer with room to write n samples, from which
+     * up to viewSize samples at a time may be viewed in place.
+     */
+    MirroredRingBuffer(int n, int viewSize) :
+        m_size(n + 1),
+        m_mirror(std::min(viewSize, n + 1)),
+        m_buffer(allocate_and_zero<T>(m_size + m_mirror)),
+        m_writer(0),
+        m_reader(0) { }
+
+    virtual ~MirroredRingBuffer() {
+        deallocate(m_buffer);
+    }
+
+    /**
+     * Return the total capacity of the ring buffer in samples.
+     * (This is the argument n passed to the constructor.)
+     */
+    int getSize() const {
+        return m_size - 1;
+    }
+
+    /**
+     * Return the largest number of samples that may be viewed at
+     * once.
+     */
+    int getViewSize() const {
+        return m_mirror;
+    }
+
+    /**
+     * Return a new ring buffer (allocated with "new" -- caller must
+     * delete when no longer needed) of the given size and the same
+     * view size, containing the same data as this one.  If another
+     * thread reads from or writes to this buffer during the call, the
+     * results may be incomplete or inconsistent.  If this buffer's
+     * data will not fit in the new size, the contents are undefined.
+     */
+    MirroredRingBuffer<T> *resized(int newSize) const {
+        MirroredRingBuffer<T> *newBuffer =
+            new MirroredRingBuffer<T>(newSize, m_mirror);
+        MBARRIER();
+        int w = m_writer;
+        int r = m_reader;
+        int n = readSpaceFor(w, r);
+        int here = std::min(n, m_size - r);
+        newBuffer->write(m_buffer + r, here);
+        newBuffer->write(m_buffer, n - here);
+        return newBuffer;
+    }
+
+    /**
+     * Reset read and write pointers, thus emptying the buffer.
+     * Should be called from the write thread.
+     */
+    void reset() {
+        int r = m_reader;
+        m_writer = r;
+    }
+
+    /**
+     * Return the amount of data available for reading, in samples.
+     */
+    int getReadSpace() const {
+        return readSpaceFor(m_writer, m_reader);
+    }
+
+    /**
+     * Return the amount of space available for writing, in samples.
+     */
+    int getWriteSpace() const {
+        return writeSpaceFor(m_writer, m_reader);
+    }
+
+    /**
+     * Return a pointer to the next n samples in the buffer, without
+     * advancing the read pointer. The pointer remains valid until the
+     * reader next calls skip() or reset(). If fewer than n samples
+     * are available, or n exceeds the view size, return nullptr.
+     */
+    const T *view(int n) const {
+        int w = m_writer;
+        int r = m_reader;
+        if (n > m_mirror || n > readSpaceFor(w, r)) {
+            std::cerr << "WARNING: MirroredRingBuffer::view: " << n
+                      << " requested, only " << readSpaceFor(w, r)
+                      << " available with view size " << m_mirror
+                      << std::endl;
+            return nullptr;
+        }
+        return m_buffer + r;
+    }
+
+    /**
+     * Read n samples from the buffer, if available, without advancing
+     * the read pointer.  If fewer than n are available, the remainder
+     * will be zeroed out.  Returns the number of samples actually
+     * read.
+     */
+    template <typename S>
+    int peek(S *const R__ destination, int n) const {
+        int w = m_writer;
+        int r = m_reader;
+        int available = readSpaceFor(w, r);
+        if (n > available) {
+            std::cerr << "WARNING: MirroredRingBuffer::peek: " << n
+                      << " requested, only " << available << " available"
+                      << std::endl;
+            v_zero(destination + available, n - available);
+            n = available;
+        }
+        if (n == 0) return n;
+        int here = m_size - r;
+        if (here >= n) {
+            v_convert(destination, m_buffer + r, n);
+        } else {
+            v_convert(destination, m_buffer + r, here);
+            v_convert(destination + here, m_buffer, n - here);
+        }
+        return n;
+    }
+
+    /**
+     * Pretend to read n samples from the buffer, without actually
+     * returning them (i.e. discard the next n samples).  Returns the
+     * number of samples actually available for discarding.
+     */
+    int skip(int n) {
+        int w = m_writer;
+        int r = m_reader;
+        int available = readSpaceFor(w, r);
+        if (n > available) {
+            std::cerr << "WARNING: MirroredRingBuffer::skip: " << n
+                      << " requested, only " << available << " available"
+                      << std::endl;
+            n = available;
+        }
+        if (n == 0) return n;
+        r += n;
+        while (r >= m_size) r -= m_size;
+        m_reader = r;
+        return n;
+    }
+
+    /**
+     * Write n samples to the buffer.  If insufficient space is
+     * available, not all samples may actually be written.  Returns
+     * the number of samples actually written.
+     */
+    template <typename S>
+    int write(const S *const R__ source, int n) {
+        int w = m_writer;
+        int r = m_reader;
+        int available = writeSpaceFor(w, r);
+        if (n > available) {
+            std::cerr << "WARNING: MirroredRingBuffer::write: " << n
+                      << " requested, only room for " << available
+                      << std::endl;
+            n = available;
+        }
+        if (n == 0) return n;
+        int here = m_size - w;
+        if (here >= n) {
+            v_convert<S, T>(m_buffer + w, source, n);
+            mirror(w, n);
+        } else {
+            v_convert<S, T>(m_buffer + w, source, here);
+            v_convert<S, T>(m_buffer, source + here, n - here);
+            mirror(w, here);
+            mirror(0, n - here);
+        }
+        advanceWriter(w, n);
+        return n;
+    }
+
+    /**
+     * Write n zero-value samples to the buffer.  If insufficient
+     * space is available, not all zeros may actually be written.
+     * Returns the number of zeroes actually written.
+     */
+    int zero(int n) {
+        int w = m_writer;
+        int r = m_reader;
+        int available = writeSpaceFor(w, r);
+        if (n > available) {
+            std::cerr << "WARNING: MirroredRingBuffer::zero: " << n
+                      << " requested, only room for " << available
+                      << std::endl;
+            n = available;
+        }
+        if (n == 0) return n;
+        int here = m_size - w;
+        if (here >= n) {
+            v_zero(m_buffer + w, n);
+            mirror(w, n);
+        } else {
+            v_zero(m_buffer + w, here);
+            v_zero(m_buffer, n - here);
+            mirror(w, here);
+            mirror(0, n - here);
+        }
+        advanceWriter(w, n);
+        return n;
+    }
+
+protected:
+    const int         m_size;
+    const int         m_mirror;
+    T *const R__      m_buffer;
+    std::atomic<int>  m_writer;
+    std::atomic<int>  m_reader;
+
+    int readSpaceFor(int w, int r) const {
+        int space;
+        if (w > r) space = w - r;
+        else if (w < r) space = (w + m_size) - r;
+        else space = 0;
+        return space;
+    }
+
+    int writeSpaceFor(int w, int r) const {
+        int space = (r + m_size - w - 1);
+        if (space >= m_size) space -= m_size;
+        return space;
+    }
+
+    // Duplicate whatever part of the n samples just written at index
+    // w (without wrapping) falls within the mirrored region
+    void mirror(int w, int n) {
+        if (w < m_mirror) {
+            v_copy(m_buffer + m_size + w, m_buffer + w,
+                   std::min(n, m_mirror - w));
+        }
+    }
+
+    void advanceWriter(int w, int n) {
+        w += n;
+        while (w >= m_size) w -= m_size;
+        MBARRIER();
+        m_writer = w;
+    }
+
+private:
+    MirroredRingBuffer(const MirroredRingBuffer &) =delete;
+    MirroredRingBuffer &operator=(const MirroredRingBuffer &) =delete;
+};
+
+}
+
+#endif
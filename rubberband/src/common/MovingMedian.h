@@ -216,6 +216,219 @@ private:
 
 };
 
+/**
+ * A set of moving median filters of the same length, one per bin,
+ * that all take a new value at once, as when filtering each bin of a
+ * spectrum over time. This gives the same results as a
+ * MovingMedianStack fed one bin at a time, but keeps the sorted
+ * records interleaved, with the k'th smallest value of every filter
+ * stored together, so that an update is a short series of
+ * branch-free selects across all filters that the compiler can
+ * vectorise.
+ */
+template <typename T>
+class MovingMedianBatch
+{
+public:
+    MovingMedianBatch(int nfilters, int size) :
+        m_nfilters(nfilters),
+        m_size(size),
+        m_fill(0),
+        m_next(0),
+        m_history(allocate_and_zero<T>(size_t(nfilters) * size)),
+        m_sorted(allocate_and_zero<T>(size_t(nfilters) * size)),
+        m_input(allocate_and_zero<T>(nfilters)),
+        m_column(allocate_and_zero<T>(nfilters)),
+        m_window(allocate_and_zero<T>(size))
+    { }
+
+    ~MovingMedianBatch() {
+        deallocate(m_history);
+        deallocate(m_sorted);
+        deallocate(m_input);
+        deallocate(m_column);
+        deallocate(m_window);
+    }
+
+    int getFilterCount() const {
+        return m_nfilters;
+    }
+    
+    int getSize() const {
+        return m_size;
+    }
+
+    /** Push values[i] into filter i, for every filter.
+     */
+    void push(const T *const R__ values) {
+
+        const int n = m_nfilters;
+        T *const R__ input = m_input;
+
+        // As in MovingMedian, a NaN would break the ordering, so it
+        // is taken as zero instead
+        for (int i = 0; i < n; ++i) {
+            T v = values[i];
+            input[i] = (v == v) ? v : T();
+        }
+
+        int fill = m_fill;
+        T *const R__ slot = m_history + size_t(m_next) * n;
+        
+        if (fill == m_size) {
+            
+            // Remove the oldest value, which is in the history slot
+            // we are about to reuse: everything from its first
+            // appearance onwards moves down one place
+            
+            for (int k = 0; k + 1 < fill; ++k) {
+                T *const R__ s0 = row(k);
+                const T *const R__ s1 = row(k + 1);
+                for (int i = 0; i < n; ++i) {
+                    T here = s0[i], above = s1[i];
+                    s0[i] = (here < slot[i]) ? here : above;
+                }
+            }
+            --fill;
+        }
+
+        // Insert the new value. Each place takes the greater of the
+        // value below it and the new value, unless it already holds
+        // something smaller, so this is just min and max working
+        // down from the top
+        
+        if (fill == 0) {
+            v_copy(row(0), input, n);
+        } else {
+            T *const R__ top = row(fill);
+            const T *const R__ below = row(fill - 1);
+            for (int i = 0; i < n; ++i) {
+                top[i] = (below[i] < input[i]) ? input[i] : below[i];
+            }
+            for (int k = fill - 1; k > 0; --k) {
+                T *const R__ s = row(k);
+                const T *const R__ b = row(k - 1);
+                for (int i = 0; i < n; ++i) {
+                    T shifted = (b[i] < input[i]) ? input[i] : b[i];
+                    s[i] = (shifted < s[i]) ? shifted : s[i];
+                }
+            }
+            T *const R__ bottom = row(0);
+            for (int i = 0; i < n; ++i) {
+                bottom[i] = (input[i] < bottom[i]) ? input[i] : bottom[i];
+            }
+        }
+
+        m_fill = fill + 1;
+        
+        v_copy(slot, input, n);
+        if (++m_next == m_size) m_next = 0;
+    }
+
+    /** Write the current median of each filter to medians. If a
+     *  median lies between two values, the first of them is used.
+     */
+    void get(T *const R__ medians) const {
+        if (m_fill == 0) {
+            v_zero(medians, m_nfilters);
+        } else {
+            v_copy(medians, row((m_fill - 1) / 2), m_nfilters);
+        }
+    }
+
+    void reset() {
+        // Nothing in the history or sorted rows is read before it
+        // has been written again, so there is no need to clear them
+        m_fill = 0;
+        m_next = 0;
+    }
+
+    /** Apply a moving median filter of length getSize() to the array
+     *  in of length n, writing the results to out, with the same
+     *  results as MovingMedian::filter. The array is cut into as many
+     *  contiguous pieces as there are filters in the batch, and the
+     *  pieces are filtered alongside one another. The few outputs
+     *  near either end, whose windows are cut short, are worked out
+     *  separately. Resets the batch first.
+     */
+    void filter(const T *const R__ in, T *const R__ out, int n) {
+
+        const int len = m_size;
+        const int before = len - 1 - len / 2; // window extent before and
+        const int after = len / 2;            // after each output
+        
+        int leftEnd = std::min(before, n);
+        int rightStart = std::max(leftEnd, n - after);
+        for (int i = 0; i < leftEnd; ++i) {
+            out[i] = windowMedian(in, 0, std::min(i + after, n - 1));
+        }
+        for (int i = rightStart; i < n; ++i) {
+            out[i] = windowMedian(in, std::max(i - before, 0), n - 1);
+        }
+
+        // The rest have full windows: window p runs from in[p] to
+        // in[p + len - 1] and its median goes to out[p + before]
+        
+        const int windows = n - len + 1;
+        if (windows <= 0) return;
+        
+        const int lanes = m_nfilters;
+        const int chunk = (windows + lanes - 1) / lanes;
+        T *const R__ column = m_column;
+
+        reset();
+        
+        for (int t = 0; t < chunk + len - 1; ++t) {
+            for (int c = 0; c < lanes; ++c) {
+                int ix = c * chunk + t;
+                column[c] = in[ix < n ? ix : n - 1];
+            }
+            push(column);
+            if (t < len - 1) continue;
+            const T *const R__ median = row((m_fill - 1) / 2);
+            for (int c = 0; c < lanes; ++c) {
+                int p = c * chunk + t - len + 1;
+                if (p >= windows) break;
+                out[p + before] = median[c];
+            }
+        }
+    }
+    
+private:
+    int m_nfilters;
+    int m_size;
+    int m_fill;
+    int m_next;   // history row to be written next, the oldest once full
+    T *m_history; // m_size rows of m_nfilters values, a ring of pushes
+    T *m_sorted;  // m_size rows, row k holding each filter's k'th smallest
+    T *m_input;
+    T *m_column;  // m_nfilters values, for filter()
+    T *m_window;  // m_size values, for sorting single windows
+
+    T *row(int k) const {
+        return m_sorted + size_t(k) * m_nfilters;
+    }
+
+    // Median of v[from] to v[to] inclusive, at most m_size values
+    T windowMedian(const T *v, int from, int to) {
+        int count = 0;
+        for (int i = from; i <= to; ++i) {
+            T x = v[i];
+            if (x != x) x = T();
+            int j = count++;
+            while (j > 0 && x < m_window[j-1]) {
+                m_window[j] = m_window[j-1];
+                --j;
+            }
+            m_window[j] = x;
+        }
+        return m_window[(count - 1) / 2];
+    }
+
+    MovingMedianBatch(const MovingMedianBatch &) =delete;
+    MovingMedianBatch &operator=(const MovingMedianBatch &) =delete;
+};
+
 template <typename T>
 class MovingMedianStack
 {
@@ -25,13 +25,13 @@
 
 #include <math.h>
 #include <iostream>
-#include <deque>
 #include <set>
 #include <cassert>
 #include <algorithm>
 #include <sstream>
 
 #include "sysutils.h"
+#include "WorkerPool.h"
 
 namespace RubberBand
 {
@@ -49,6 +49,7 @@ StretchCalculator::StretchCalculator(size_t sampleRate,
     m_transientAmnesty(0),
     m_debugLevel(0),
     m_useHardPeaks(useHardPeaks),
+    m_useThreads(false),
     m_inFrameCounter(0),
     m_frameCheckpoint(0, 0),
     m_outFrameCounter(0),
@@ -631,25 +632,33 @@ StretchCalculator::findPeaks(const std::vector<float> &rawDf)
     int minspacing = lrint(ceil(double(m_sampleRate) /
                                 (20 * double(m_increment)))); // 0.05 sec ish
     
-    std::deque<float> medianwin;
-    std::vector<float> sorted;
-    int softPeakAmnesty = 0;
+    // The median window slides along the curve a chunk at a time, so
+    // each position of it is a run of the values pushed onto it in
+    // turn. Trace the window through first, which is cheap, so that
+    // the costly part -- the percentile of every window -- can be
+    // found for all positions independently, in segments across
+    // threads if we have them, before the peaks are picked in order.
+
+    const size_t count = df.size();
+
+    std::vector<float> pushed;
+    std::vector<size_t> windowStart(count), windowSize(count);
 
     for (size_t i = 0; i < medianmaxsize/2; ++i) {
-        medianwin.push_back(0);
+        pushed.push_back(0);
     }
-    for (size_t i = 0; i < medianmaxsize/2 && i < df.size(); ++i) {
-        medianwin.push_back(df[i]);
+    for (size_t i = 0; i < medianmaxsize/2 && i < count; ++i) {
+        pushed.push_back(df[i]);
     }
 
-    size_t lastSoftPeak = 0;
+    size_t front = 0;
+
+    for (size_t i = 0; i < count; ++i) {
 
-    for (size_t i = 0; i < df.size(); ++i) {
-        
         size_t mediansize = medianmaxsize;
 
-        if (medianwin.size() < mediansize) {
-            mediansize = medianwin.size();
+        if (pushed.size() - front < mediansize) {
+            mediansize = pushed.size() - front;
         }
 
         size_t middle = medianmaxsize / 2;
@@ -657,34 +666,59 @@ StretchCalculator::findPeaks(const std::vector<float> &rawDf)
 
         size_t nextDf = i + mediansize - middle;
 
-        if (mediansize < 2) {
-            if (mediansize > medianmaxsize) { // absurd, but never mind that
-                medianwin.pop_front();
-            }
-            if (nextDf < df.size()) {
-                medianwin.push_back(df[nextDf]);
-            } else {
-                medianwin.push_back(0);
-            }
-            continue;
-        }
+        windowStart[i] = front;
+        windowSize[i] = mediansize;
 
-        sorted.clear();
-        for (size_t j = 0; j < mediansize; ++j) {
-            sorted.push_back(medianwin[j]);
+        if (mediansize >= medianmaxsize) {
+            ++front;
+        }
+        if (nextDf < count) {
+            pushed.push_back(df[nextDf]);
+        } else {
+            pushed.push_back(0);
         }
-        std::sort(sorted.begin(), sorted.end());
+    }
+
+    // For each position, the offset from the middle of the window to
+    // the soft peak found there, or -1 if there is none
 
-        size_t n = 90; // percentile above which we pick peaks
-        size_t index = (sorted.size() * n) / 100;
-        if (index >= sorted.size()) index = sorted.size()-1;
-        if (index == sorted.size()-1 && index > 0) --index;
-        float thresh = sorted[index];
+    std::vector<int> peakOffset(count, -1);
 
-        if (medianwin[middle] > thresh &&
-            medianwin[middle] > medianwin[middle-1] &&
-            medianwin[middle] > medianwin[middle+1] &&
-            softPeakAmnesty == 0) {
+    auto findSoftPeaks = [&](size_t from, size_t to) {
+
+        std::vector<float> sorted;
+        
+        for (size_t i = from; i < to; ++i) {
+
+            size_t mediansize = windowSize[i];
+            if (mediansize < 2) continue;
+
+            size_t middle = medianmaxsize / 2;
+            if (middle >= mediansize) middle = mediansize-1;
+
+            // When the curve is too short to fill the window past its
+            // middle, this reads the value pushed next, which is zero
+            const float *medianwin = pushed.data() + windowStart[i];
+
+            // Test for a local maximum first, as that rules out most
+            // positions without needing the percentile
+            
+            if (!(medianwin[middle] > medianwin[middle-1] &&
+                  medianwin[middle] > medianwin[middle+1])) {
+                continue;
+            }
+
+            sorted.assign(medianwin, medianwin + mediansize);
+
+            size_t n = 90; // percentile above which we pick peaks
+            size_t index = (sorted.size() * n) / 100;
+            if (index >= sorted.size()) index = sorted.size()-1;
+            if (index == sorted.size()-1 && index > 0) --index;
+            std::nth_element(sorted.begin(), sorted.begin() + index,
+                             sorted.end());
+            float thresh = sorted[index];
+
+            if (!(medianwin[middle] > thresh)) continue;
 
             size_t maxindex = middle;
             float maxval = medianwin[middle];
@@ -698,11 +732,46 @@ StretchCalculator::findPeaks(const std::vector<float> &rawDf)
                 }
             }
 
-            size_t peak = i + maxindex - middle;
+            peakOffset[i] = int(maxindex - middle);
+        }
+    };
+
+#ifndef NO_THREADING
+    const size_t segmentSize = 4096;
+    int segments = int((count + segmentSize - 1) / segmentSize);
+
+    if (m_useThreads && segments > 1) {
+        SharedWorkerPool::getInstance().run
+            (segments, [&](int s) {
+                findSoftPeaks(s * segmentSize,
+                              std::min(count, (s + 1) * segmentSize));
+            });
+    } else {
+        findSoftPeaks(0, count);
+    }
+#else
+    findSoftPeaks(0, count);
+#endif
+
+    int softPeakAmnesty = 0;
+    size_t lastSoftPeak = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+
+        size_t mediansize = windowSize[i];
+        if (mediansize < 2) continue;
+
+        if (peakOffset[i] >= 0 && softPeakAmnesty == 0) {
+
+            size_t middle = medianmaxsize / 2;
+            if (middle >= mediansize) middle = mediansize-1;
+
+            size_t peak = i + peakOffset[i];
 
             if (softPeakCandidates.empty() || lastSoftPeak != peak) {
-                m_log.log(2, "soft peak: chunk and median df", peak, medianwin[middle]);
-                if (peak >= df.size()) {
+                m_log.log(2, "soft peak: chunk and median df", peak,
+                          pushed[windowStart[i] + middle]);
+                if (peak >= count) {
                     m_log.log(2, "peak is beyond end");
                 } else {
                     softPeakCandidates.insert(peak);
@@ -710,19 +779,10 @@ StretchCalculator::findPeaks(const std::vector<float> &rawDf)
                 }
             }
 
-            softPeakAmnesty = minspacing + maxindex - middle;
+            softPeakAmnesty = minspacing + peakOffset[i];
             m_log.log(3, "amnesty", softPeakAmnesty);
 
         } else if (softPeakAmnesty > 0) --softPeakAmnesty;
-
-        if (mediansize >= medianmaxsize) {
-            medianwin.pop_front();
-        }
-        if (nextDf < df.size()) {
-            medianwin.push_back(df[nextDf]);
-        } else {
-            medianwin.push_back(0);
-        }
     }
 
     std::vector<Peak> peaks;
@@ -81,6 +81,12 @@ public:
 
     void setUseHardPeaks(bool use) { m_useHardPeaks = use; }
 
+    /**
+     * Allow calculate() to spread its peak-finding across the shared
+     * worker pool. The result is the same either way.
+     */
+    void setUseThreads(bool use) { m_useThreads = use; }
+
     void reset();
   
     void setDebugLevel(int level) { m_debugLevel = level; }
@@ -108,6 +114,7 @@ protected:
     int m_transientAmnesty; // only in RT mode; handled differently offline
     int m_debugLevel;
     bool m_useHardPeaks;
+    bool m_useThreads;
     int64_t m_inFrameCounter;
     std::pair<int64_t, int64_t> m_frameCheckpoint;
     int64_t expectedOutFrame(int64_t inFrame, double timeRatio);
@@ -0,0 +1,518 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Rubber Band Library
+    An audio time-stretching and pitch-shifting library.
+    Copyright 2007-2023 Particular Programs Ltd.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+
+    Alternatively, if you have a valid commercial licence for the
+    Rubber Band Library obtained by agreement with the copyright
+    holders, you may redistribute and/or modify it under the terms
+    described in that licence.
+
+    If you wish to distribute code using the Rubber Band Library
+    under terms other than those of the GNU General Public License,
+    you must obtain a valid commercial licence before doing so.
+*/
+
+#ifndef RUBBERBAND_UNITY_BYPASS_H
+#define RUBBERBAND_UNITY_BYPASS_H
+
+#include "Allocators.h"
+#include "VectorOps.h"
+
+#include <algorithm>
+#include <cstdint>
+
+namespace RubberBand {
+
+/**
+ * Pass-through for a real-time stretcher whose time ratio and pitch
+ * scale have both been exactly 1 for a while, so that it costs next
+ * to nothing while it has nothing to do.
+ *
+ * Every input sample is kept in a history buffer. Once the ratios
+ * have been at unity for the settling period, the stretcher's output
+ * is crossfaded into the history at the same position and the
+ * stretcher is then left idle, with the history played out at the
+ * delay the stretcher had.
+ *
+ * When the ratios move away from unity, the history carries on
+ * playing while the stretcher catches up with it, at unity, from a
+ * short way before the point the history has reached, so that its
+ * analysis and phases are warm again. The catching up is spread
+ * across process calls, each feeding the stretcher no more than a
+ * few times its own input. Ratios set by the caller from the moment
+ * the stretcher went idle are held back from it until it is done.
+ * The stretcher's output is then crossfaded back in from where the
+ * history left off.
+ *
+ * The stretcher is not reset for this, as reset() is not safe to call
+ * from a real-time thread. It simply carries on from the stale input
+ * it was last given, and everything it emits before the catching up
+ * reaches the handover point is dropped.
+ *
+ * This relies on a real-time stretcher at unity emitting output
+ * sample i from input sample i, which both engines do. The stretcher
+ * is passed in to each call, rather than held, so that one class
+ * serves either engine.
+ *
+ * The history is sized at construction for the stretcher's delay at
+ * unity, a warm-up, a fade and a couple of process calls, and grows
+ * with setMaxProcessSize(). Should the caller hold output back or
+ * send larger blocks than that, the bypass is simply left (or not
+ * entered) before the history would overflow.
+ */
+class UnityBypass
+{
+public:
+    /**
+     * Construct for a stretcher whose start delay at unity is
+     * startDelay, expecting it to be given no more than
+     * defaultProcessSize samples per process call until told
+     * otherwise through setMaxProcessSize().
+     */
+    UnityBypass(int channels, int settleLength, int fadeLength,
+                int startDelay, double timeRatio, double pitchScale) :
+        m_channels(channels),
+        m_settleLength(settleLength),
+        m_fadeLength(std::max(fadeLength, 1)),
+        m_startDelay(std::max(startDelay, 0)),
+        m_maxProcessSize(defaultProcessSize),
+        m_historySize(historySizeFor(m_maxProcessSize)),
+        m_history(allocate_channels<float>(channels, m_historySize)),
+        m_scratch(allocate_channels<float>(channels, chunkSize)),
+        m_pointers(allocate<float *>(channels)),
+        m_timeRatio(timeRatio),
+        m_pitchScale(pitchScale)
+    {
+        clear();
+    }
+
+    ~UnityBypass() {
+        deallocate(m_pointers);
+        deallocate_channels(m_scratch, m_channels);
+        deallocate_channels(m_history, m_channels);
+    }
+
+    /**
+     * Make room in the history for process calls of up to the given
+     * size. Allocates, so not for use in a real-time context.
+     */
+    void setMaxProcessSize(size_t samples) {
+        if (int64_t(samples) <= m_maxProcessSize) {
+            return;
+        }
+        m_maxProcessSize = int64_t(samples);
+        int64_t size = historySizeFor(m_maxProcessSize);
+        float **history = allocate_and_zero_channels<float>(m_channels,
+                                                            size);
+        // Keep everything still held, at the same absolute positions
+        int64_t from = std::max(m_inputCount - m_historySize, int64_t(0));
+        for (int64_t pos = from; pos < m_inputCount; ++pos) {
+            for (int c = 0; c < m_channels; ++c) {
+                history[c][pos % size] = m_history[c][pos % m_historySize];
+            }
+        }
+        deallocate_channels(m_history, m_channels);
+        m_history = history;
+        m_historySize = size;
+    }
+
+    /**
+     * Go back to plain processing, following a reset of the
+     * stretcher, which gets back any ratios that were being held.
+     */
+    template <typename S>
+    void reset(S &stretcher) {
+        if (isBypassing()) {
+            restoreRatios(stretcher);
+        }
+        clear();
+    }
+
+    bool isBypassing() const {
+        return m_state == State::Bypassing || m_state == State::Restarting;
+    }
+
+    double getTimeRatio() const {
+        return m_timeRatio;
+    }
+
+    double getPitchScale() const {
+        return m_pitchScale;
+    }
+
+    template <typename S>
+    void setTimeRatio(S &stretcher, double ratio) {
+        m_timeRatio = ratio;
+        if (!isBypassing()) {
+            stretcher.setTimeRatio(ratio);
+        }
+    }
+
+    template <typename S>
+    void setPitchScale(S &stretcher, double scale) {
+        m_pitchScale = scale;
+        if (!isBypassing()) {
+            stretcher.setPitchScale(scale);
+        }
+    }
+
+    template <typename S>
+    size_t getSamplesRequired(const S &stretcher) {
+        if (isBypassing()) {
+            // Any input gives the same amount of output straight
+            // away, but callers expect the stretcher's usual step
+            return m_lastRequired;
+        }
+        size_t required = stretcher.getSamplesRequired();
+        if (required > 0) {
+            m_lastRequired = required;
+        }
+        return required;
+    }
+
+    template <typename S>
+    void process(S &stretcher, const float *const *input, size_t samples,
+                 bool final, bool atUnity) {
+
+        if (m_state == State::Bypassing) {
+            // The history has to reach back to where the stretcher
+            // will be restarted from, and the caller may have stopped
+            // retrieving
+            int64_t oldest = std::min(m_outputCount,
+                                      m_inputCount - m_delay - warmupLimit);
+            if (!atUnity || final || wouldOverflow(oldest, samples)) {
+                beginRestart(stretcher);
+            }
+        }
+
+        if (m_state == State::Restarting) {
+            int64_t oldest = std::min(m_outputCount, m_fed);
+            if (final || wouldOverflow(oldest, samples)) {
+                // No time to spread it out: catch up with everything
+                // before this input now, and let the input itself be
+                // processed as usual below
+                catchUp(stretcher, m_inputCount - m_fed);
+                finishRestart(stretcher);
+            }
+        }
+
+        record(input, samples);
+
+        if (m_state == State::Bypassing) {
+            return;
+        }
+
+        if (m_state == State::Restarting) {
+            catchUp(stretcher, std::min(m_inputCount - m_fed,
+                                        int64_t(samples) * catchUpRatio));
+            if (m_fed == m_inputCount) {
+                finishRestart(stretcher);
+            }
+            return;
+        }
+
+        if (atUnity && !final) {
+            m_settled += samples;
+        } else {
+            m_settled = 0;
+            if (m_state == State::Entering) {
+                // Abandon the fade before it completes. The stretcher
+                // has been running all along, so its output is still
+                // good from here
+                m_state = State::Processing;
+            }
+        }
+
+        stretcher.process(input, samples, final);
+        m_stretcherIn += samples;
+
+        if (m_state == State::Processing && m_settled >= m_settleLength) {
+            int64_t pending = m_inputCount - m_outputCount;
+            if (pending + warmupLimit + m_fadeLength + chunkSize <=
+                m_historySize) {
+                m_state = State::Entering;
+                m_fadeFrom = m_outputCount;
+            }
+        }
+    }
+
+    template <typename S>
+    int available(const S &stretcher) const {
+        switch (m_state) {
+        case State::Bypassing:
+        case State::Restarting:
+            return int(m_inputCount - m_delay - m_outputCount);
+        case State::Leaving: {
+            int fromHistory = int(std::max(m_fadeFrom - m_outputCount,
+                                           int64_t(0)));
+            int fromStretcher = stretcher.available();
+            if (fromStretcher < 0) return fromStretcher;
+            int toDrop = int(std::max(m_fadeFrom - m_offset - m_stretcherOut,
+                                      int64_t(0)));
+            return fromHistory + std::max(fromStretcher - toDrop, 0);
+        }
+        default:
+            return stretcher.available();
+        }
+    }
+
+    template <typename S>
+    size_t retrieve(const S &stretcher, float *const *output, size_t samples) {
+
+        if (m_state == State::Processing) {
+            size_t got = stretcher.retrieve(output, samples);
+            m_outputCount += got;
+            m_stretcherOut += got;
+            return got;
+        }
+
+        if (isBypassing()) {
+            int n = std::min(int(samples), available(stretcher));
+            if (n <= 0) return 0;
+            readHistory(output, 0, m_outputCount, n);
+            m_outputCount += n;
+            return n;
+        }
+
+        if (m_state == State::Entering) {
+            size_t got = stretcher.retrieve(output, samples);
+            fade(output, 0, int(got), true);
+            m_outputCount += got;
+            m_stretcherOut += got;
+            if (m_outputCount >= m_fadeFrom + m_fadeLength) {
+                // The stretcher has more output ready beyond this
+                // point, but from here on the history is used instead,
+                // at the delay the stretcher has reached
+                m_delay = m_inputCount - m_outputCount -
+                    std::max(stretcher.available(), 0);
+                m_state = State::Bypassing;
+            }
+            return got;
+        }
+
+        // Leaving: whatever the history had already made available
+        // before the stretcher caught up, then the stretcher's output
+        // faded in over the history
+
+        size_t done = 0;
+        if (m_outputCount < m_fadeFrom) {
+            int n = int(std::min(int64_t(samples), m_fadeFrom - m_outputCount));
+            readHistory(output, 0, m_outputCount, n);
+            m_outputCount += n;
+            done = n;
+        }
+
+        int64_t handover = m_fadeFrom - m_offset;
+        drop(stretcher, handover);
+        if (m_stretcherOut < handover || done == samples) {
+            return done;
+        }
+
+        for (int c = 0; c < m_channels; ++c) {
+            m_pointers[c] = output[c] + done;
+        }
+        size_t got = stretcher.retrieve(m_pointers, samples - done);
+        fade(output, int(done), int(got), false);
+        m_outputCount += got;
+        m_stretcherOut += got;
+        if (m_outputCount >= m_fadeFrom + m_fadeLength) {
+            m_state = State::Processing;
+            m_settled = 0;
+        }
+        return done + got;
+    }
+
+protected:
+    enum class State {
+        Processing, // stretcher output only
+        Entering,   // stretcher output fading out to history
+        Bypassing,  // history only, stretcher idle
+        Restarting, // history only, stretcher catching up at unity
+        Leaving     // history fading out to caught-up stretcher output
+    };
+
+    static constexpr int64_t defaultProcessSize = 4096;
+    static constexpr int chunkSize = 512;
+    static constexpr int64_t warmupLimit = 8192;
+
+    // While restarting, each process call feeds the stretcher up to
+    // this many times as much history as it was given input, so that
+    // it gains on the input by all but one of them
+    static constexpr int64_t catchUpRatio = 2;
+
+    int m_channels;
+    int64_t m_settleLength;
+    int m_fadeLength;
+    int64_t m_startDelay;
+    int64_t m_maxProcessSize;
+    int64_t m_historySize; // per channel
+    float **m_history;
+    float **m_scratch;
+    float **m_pointers;
+    double m_timeRatio;    // as last set by the caller
+    double m_pitchScale;   // as last set by the caller
+    State m_state;
+    int64_t m_inputCount;  // total samples recorded
+    int64_t m_outputCount; // total samples retrieved
+    int64_t m_settled;     // input samples since last not at unity
+    int64_t m_fadeFrom;    // output position at which a fade starts
+    int64_t m_delay;       // input less output, while bypassing
+    int64_t m_stretcherIn;  // total samples given to the stretcher
+    int64_t m_stretcherOut; // total samples taken from the stretcher
+    int64_t m_offset;      // input position less stretcher position
+    int64_t m_fed;         // next input position to catch up from
+    size_t m_lastRequired;
+
+    void clear() {
+        m_state = State::Processing;
+        m_inputCount = 0;
+        m_outputCount = 0;
+        m_settled = 0;
+        m_fadeFrom = 0;
+        m_delay = 0;
+        m_stretcherIn = 0;
+        m_stretcherOut = 0;
+        m_offset = 0;
+        m_fed = 0;
+        m_lastRequired = 1;
+    }
+
+    // Enough for the stretcher's own delay, a warm-up, a fade and
+    // two process calls, one for input and one for output the caller
+    // has yet to retrieve
+    int64_t historySizeFor(int64_t maxProcessSize) const {
+        return m_startDelay + warmupLimit + m_fadeLength + chunkSize +
+            2 * maxProcessSize;
+    }
+
+    bool wouldOverflow(int64_t oldest, size_t samples) const {
+        return m_inputCount + int64_t(samples) - oldest > m_historySize;
+    }
+
+    template <typename S>
+    void restoreRatios(S &stretcher) {
+        stretcher.setTimeRatio(m_timeRatio);
+        stretcher.setPitchScale(m_pitchScale);
+    }
+
+    void record(const float *const *input, size_t samples) {
+        // Only the last m_historySize samples of an overlong block
+        // can be kept
+        int64_t skip = std::max(int64_t(samples) - m_historySize, int64_t(0));
+        m_inputCount += skip;
+        int n = int(int64_t(samples) - skip);
+        int64_t at = m_inputCount % m_historySize;
+        int first = int(std::min(int64_t(n), m_historySize - at));
+        for (int c = 0; c < m_channels; ++c) {
+            v_copy(m_history[c] + at, input[c] + skip, first);
+            if (first < n) {
+                v_copy(m_history[c], input[c] + skip + first, n - first);
+            }
+        }
+        m_inputCount += n;
+    }
+
+    void readHistory(float *const *output, int offset, int64_t from, int n) {
+        int64_t at = from % m_historySize;
+        int first = int(std::min(int64_t(n), m_historySize - at));
+        for (int c = 0; c < m_channels; ++c) {
+            v_copy(output[c] + offset, m_history[c] + at, first);
+            if (first < n) {
+                v_copy(output[c] + offset + first, m_history[c], n - first);
+            }
+        }
+    }
+
+    // Mix the history into n samples of stretcher output starting at
+    // offset, whose first sample is at m_outputCount, across the fade
+    void fade(float *const *output, int offset, int n, bool toHistory) {
+        for (int i = 0; i < n; ++i) {
+            int64_t pos = m_outputCount + i;
+            if (pos < m_fadeFrom) continue;
+            float g = 1.f;
+            if (pos < m_fadeFrom + m_fadeLength) {
+                g = float(pos - m_fadeFrom) / float(m_fadeLength);
+            }
+            if (!toHistory) g = 1.f - g;
+            int64_t at = pos % m_historySize;
+            for (int c = 0; c < m_channels; ++c) {
+                float &v = output[c][offset + i];
+                v = v * (1.f - g) + m_history[c][at] * g;
+            }
+        }
+    }
+
+    // Drop the stretcher's output up to the given stretcher output
+    // position, as much of it as is available
+    template <typename S>
+    void drop(const S &stretcher, int64_t upTo) {
+        while (m_stretcherOut < upTo) {
+            int n = int(std::min(int64_t(chunkSize), upTo - m_stretcherOut));
+            n = std::min(n, stretcher.available());
+            if (n <= 0) break;
+            n = int(stretcher.retrieve(m_scratch, n));
+            if (n <= 0) break;
+            m_stretcherOut += n;
+        }
+    }
+
+    // Point the stretcher, still at unity, at the history a warm-up's
+    // length before the first position the history has not
+    // already made available
+    template <typename S>
+    void beginRestart(S &stretcher) {
+
+        int64_t resumeAt = m_inputCount - m_delay;
+        int64_t warmup = std::min(int64_t(2 * stretcher.getStartDelay()),
+                                  int64_t(warmupLimit));
+        warmup = std::min(warmup, resumeAt);
+        warmup = std::min(warmup, m_historySize - m_delay);
+        warmup = std::max(warmup, int64_t(0));
+
+        m_fed = resumeAt - warmup;
+        m_offset = m_fed - m_stretcherIn;
+        m_state = State::Restarting;
+        m_settled = 0;
+    }
+
+    // Feed the stretcher count samples of history, dropping whatever
+    // it emits from before the point the history has reached
+    template <typename S>
+    void catchUp(S &stretcher, int64_t count) {
+        while (count > 0) {
+            int n = int(std::min(int64_t(chunkSize), count));
+            readHistory(m_scratch, 0, m_fed, n);
+            stretcher.process(m_scratch, n, false);
+            m_fed += n;
+            m_stretcherIn += n;
+            count -= n;
+            drop(stretcher, m_inputCount - m_delay - m_offset);
+        }
+    }
+
+    // The stretcher has had all the history there is: give it the
+    // caller's ratios and fade it in from where the history has got to
+    template <typename S>
+    void finishRestart(S &stretcher) {
+        restoreRatios(stretcher);
+        m_state = State::Leaving;
+        m_fadeFrom = m_inputCount - m_delay;
+        m_settled = 0;
+    }
+
+    UnityBypass(const UnityBypass &) =delete;
+    UnityBypass &operator=(const UnityBypass &) =delete;
+};
+
+}
+
+#endif
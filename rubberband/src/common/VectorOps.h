@@ -42,8 +42,39 @@
 #include <alloca.h>
 #endif
 
+// Target instruction sets, worked out here once for every file that
+// has vector specialisations. Each level implies those below it:
+// RUBBERBAND_VECTOR_OPS_AVX, then _SSE2 (with SSE4.1 floor where
+// available), then _SSE; or RUBBERBAND_VECTOR_OPS_NEON, and _NEON64
+// where there are double-precision vectors as well
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define RUBBERBAND_VECTOR_OPS_AVX 1
+#define RUBBERBAND_VECTOR_OPS_SSE2 1
+#define RUBBERBAND_VECTOR_OPS_SSE 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#ifdef __SSE4_1__
+#include <smmintrin.h>
+#endif
+#define RUBBERBAND_VECTOR_OPS_SSE2 1
+#define RUBBERBAND_VECTOR_OPS_SSE 1
+#elif defined(__SSE__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#include <xmmintrin.h>
+#define RUBBERBAND_VECTOR_OPS_SSE 1
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define RUBBERBAND_VECTOR_OPS_NEON 1
+#if defined(__aarch64__)
+#define RUBBERBAND_VECTOR_OPS_NEON64 1
+#endif
+#endif
+
 #include <cstring>
+#include <cstdint>
 #include "sysutils.h"
+#include "mathmisc.h"
 
 namespace RubberBand {
 
@@ -481,6 +512,81 @@ inline void v_multiply_and_add(double *const R__ dst,
 }
 #endif
 
+// dst[i] = dst[i] * dstGains[i] + src[i] * srcGains[i], e.g. for
+// crossfading or wet/dry mixing with per-sample gain ramps.
+
+template<typename T>
+inline void v_mix_with_gains(T *const R__ dst,
+                             const T *const R__ src,
+                             const T *const R__ dstGains,
+                             const T *const R__ srcGains,
+                             const int count)
+{
+    for (int i = 0; i < count; ++i) {
+        dst[i] = dst[i] * dstGains[i] + src[i] * srcGains[i];
+    }
+}
+
+#if defined(RUBBERBAND_VECTOR_OPS_AVX)
+template<>
+inline void v_mix_with_gains(float *const R__ dst,
+                             const float *const R__ src,
+                             const float *const R__ dstGains,
+                             const float *const R__ srcGains,
+                             const int count)
+{
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 d = _mm256_mul_ps(_mm256_loadu_ps(dst + i),
+                                 _mm256_loadu_ps(dstGains + i));
+        __m256 s = _mm256_mul_ps(_mm256_loadu_ps(src + i),
+                                 _mm256_loadu_ps(srcGains + i));
+        _mm256_storeu_ps(dst + i, _mm256_add_ps(d, s));
+    }
+    for (; i < count; ++i) {
+        dst[i] = dst[i] * dstGains[i] + src[i] * srcGains[i];
+    }
+}
+#elif defined(RUBBERBAND_VECTOR_OPS_SSE)
+template<>
+inline void v_mix_with_gains(float *const R__ dst,
+                             const float *const R__ src,
+                             const float *const R__ dstGains,
+                             const float *const R__ srcGains,
+                             const int count)
+{
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 d = _mm_mul_ps(_mm_loadu_ps(dst + i),
+                              _mm_loadu_ps(dstGains + i));
+        __m128 s = _mm_mul_ps(_mm_loadu_ps(src + i),
+                              _mm_loadu_ps(srcGains + i));
+        _mm_storeu_ps(dst + i, _mm_add_ps(d, s));
+    }
+    for (; i < count; ++i) {
+        dst[i] = dst[i] * dstGains[i] + src[i] * srcGains[i];
+    }
+}
+#elif defined(RUBBERBAND_VECTOR_OPS_NEON)
+template<>
+inline void v_mix_with_gains(float *const R__ dst,
+                             const float *const R__ src,
+                             const float *const R__ dstGains,
+                             const float *const R__ srcGains,
+                             const int count)
+{
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        float32x4_t d = vmulq_f32(vld1q_f32(dst + i), vld1q_f32(dstGains + i));
+        d = vmlaq_f32(d, vld1q_f32(src + i), vld1q_f32(srcGains + i));
+        vst1q_f32(dst + i, d);
+    }
+    for (; i < count; ++i) {
+        dst[i] = dst[i] * dstGains[i] + src[i] * srcGains[i];
+    }
+}
+#endif
+
 template<typename T>
 inline T v_sum(const T *const R__ src,
                const int count)
@@ -864,6 +970,419 @@ inline T v_mean_channels(const T *const R__ *const R__ ptr,
     return t;
 }
 
+// The per-bin arithmetic of the phase advance, in forms that can be
+// vectorised. The vector versions carry out exactly the same
+// operations as princarg() and the scalar loops, in the same order,
+// so they give the same results provided the compiler is not fusing
+// multiply-adds in the scalar code
+
+// unlocked[i] = prevOut[i] + ratio * (omega + princarg(phase[i] -
+// (prevIn[i] + omega))), where omega = omegaFactor * i, for i in
+// [from, to]
+template <typename T>
+inline void v_advance_unlocked(T *const R__ unlocked,
+                               const T *const R__ phase,
+                               const T *const R__ prevIn,
+                               const T *const R__ prevOut,
+                               const T omegaFactor,
+                               const double ratio,
+                               const int from,
+                               const int to)
+{
+    for (int i = from; i <= to; ++i) {
+        T omega = omegaFactor * T(i);
+        T expected = prevIn[i] + omega;
+        T error = princarg(phase[i] - expected);
+        T advance = ratio * (omega + error);
+        unlocked[i] = prevOut[i] + advance;
+    }
+}
+
+// ph[i] = princarg(ph[i]) for i in [from, to]
+template <typename T>
+inline void v_princarg(T *const R__ ph,
+                       const int from,
+                       const int to)
+{
+    for (int i = from; i <= to; ++i) {
+        ph[i] = princarg(ph[i]);
+    }
+}
+
+#if defined(RUBBERBAND_VECTOR_OPS_AVX)
+
+inline __m256d v_princarg_pd(__m256d a)
+{
+    const __m256d pi = _mm256_set1_pd(M_PI);
+    const __m256d m2pi = _mm256_set1_pd(-2.0 * M_PI);
+    __m256d x = _mm256_add_pd(a, pi);
+    __m256d q = _mm256_floor_pd(_mm256_div_pd(x, m2pi));
+    return _mm256_add_pd(_mm256_sub_pd(x, _mm256_mul_pd(m2pi, q)), pi);
+}
+
+template <>
+inline void v_advance_unlocked(double *const R__ unlocked,
+                               const double *const R__ phase,
+                               const double *const R__ prevIn,
+                               const double *const R__ prevOut,
+                               const double omegaFactor,
+                               const double ratio,
+                               const int from,
+                               const int to)
+{
+    const __m256d of = _mm256_set1_pd(omegaFactor);
+    const __m256d r = _mm256_set1_pd(ratio);
+    int i = from;
+    for (; i + 3 <= to; i += 4) {
+        __m256d bin = _mm256_set_pd(i + 3, i + 2, i + 1, i);
+        __m256d omega = _mm256_mul_pd(of, bin);
+        __m256d expected = _mm256_add_pd(_mm256_loadu_pd(prevIn + i), omega);
+        __m256d error = v_princarg_pd
+            (_mm256_sub_pd(_mm256_loadu_pd(phase + i), expected));
+        __m256d advance = _mm256_mul_pd(r, _mm256_add_pd(omega, error));
+        _mm256_storeu_pd(unlocked + i,
+                         _mm256_add_pd(_mm256_loadu_pd(prevOut + i), advance));
+    }
+    for (; i <= to; ++i) {
+        double omega = omegaFactor * double(i);
+        double expected = prevIn[i] + omega;
+        double error = princarg(phase[i] - expected);
+        double advance = ratio * (omega + error);
+        unlocked[i] = prevOut[i] + advance;
+    }
+}
+
+template <>
+inline void v_princarg(double *const R__ ph,
+                       const int from,
+                       const int to)
+{
+    int i = from;
+    for (; i + 3 <= to; i += 4) {
+        _mm256_storeu_pd(ph + i, v_princarg_pd(_mm256_loadu_pd(ph + i)));
+    }
+    for (; i <= to; ++i) {
+        ph[i] = princarg(ph[i]);
+    }
+}
+
+#elif defined(RUBBERBAND_VECTOR_OPS_SSE2)
+
+inline __m128d v_floor_pd(__m128d x)
+{
+#ifdef __SSE4_1__
+    return _mm_floor_pd(x);
+#else
+    // Truncate via int32 and step down where that rounded upwards.
+    // Values out of int32 range (or NaNs) don't come through this
+    // conversion intact, so those go to the library floor instead
+    const __m128d limit = _mm_set1_pd(2147483647.0);
+    const __m128d absMask = _mm_castsi128_pd
+        (_mm_set_epi32(0x7fffffff, -1, 0x7fffffff, -1));
+    if (_mm_movemask_pd(_mm_cmpnlt_pd(_mm_and_pd(x, absMask), limit))) {
+        double v[2];
+        _mm_storeu_pd(v, x);
+        return _mm_set_pd(floor(v[1]), floor(v[0]));
+    }
+    __m128d t = _mm_cvtepi32_pd(_mm_cvttpd_epi32(x));
+    return _mm_sub_pd(t, _mm_and_pd(_mm_cmpgt_pd(t, x), _mm_set1_pd(1.0)));
+#endif
+}
+
+inline __m128d v_princarg_pd(__m128d a)
+{
+    const __m128d pi = _mm_set1_pd(M_PI);
+    const __m128d m2pi = _mm_set1_pd(-2.0 * M_PI);
+    __m128d x = _mm_add_pd(a, pi);
+    __m128d q = v_floor_pd(_mm_div_pd(x, m2pi));
+    return _mm_add_pd(_mm_sub_pd(x, _mm_mul_pd(m2pi, q)), pi);
+}
+
+template <>
+inline void v_advance_unlocked(double *const R__ unlocked,
+                               const double *const R__ phase,
+                               const double *const R__ prevIn,
+                               const double *const R__ prevOut,
+                               const double omegaFactor,
+                               const double ratio,
+                               const int from,
+                               const int to)
+{
+    const __m128d of = _mm_set1_pd(omegaFactor);
+    const __m128d r = _mm_set1_pd(ratio);
+    int i = from;
+    for (; i + 1 <= to; i += 2) {
+        __m128d bin = _mm_set_pd(i + 1, i);
+        __m128d omega = _mm_mul_pd(of, bin);
+        __m128d expected = _mm_add_pd(_mm_loadu_pd(prevIn + i), omega);
+        __m128d error = v_princarg_pd
+            (_mm_sub_pd(_mm_loadu_pd(phase + i), expected));
+        __m128d advance = _mm_mul_pd(r, _mm_add_pd(omega, error));
+        _mm_storeu_pd(unlocked + i,
+                      _mm_add_pd(_mm_loadu_pd(prevOut + i), advance));
+    }
+    for (; i <= to; ++i) {
+        double omega = omegaFactor * double(i);
+        double expected = prevIn[i] + omega;
+        double error = princarg(phase[i] - expected);
+        double advance = ratio * (omega + error);
+        unlocked[i] = prevOut[i] + advance;
+    }
+}
+
+template <>
+inline void v_princarg(double *const R__ ph,
+                       const int from,
+                       const int to)
+{
+    int i = from;
+    for (; i + 1 <= to; i += 2) {
+        _mm_storeu_pd(ph + i, v_princarg_pd(_mm_loadu_pd(ph + i)));
+    }
+    for (; i <= to; ++i) {
+        ph[i] = princarg(ph[i]);
+    }
+}
+
+#elif defined(RUBBERBAND_VECTOR_OPS_NEON64)
+
+inline float64x2_t v_princarg_pd(float64x2_t a)
+{
+    const float64x2_t pi = vdupq_n_f64(M_PI);
+    const float64x2_t m2pi = vdupq_n_f64(-2.0 * M_PI);
+    float64x2_t x = vaddq_f64(a, pi);
+    float64x2_t q = vrndmq_f64(vdivq_f64(x, m2pi));
+    return vaddq_f64(vsubq_f64(x, vmulq_f64(m2pi, q)), pi);
+}
+
+template <>
+inline void v_advance_unlocked(double *const R__ unlocked,
+                               const double *const R__ phase,
+                               const double *const R__ prevIn,
+                               const double *const R__ prevOut,
+                               const double omegaFactor,
+                               const double ratio,
+                               const int from,
+                               const int to)
+{
+    const float64x2_t of = vdupq_n_f64(omegaFactor);
+    const float64x2_t r = vdupq_n_f64(ratio);
+    int i = from;
+    for (; i + 1 <= to; i += 2) {
+        const double b[2] = { double(i), double(i + 1) };
+        float64x2_t omega = vmulq_f64(of, vld1q_f64(b));
+        float64x2_t expected = vaddq_f64(vld1q_f64(prevIn + i), omega);
+        float64x2_t error = v_princarg_pd
+            (vsubq_f64(vld1q_f64(phase + i), expected));
+        float64x2_t advance = vmulq_f64(r, vaddq_f64(omega, error));
+        vst1q_f64(unlocked + i, vaddq_f64(vld1q_f64(prevOut + i), advance));
+    }
+    for (; i <= to; ++i) {
+        double omega = omegaFactor * double(i);
+        double expected = prevIn[i] + omega;
+        double error = princarg(phase[i] - expected);
+        double advance = ratio * (omega + error);
+        unlocked[i] = prevOut[i] + advance;
+    }
+}
+
+template <>
+inline void v_princarg(double *const R__ ph,
+                       const int from,
+                       const int to)
+{
+    int i = from;
+    for (; i + 1 <= to; i += 2) {
+        vst1q_f64(ph + i, v_princarg_pd(vld1q_f64(ph + i)));
+    }
+    for (; i <= to; ++i) {
+        ph[i] = princarg(ph[i]);
+    }
+}
+
+#endif
+
+// The per-bin work of the percussive curve, optionally with the high
+// frequency curve alongside. Counts the bins in [1, sz] whose
+// magnitude has risen by at least threshold since prevMag, and those
+// whose magnitude is non-zero at all, then stores mag in prevMag. If
+// withHf, also sums mag[n] * n over [0, sz] into hf. That sum is
+// accumulated in bin order, as HighFrequencyAudioCurve does it, so
+// that both give exactly the same value; everything else is
+// branch-free so that it can be vectorised.
+
+template <bool withHf, typename T>
+inline void v_count_rising_bins(const T *const R__ mag,
+                                double *const R__ prevMag,
+                                const int sz,
+                                const T threshold,
+                                const T zeroThresh,
+                                int &count,
+                                int &nonZeroCount,
+                                T &hf)
+{
+    int above = 0, nonZero = 0;
+    T result = T();
+    if (withHf) result = result + mag[0] * T(0);
+
+    for (int n = 1; n <= sz; ++n) {
+        const double prev = prevMag[n];
+        const T m = mag[n];
+        const bool nz = (m > zeroThresh);
+        const T ratio = T(m / prev);
+        above += ((prev > zeroThresh) ? (ratio >= threshold) : nz);
+        nonZero += nz;
+        if (withHf) result = result + m * T(n);
+    }
+
+    v_convert(prevMag, mag, sz + 1);
+
+    count = above;
+    nonZeroCount = nonZero;
+    if (withHf) hf = result;
+}
+
+#if defined(RUBBERBAND_VECTOR_OPS_SSE2)
+
+template <bool withHf>
+inline void v_count_rising_bins(const double *const R__ mag,
+                                double *const R__ prevMag,
+                                const int sz,
+                                const double threshold,
+                                const double zeroThresh,
+                                int &count,
+                                int &nonZeroCount,
+                                double &hf)
+{
+    const __m128d thr = _mm_set1_pd(threshold);
+    const __m128d zt = _mm_set1_pd(zeroThresh);
+    const __m128d two = _mm_set1_pd(2.0);
+    __m128d bin = _mm_set_pd(2.0, 1.0);
+    __m128i above = _mm_setzero_si128();
+    __m128i nonZero = _mm_setzero_si128();
+
+    double result = 0.0;
+    if (withHf) result = result + mag[0] * 0.0;
+
+    int n = 1;
+    for (; n + 1 <= sz; n += 2) {
+        __m128d m = _mm_loadu_pd(mag + n);
+        __m128d prev = _mm_loadu_pd(prevMag + n);
+        __m128d nz = _mm_cmpgt_pd(m, zt);
+        __m128d known = _mm_cmpgt_pd(prev, zt);
+        __m128d risen = _mm_cmpge_pd(_mm_div_pd(m, prev), thr);
+        __m128d a = _mm_or_pd(_mm_and_pd(known, risen),
+                              _mm_andnot_pd(known, nz));
+        // Each true lane is all ones, i.e. -1
+        above = _mm_sub_epi64(above, _mm_castpd_si128(a));
+        nonZero = _mm_sub_epi64(nonZero, _mm_castpd_si128(nz));
+        if (withHf) {
+            __m128d v = _mm_mul_pd(m, bin);
+            result = result + _mm_cvtsd_f64(v);
+            result = result + _mm_cvtsd_f64(_mm_unpackhi_pd(v, v));
+            bin = _mm_add_pd(bin, two);
+        }
+    }
+
+    int64_t a[2], z[2];
+    _mm_storeu_si128((__m128i *)a, above);
+    _mm_storeu_si128((__m128i *)z, nonZero);
+    count = int(a[0] + a[1]);
+    nonZeroCount = int(z[0] + z[1]);
+
+    for (; n <= sz; ++n) {
+        const double prev = prevMag[n];
+        const double m = mag[n];
+        const bool nz = (m > zeroThresh);
+        const double ratio = m / prev;
+        count += ((prev > zeroThresh) ? (ratio >= threshold) : nz);
+        nonZeroCount += nz;
+        if (withHf) result = result + m * double(n);
+    }
+
+    v_copy(prevMag, mag, sz + 1);
+
+    if (withHf) hf = result;
+}
+
+template <bool withHf>
+inline void v_count_rising_bins(const float *const R__ mag,
+                                double *const R__ prevMag,
+                                const int sz,
+                                const float threshold,
+                                const float zeroThresh,
+                                int &count,
+                                int &nonZeroCount,
+                                float &hf)
+{
+    // The ratio is taken in double precision against the previous
+    // magnitudes, then rounded to float for comparison, as in the
+    // scalar loop
+    const __m128 thr = _mm_set1_ps(threshold);
+    const __m128 zt = _mm_set1_ps(zeroThresh);
+    const __m128d ztd = _mm_set1_pd(zeroThresh);
+    const __m128 four = _mm_set1_ps(4.f);
+    __m128 bin = _mm_set_ps(4.f, 3.f, 2.f, 1.f);
+    __m128i above = _mm_setzero_si128();
+    __m128i nonZero = _mm_setzero_si128();
+
+    float result = 0.f;
+    if (withHf) result = result + mag[0] * 0.f;
+
+    int n = 1;
+    for (; n + 3 <= sz; n += 4) {
+        __m128 m = _mm_loadu_ps(mag + n);
+        __m128d m0 = _mm_cvtps_pd(m);
+        __m128d m1 = _mm_cvtps_pd(_mm_movehl_ps(m, m));
+        __m128d prev0 = _mm_loadu_pd(prevMag + n);
+        __m128d prev1 = _mm_loadu_pd(prevMag + n + 2);
+        __m128 ratio = _mm_movelh_ps(_mm_cvtpd_ps(_mm_div_pd(m0, prev0)),
+                                     _mm_cvtpd_ps(_mm_div_pd(m1, prev1)));
+        // Narrow the 64-bit comparison masks to 32-bit lanes
+        __m128 known = _mm_shuffle_ps
+            (_mm_castpd_ps(_mm_cmpgt_pd(prev0, ztd)),
+             _mm_castpd_ps(_mm_cmpgt_pd(prev1, ztd)),
+             _MM_SHUFFLE(2, 0, 2, 0));
+        __m128 nz = _mm_cmpgt_ps(m, zt);
+        __m128 risen = _mm_cmpge_ps(ratio, thr);
+        __m128 a = _mm_or_ps(_mm_and_ps(known, risen),
+                             _mm_andnot_ps(known, nz));
+        above = _mm_sub_epi32(above, _mm_castps_si128(a));
+        nonZero = _mm_sub_epi32(nonZero, _mm_castps_si128(nz));
+        if (withHf) {
+            float v[4];
+            _mm_storeu_ps(v, _mm_mul_ps(m, bin));
+            result = result + v[0];
+            result = result + v[1];
+            result = result + v[2];
+            result = result + v[3];
+            bin = _mm_add_ps(bin, four);
+        }
+    }
+
+    int32_t a[4], z[4];
+    _mm_storeu_si128((__m128i *)a, above);
+    _mm_storeu_si128((__m128i *)z, nonZero);
+    count = a[0] + a[1] + a[2] + a[3];
+    nonZeroCount = z[0] + z[1] + z[2] + z[3];
+
+    for (; n <= sz; ++n) {
+        const double prev = prevMag[n];
+        const float m = mag[n];
+        const bool nz = (m > zeroThresh);
+        const float ratio = float(m / prev);
+        count += ((prev > zeroThresh) ? (ratio >= threshold) : nz);
+        nonZeroCount += nz;
+        if (withHf) result = result + m * float(n);
+    }
+
+    v_convert(prevMag, mag, sz + 1);
+
+    if (withHf) hf = result;
+}
+
+#endif
+
 }
 
 #endif
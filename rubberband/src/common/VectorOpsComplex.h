@@ -200,6 +200,23 @@ void v_cartesian_interleaved_to_polar(T *const R__ mag,
     }
 }
 
+// As v_cartesian_to_polar, but with the magnitudes also multiplied
+// by gain, e.g. to normalise a forward FFT, in the same pass
+template<typename S, typename T> // S source, T target
+void v_cartesian_to_polar_scaled(T *const R__ mag,
+                                 T *const R__ phase,
+                                 const S *const R__ real,
+                                 const S *const R__ imag,
+                                 const T gain,
+                                 const int count)
+{
+    T m;
+    for (int i = 0; i < count; ++i) {
+        c_magphase<T>(&m, phase + i, real[i], imag[i]);
+        mag[i] = m * gain;
+    }
+}
+
 #ifdef HAVE_VDSP
 template<>
 inline void v_cartesian_to_polar(float *const R__ mag,
@@ -230,6 +247,28 @@ inline void v_cartesian_to_polar(double *const R__ mag,
     vvsqrt(mag, phase, &count); // using phase as the source
     vvatan2(phase, imag, real, &count);
 }
+template<>
+inline void v_cartesian_to_polar_scaled(float *const R__ mag,
+                                        float *const R__ phase,
+                                        const float *const R__ real,
+                                        const float *const R__ imag,
+                                        const float gain,
+                                        const int count)
+{
+    v_cartesian_to_polar(mag, phase, real, imag, count);
+    v_scale(mag, gain, count);
+}
+template<>
+inline void v_cartesian_to_polar_scaled(double *const R__ mag,
+                                        double *const R__ phase,
+                                        const double *const R__ real,
+                                        const double *const R__ imag,
+                                        const double gain,
+                                        const int count)
+{
+    v_cartesian_to_polar(mag, phase, real, imag, count);
+    v_scale(mag, gain, count);
+}
 #endif
 
 template<typename T>
@@ -255,6 +294,20 @@ void v_cartesian_to_magnitudes(T *const R__ mag,
     }
 }
 
+// As v_cartesian_to_magnitudes, but with the magnitudes also
+// multiplied by gain in the same pass
+template<typename S, typename T> // S source, T target
+void v_cartesian_to_magnitudes_scaled(T *const R__ mag,
+                                      const S *const R__ real,
+                                      const S *const R__ imag,
+                                      const T gain,
+                                      const int count)
+{
+    for (int i = 0; i < count; ++i) {
+        mag[i] = T(sqrt(real[i] * real[i] + imag[i] * imag[i])) * gain;
+    }
+}
+
 template<typename S, typename T> // S source, T target
 void v_cartesian_interleaved_to_magnitudes(T *const R__ mag,
                                            const S *const R__ src,
@@ -284,6 +337,28 @@ inline void v_cartesian_to_magnitudes(double *const R__ mag,
     ippsMagnitude_64f(real, imag, mag, count);
 }
 
+template<>
+inline void v_cartesian_to_magnitudes_scaled(float *const R__ mag,
+                                             const float *const R__ real,
+                                             const float *const R__ imag,
+                                             const float gain,
+                                             const int count)
+{
+    ippsMagnitude_32f(real, imag, mag, count);
+    v_scale(mag, gain, count);
+}
+
+template<>
+inline void v_cartesian_to_magnitudes_scaled(double *const R__ mag,
+                                             const double *const R__ real,
+                                             const double *const R__ imag,
+                                             const double gain,
+                                             const int count)
+{
+    ippsMagnitude_64f(real, imag, mag, count);
+    v_scale(mag, gain, count);
+}
+
 template<>
 inline void v_cartesian_interleaved_to_magnitudes(float *const R__ mag,
                                                   const float *const R__ src,
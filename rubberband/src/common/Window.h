@@ -82,6 +82,33 @@ public:
         v_multiply(dst, src, m_cache, m_size);
     }
 
+    // Cut from a source of another sample type, such as a float
+    // ring buffer viewed in place, converting as we go
+    template <typename S>
+    inline void cut(const S *const R__ src, T *const R__ dst) const {
+        const T *const R__ cache = m_cache;
+        for (int i = 0; i < m_size; ++i) {
+            dst[i] = T(src[i]) * cache[i];
+        }
+    }
+
+    // Cut, and exchange the two halves of the result as v_fftshift
+    // would, in the same pass
+    template <typename S>
+    inline void cutShifted(const S *const R__ src, T *const R__ dst) const {
+        const T *const R__ cache = m_cache;
+        const int hs = m_size / 2;
+        for (int i = 0; i < hs; ++i) {
+            dst[i] = T(src[i + hs]) * cache[i + hs];
+        }
+        for (int i = 0; i < hs; ++i) {
+            dst[i + hs] = T(src[i]) * cache[i];
+        }
+        if (m_size % 2) {
+            dst[m_size - 1] = T(src[m_size - 1]) * cache[m_size - 1];
+        }
+    }
+
     inline void cutAndAdd(const T *const R__ src, T *const R__ dst) const {
         v_multiply_and_add(dst, src, m_cache, m_size);
     }
@@ -0,0 +1,327 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Rubber Band Library
+    An audio time-stretching and pitch-shifting library.
+    Copyright 2007-2023 Particular Programs Ltd.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+
+    Alternatively, if you have a valid commercial licence for the
+    Rubber Band Library obtained by agreement with the copyright
+    holders, you may redistribute and/or modify it under the terms
+    described in that licence.
+
+    If you wish to distribute code using the Rubber Band Library
+    under terms other than those of the GNU General Public License,
+    you must obtain a valid commercial licence before doing so.
+*/
+
+#ifndef RUBBERBAND_WORKER_POOL_H
+#define RUBBERBAND_WORKER_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "Thread.h"
+
+namespace RubberBand {
+
+/**
+ * A process-wide set of persistent threads, shared by every caller,
+ * for running batches of independent tasks from any number of
+ * threads at once. The number of threads is fixed by the number of
+ * CPUs, so that however many stretchers are running, the total
+ * number of busy threads follows the machine rather than the work.
+ *
+ * Each call to run() publishes a batch to a single queue shared by
+ * the whole pool, from which idle threads claim tasks through the
+ * batch's own atomic counter, taking from each waiting batch in
+ * turn. There is no per-thread queue and no stealing between
+ * threads: a batch is a flat range of task indices, and the shared
+ * counter already hands each one to whichever thread asks first.
+ * The calling thread works through its own batch as well, then
+ * helps with any other batch that still has tasks to claim. Once
+ * there are none it spins, then yields, watching the batch's count
+ * of pool threads still working on it, and only if that is slow to
+ * reach zero does it park on a waiter borrowed from a preallocated
+ * set, for the last pool thread out to wake.
+ *
+ * Which thread runs which task is not defined, so tasks must not
+ * depend on one another: each should only write to data belonging
+ * to its own index. run() may take a lock and wait on a condition,
+ * so is not suitable for use in a realtime context.
+ */
+class SharedWorkerPool
+{
+public:
+    /**
+     * Return the pool for this process, starting it on first use.
+     * The pool is never destroyed, as its threads may be needed by
+     * other static objects until the very end.
+     */
+    static SharedWorkerPool &getInstance() {
+        static SharedWorkerPool *instance = new SharedWorkerPool
+            (std::max(int(std::thread::hardware_concurrency()), 2) - 1);
+        return *instance;
+    }
+
+    /**
+     * Return the number of threads in the pool, not counting any
+     * thread that calls run().
+     */
+    int getThreadCount() const {
+        return int(m_workers.size());
+    }
+
+    /**
+     * Call f(i) once for every i in [0, count), spread across the
+     * pool and the calling thread, and return when all calls have
+     * returned. f is not copied. May be called from several threads
+     * at once.
+     */
+    template <typename F>
+    void run(int count, F &&f) {
+        typedef typename std::remove_reference<F>::type Function;
+        runTasks(count, &invoke<Function>, const_cast<void *>
+                 (static_cast<const void *>(&f)));
+    }
+
+private:
+    typedef void (*TaskFunction)(void *, int);
+
+    // Somewhere for the owner of a batch to sleep until the last
+    // pool thread leaves it. Never destroyed, and reused by one
+    // batch after another
+    struct Waiter {
+        Waiter() : woken(false), condition("worker batch waiter") { }
+        bool woken;
+        Condition condition;
+    };
+
+    // Set in Batch::users by an owner that has gone to sleep on its
+    // waiter, so that the thread taking the count of actual users
+    // to zero knows to wake it
+    static const int parked = 1 << 30;
+
+    struct Batch {
+        Batch(TaskFunction f, void *c, int n) :
+            function(f), context(c), count(n),
+            next(0), users(0), link(nullptr), waiter(nullptr) { }
+        TaskFunction function;
+        void *context;
+        int count;
+        std::atomic<int> next;  // next task index to be claimed
+        std::atomic<int> users; // pool threads working on it, | parked
+        Batch *link;            // next in the queue
+        Waiter *waiter;         // set by the owner before it parks
+    };
+
+    SharedWorkerPool(int threads) :
+        m_queue(nullptr),
+        m_available("shared worker pool")
+    {
+#ifndef NO_THREADING
+        for (int i = 0; i < threads; ++i) {
+            m_workers.push_back(new Worker(this));
+        }
+        // Enough for one parked caller per CPU before any more need
+        // to be made
+        for (int i = 0; i <= threads; ++i) {
+            m_waiters.push_back(new Waiter);
+        }
+        for (auto w : m_workers) {
+            w->start();
+        }
+#else
+        (void)threads;
+#endif
+    }
+
+    SharedWorkerPool(const SharedWorkerPool &) =delete;
+    SharedWorkerPool &operator=(const SharedWorkerPool &) =delete;
+
+    template <typename F>
+    static void invoke(void *f, int i) {
+        (*static_cast<F *>(f))(i);
+    }
+
+    void runTasks(int count, TaskFunction function, void *context) {
+
+        if (count <= 0) return;
+
+        if (m_workers.empty() || count == 1) {
+            for (int i = 0; i < count; ++i) {
+                function(context, i);
+            }
+            return;
+        }
+
+        Batch batch(function, context, count);
+
+        m_available.lock();
+        batch.link = m_queue;
+        m_queue = &batch;
+        int wanted = std::min(count - 1, int(m_workers.size()));
+        for (int i = 0; i < wanted; ++i) {
+            m_available.signal();
+        }
+        m_available.unlock();
+
+        work(&batch);
+
+        // Every task has now been claimed, so no thread that has not
+        // already joined the batch will find anything in it, and the
+        // count of users can only fall. Lend a hand elsewhere while
+        // there is anything left to help with, then wait for that
+        // count to reach zero
+
+        while (batch.users.load(std::memory_order_acquire) > 0) {
+            m_available.lock();
+            Batch *other = claim();
+            m_available.unlock();
+            if (!other) break;
+            work(other);
+            leave(other);
+        }
+
+        if (!finished(batch)) {
+            park(batch);
+        }
+
+        m_available.lock();
+        Batch **b = &m_queue;
+        while (*b != &batch) b = &(*b)->link;
+        *b = batch.link;
+        if (batch.waiter) {
+            m_waiters.push_back(batch.waiter);
+        }
+        m_available.unlock();
+    }
+
+    // Return true if the pool threads that joined our batch leave it
+    // within a short spin and a few yields. These are usually in the
+    // middle of their last task, which is about as long as one of
+    // ours, so this is the common way out
+    static bool finished(const Batch &batch) {
+        for (int i = 0; i < 1000; ++i) {
+            if (batch.users.load(std::memory_order_acquire) == 0) {
+                return true;
+            }
+        }
+        for (int i = 0; i < 20; ++i) {
+            std::this_thread::yield();
+            if (batch.users.load(std::memory_order_acquire) == 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Sleep until the last pool thread leaves our batch. If the
+    // count reaches zero before the parked flag goes in, nobody will
+    // wake us and we need not wait; otherwise exactly one thread
+    // will, and we must not return before it has done so, as it
+    // still refers to the batch
+    void park(Batch &batch) {
+        m_available.lock();
+        if (m_waiters.empty()) {
+            m_waiters.push_back(new Waiter);
+        }
+        batch.waiter = m_waiters.back();
+        m_waiters.pop_back();
+        m_available.unlock();
+
+        if (batch.users.fetch_or(parked, std::memory_order_acq_rel) == 0) {
+            return;
+        }
+
+        Waiter *w = batch.waiter;
+        w->condition.lock();
+        while (!w->woken) {
+            w->condition.wait();
+        }
+        w->woken = false;
+        w->condition.unlock();
+    }
+
+    // Find a queued batch with tasks left to claim, and join it.
+    // Call with m_available locked. The batch found is moved to the
+    // back of the queue, so that concurrent batches take turns
+    Batch *claim() {
+        Batch **b = &m_queue;
+        while (*b && (*b)->next >= (*b)->count) b = &(*b)->link;
+        Batch *found = *b;
+        if (!found) return nullptr;
+        ++found->users;
+        if (found->link) {
+            *b = found->link;
+            Batch **end = b;
+            while (*end) end = &(*end)->link;
+            *end = found;
+            found->link = nullptr;
+        }
+        return found;
+    }
+
+    static void work(Batch *batch) {
+        int i;
+        while ((i = batch->next++) < batch->count) {
+            batch->function(batch->context, i);
+        }
+    }
+
+    // Stop using a batch joined through claim(). Nothing may touch
+    // the batch after the count falls, as its owner may then return
+    // and destroy it, unless the owner is parked: then it waits for
+    // us to wake it, and only we can do so
+    static void leave(Batch *batch) {
+        if (batch->users.fetch_sub(1, std::memory_order_acq_rel) ==
+            (parked | 1)) {
+            Waiter *w = batch->waiter;
+            w->condition.lock();
+            w->woken = true;
+            w->condition.signal();
+            w->condition.unlock();
+        }
+    }
+
+    class Worker : public Thread
+    {
+    public:
+        Worker(SharedWorkerPool *pool) : m_pool(pool) { }
+
+        void run() override {
+            while (true) {
+                m_pool->m_available.lock();
+                Batch *batch = nullptr;
+                while (!(batch = m_pool->claim())) {
+                    m_pool->m_available.wait();
+                }
+                m_pool->m_available.unlock();
+                work(batch);
+                leave(batch);
+            }
+        }
+
+    private:
+        SharedWorkerPool *m_pool;
+    };
+
+    std::vector<Worker *> m_workers;
+    std::vector<Waiter *> m_waiters; // not in use by any batch
+    Batch *m_queue; // batches not yet finished with, newest first
+    Condition m_available;
+};
+
+}
+
+#endif
@@ -31,7 +31,7 @@
 namespace RubberBand
 {
 
-class CompoundAudioCurve : public AudioCurveCalculator
+class CompoundAudioCurve final : public AudioCurveCalculator
 {
 public:
     CompoundAudioCurve(Parameters parameters);
@@ -28,9 +28,16 @@
 
 #include <cmath>
 #include <iostream>
+
 namespace RubberBand
 {
 
+// 3dB rise in square of magnitude
+static const float thresholdFloat = powf(10.f, 0.15f);
+static const double thresholdDouble = pow(10., 0.15);
+
+static const float zeroThreshFloat = powf(10.f, -8);
+static const double zeroThreshDouble = pow(10., -8);
 
 PercussiveAudioCurve::PercussiveAudioCurve(Parameters parameters) :
     AudioCurveCalculator(parameters)
@@ -60,24 +67,12 @@ PercussiveAudioCurve::setFftSize(int newSize)
 float
 PercussiveAudioCurve::processFloat(const float *R__ mag, int)
 {
-    static float threshold = powf(10.f, 0.15f); // 3dB rise in square of magnitude
-    static float zeroThresh = powf(10.f, -8);
-
-    int count = 0;
-    int nonZeroCount = 0;
-
-    const int sz = m_lastPerceivedBin;
-
-    for (int n = 1; n <= sz; ++n) {
-        float v = 0.f;
-        if (m_prevMag[n] > zeroThresh) v = mag[n] / m_prevMag[n];
-        else if (mag[n] > zeroThresh) v = threshold;
-        bool above = (v >= threshold);
-        if (above) ++count;
-        if (mag[n] > zeroThresh) ++nonZeroCount;
-    }
+    int count = 0, nonZeroCount = 0;
+    float hf = 0.f;
 
-    v_convert(m_prevMag, mag, sz + 1);
+    v_count_rising_bins<false>(mag, m_prevMag, m_lastPerceivedBin,
+                               thresholdFloat, zeroThreshFloat,
+                               count, nonZeroCount, hf);
 
     if (nonZeroCount == 0) return 0;
     else return float(count) / float(nonZeroCount);
@@ -86,24 +81,38 @@ PercussiveAudioCurve::processFloat(const float *R__ mag, int)
 double
 PercussiveAudioCurve::processDouble(const double *R__ mag, int)
 {
-    static double threshold = pow(10., 0.15); // 3dB rise in square of magnitude
-    static double zeroThresh = pow(10., -8);
+    int count = 0, nonZeroCount = 0;
+    double hf = 0.0;
+
+    v_count_rising_bins<false>(mag, m_prevMag, m_lastPerceivedBin,
+                               thresholdDouble, zeroThreshDouble,
+                               count, nonZeroCount, hf);
+
+    if (nonZeroCount == 0) return 0;
+    else return double(count) / double(nonZeroCount);
+}
+
+float
+PercussiveAudioCurve::processWithHighFrequency(const float *R__ mag, float &hf)
+{
+    int count = 0, nonZeroCount = 0;
 
-    int count = 0;
-    int nonZeroCount = 0;
+    v_count_rising_bins<true>(mag, m_prevMag, m_lastPerceivedBin,
+                              thresholdFloat, zeroThreshFloat,
+                              count, nonZeroCount, hf);
 
-    const int sz = m_lastPerceivedBin;
+    if (nonZeroCount == 0) return 0;
+    else return float(count) / float(nonZeroCount);
+}
 
-    for (int n = 1; n <= sz; ++n) {
-        double v = 0.0;
-        if (m_prevMag[n] > zeroThresh) v = mag[n] / m_prevMag[n];
-        else if (mag[n] > zeroThresh) v = threshold;
-        bool above = (v >= threshold);
-        if (above) ++count;
-        if (mag[n] > zeroThresh) ++nonZeroCount;
-    }
+double
+PercussiveAudioCurve::processWithHighFrequency(const double *R__ mag, double &hf)
+{
+    int count = 0, nonZeroCount = 0;
 
-    v_copy(m_prevMag, mag, sz + 1);
+    v_count_rising_bins<true>(mag, m_prevMag, m_lastPerceivedBin,
+                              thresholdDouble, zeroThreshDouble,
+                              count, nonZeroCount, hf);
 
     if (nonZeroCount == 0) return 0;
     else return double(count) / double(nonZeroCount);
@@ -41,6 +41,19 @@ public:
     virtual float processFloat(const float *R__ mag, int increment);
     virtual double processDouble(const double *R__ mag, int increment);
 
+    /**
+     * Process as processFloat, also returning through hf the value
+     * HighFrequencyAudioCurve would return for the same magnitudes,
+     * calculated in the same pass over them.
+     */
+    float processWithHighFrequency(const float *R__ mag, float &hf);
+
+    /**
+     * Process as processDouble, also returning through hf the value
+     * HighFrequencyAudioCurve would return for the same magnitudes,
+     * calculated in the same pass over them.
+     */
+    double processWithHighFrequency(const double *R__ mag, double &hf);
 
     virtual void reset();
     virtual const char *getUnit() const { return "bin/total"; }
@@ -55,6 +55,9 @@ R2Stretcher::m_defaultIncrement = 256;
 const size_t
 R2Stretcher::m_defaultFftSize = 2048;
 
+const size_t
+R2Stretcher::m_studyBatchSize = 256;
+
 R2Stretcher::R2Stretcher(size_t sampleRate,
                          size_t channels,
                          RubberBandStretcher::Options options,
@@ -74,6 +77,7 @@ R2Stretcher::R2Stretcher(size_t sampleRate,
     m_expectedInputDuration(0),
 #ifndef NO_THREADING
     m_threaded(false),
+    m_threadedStudy(false),
 #endif
     m_realtime(false),
     m_options(options),
@@ -83,9 +87,7 @@ R2Stretcher::R2Stretcher(size_t sampleRate,
     m_afilter(0),
     m_swindow(0),
     m_studyFFT(0),
-#ifndef NO_THREADING
-    m_spaceAvailable("space"),
-#endif
+    m_studyPending(0),
     m_inputDuration(0),
     m_detectorType(CompoundAudioCurve::CompoundDetector),
     m_silentHistory(0),
@@ -154,6 +156,16 @@ R2Stretcher::R2Stretcher(size_t sampleRate,
             m_log.log(1, "Going multithreaded...");
         }
     }
+
+    // Studying analyses a mixdown, in chunks that are independent
+    // until they reach the audio curves, so it can use threads even
+    // for a single channel
+    if (!m_realtime &&
+        !(m_options & RubberBandStretcher::OptionThreadingNever) &&
+        ((m_options & RubberBandStretcher::OptionThreadingAlways) ||
+         system_is_multiprocessor())) {
+        m_threadedStudy = true;
+    }
 #endif
 
     configure();
@@ -161,19 +173,6 @@ R2Stretcher::R2Stretcher(size_t sampleRate,
 
 R2Stretcher::~R2Stretcher()
 {
-#ifndef NO_THREADING
-    if (m_threaded) {
-        MutexLocker locker(&m_threadSetMutex);
-        for (set<ProcessThread *>::iterator i = m_threadSet.begin();
-             i != m_threadSet.end(); ++i) {
-            m_log.log(1, "RubberBandStretcher::~RubberBandStretcher: joining for channel", (*i)->channel());
-            (*i)->abandon();
-            (*i)->wait();
-            delete *i;
-        }
-    }
-#endif
-
     for (size_t c = 0; c < m_channels; ++c) {
         delete m_channelData[c];
     }
@@ -182,6 +181,9 @@ R2Stretcher::~R2Stretcher()
     delete m_silentAudioCurve;
     delete m_stretchCalculator;
     delete m_studyFFT;
+    for (size_t i = 0; i < m_studyFFTs.size(); ++i) {
+        delete m_studyFFTs[i];
+    }
 
     for (map<size_t, Window<float> *>::iterator i = m_windows.begin();
          i != m_windows.end(); ++i) {
@@ -196,20 +198,6 @@ R2Stretcher::~R2Stretcher()
 void
 R2Stretcher::reset()
 {
-#ifndef NO_THREADING
-    if (m_threaded) {
-        m_threadSetMutex.lock();
-        for (set<ProcessThread *>::iterator i = m_threadSet.begin();
-             i != m_threadSet.end(); ++i) {
-            m_log.log(1, "RubberBandStretcher::~RubberBandStretcher: joining for channel", (*i)->channel());
-            (*i)->abandon();
-            (*i)->wait();
-            delete *i;
-        }
-        m_threadSet.clear();
-    }
-#endif
-
     m_emergencyScavenger.scavenge();
 
     if (m_stretchCalculator) {
@@ -227,10 +215,7 @@ R2Stretcher::reset()
     m_maxProcessSize = 0;
     m_inputDuration = 0;
     m_silentHistory = 0;
-
-#ifndef NO_THREADING
-    if (m_threaded) m_threadSetMutex.unlock();
-#endif
+    m_studyPending = 0;
 
     reconfigure();
 }
@@ -536,16 +521,6 @@ R2Stretcher::calculateSizes()
         // This headroom is so as to try to avoid reallocation when
         // the pitch scale changes
         m_outbufSize = m_outbufSize * 16;
-    } else {
-#ifndef NO_THREADING
-        if (m_threaded) {
-            // This headroom is to permit the processing threads to
-            // run ahead of the buffer output drainage; the exact
-            // amount of headroom is a question of tuning rather than
-            // results
-            m_outbufSize = m_outbufSize * 16;
-        }
-#endif
     }
 
     m_log.log(1, "calculateSizes: outbuf size", m_outbufSize);
@@ -640,6 +615,27 @@ R2Stretcher::configure()
         m_studyFFT->initFloat();
     }
 
+#ifndef NO_THREADING
+    if (m_threadedStudy) {
+        if (fftSizeChanged || m_studyFFTs.empty()) {
+            for (size_t i = 0; i < m_studyFFTs.size(); ++i) {
+                delete m_studyFFTs[i];
+            }
+            m_studyFFTs.clear();
+            int segments =
+                SharedWorkerPool::getInstance().getThreadCount() + 1;
+            for (int i = 0; i < segments; ++i) {
+                m_studyFFTs.push_back(new FFT(m_fftSize));
+                m_studyFFTs[i]->initFloat();
+            }
+        }
+        m_studyFrames.resize(m_studyBatchSize *
+                             std::max(m_aWindowSize, m_fftSize));
+        m_studyMags.resize(m_studyBatchSize * (m_fftSize/2 + 1));
+        m_studyPending = 0;
+    }
+#endif
+
     if (m_pitchScale != 1.0 ||
         (m_options & RubberBandStretcher::OptionPitchHighConsistency) ||
         m_realtime) {
@@ -693,6 +689,9 @@ R2Stretcher::configure()
          m_log);
 
     m_stretchCalculator->setDebugLevel(m_log.getDebugLevel());
+#ifndef NO_THREADING
+    m_stretchCalculator->setUseThreads(m_threadedStudy);
+#endif
     m_inputDuration = 0;
 
     // Prepare the inbufs with half a chunk of emptiness.  The centre
@@ -987,6 +986,11 @@ R2Stretcher::study(const float *const *input, size_t samples, bool final)
         mixdown = input[0];
     }
 
+    // Used when we need to fold or zero-pad the windowed chunk, as
+    // this can't be done in place
+    float *tmp = (float *)alloca
+        (std::max(m_fftSize, m_aWindowSize) * sizeof(float));
+
     while (consumed < samples) {
 
 	size_t writable = inbuf.getWriteSpace();
@@ -1009,59 +1013,40 @@ R2Stretcher::study(const float *const *input, size_t samples, bool final)
 	    // them for processing, and then skip m_increment to
 	    // advance the read pointer.
 
-            // cd.accumulator is not otherwise used during studying,
-            // so we can use it as a temporary buffer here
-
             size_t ready = inbuf.getReadSpace();
             assert(final || ready >= m_aWindowSize);
-            inbuf.peek(cd.accumulator, std::min(ready, m_aWindowSize));
-
-            if (m_aWindowSize == m_fftSize) {
 
-                // We don't need the fftshift for studying, as we're
-                // only interested in magnitude.
-
-                m_awindow->cut(cd.accumulator);
-
-            } else {
-
-                // If we need to fold (i.e. if the window size is
-                // greater than the fft size so we are doing a
-                // time-aliased presum fft) or zero-pad, then we might
-                // as well use our standard function for it.  This
-                // means we retain the m_afilter cut if folding as well,
-                // which is good for consistency with real-time mode.
-                // We get fftshift as well, which we don't want, but
-                // the penalty is nominal.
-
-                // Note that we can't do this in-place.  Pity
-
-                float *tmp = (float *)alloca
-                    (std::max(m_fftSize, m_aWindowSize) * sizeof(float));
-
-                if (m_aWindowSize > m_fftSize) {
-                    m_afilter->cut(cd.accumulator);
+#ifndef NO_THREADING
+            if (m_threadedStudy) {
+                if (ready >= m_aWindowSize) {
+                    // Hold the chunk back to be analysed along with
+                    // others in parallel
+                    if (m_studyPending == m_studyBatchSize) {
+                        studyPendingChunks();
+                    }
+                    size_t frameSize = std::max(m_aWindowSize, m_fftSize);
+                    inbuf.peek(&m_studyFrames[m_studyPending * frameSize],
+                               m_aWindowSize);
+                    ++m_studyPending;
+                    m_inputDuration += m_increment;
+                    inbuf.skip(m_increment);
+                    continue;
                 }
-
-                cutShiftAndFold(tmp, m_fftSize, cd.accumulator, m_awindow);
-                v_copy(cd.accumulator, tmp, m_fftSize);
+                // A short chunk at the end follows on from the
+                // chunks before it (see below)
+                studyPendingChunks();
             }
+#endif
+            
+            // cd.accumulator is not otherwise used during studying,
+            // so we can use it as a temporary buffer here. Note that
+            // a short chunk at the end leaves the rest of the buffer
+            // as the previous chunk had it
 
-            m_studyFFT->forwardMagnitude(cd.accumulator, cd.fltbuf);
-
-            float df = m_phaseResetAudioCurve->processFloat(cd.fltbuf, m_increment);
-            m_phaseResetDf.push_back(df);
-
-//            cout << m_phaseResetDf.size() << " [" << final << "] -> " << df << " \t: ";
-
-            df = m_silentAudioCurve->processFloat(cd.fltbuf, m_increment);
-            bool silent = (df > 0.f);
-            if (silent) {
-                m_log.log(2, "silence at", m_inputDuration);
-            }
-            m_silence.push_back(silent);
+            inbuf.peek(cd.accumulator, std::min(ready, m_aWindowSize));
 
-//            cout << df << endl;
+            studyChunk(cd.accumulator, tmp, m_studyFFT, cd.fltbuf);
+            studyCurves(cd.fltbuf);
 
             // We have augmented the input by m_aWindowSize/2 so that
             // the first chunk is centred on the first audio sample.
@@ -1075,6 +1060,14 @@ R2Stretcher::study(const float *const *input, size_t samples, bool final)
 	}
     }
 
+#ifndef NO_THREADING
+    // Chunks are only held back within a single call, so that
+    // everything passed to study() has been studied when it returns
+    if (m_threadedStudy) {
+        studyPendingChunks();
+    }
+#endif
+
     if (final) {
         int rs = inbuf.getReadSpace();
         m_inputDuration += rs;
@@ -1086,6 +1079,103 @@ R2Stretcher::study(const float *const *input, size_t samples, bool final)
     if (m_channels > 1 || final) delete[] mdalloc;
 }
 
+void
+R2Stretcher::studyChunk(float *frame, float *tmp, FFT *fft, float *mag)
+{
+    // frame holds m_aWindowSize samples and has room for the FFT
+    // size if that is larger; tmp has room for both
+
+    if (m_aWindowSize == m_fftSize) {
+
+        // We don't need the fftshift for studying, as we're
+        // only interested in magnitude.
+
+        m_awindow->cut(frame);
+
+    } else {
+
+        // If we need to fold (i.e. if the window size is
+        // greater than the fft size so we are doing a
+        // time-aliased presum fft) or zero-pad, then we might
+        // as well use our standard function for it.  This
+        // means we retain the m_afilter cut if folding as well,
+        // which is good for consistency with real-time mode.
+        // We get fftshift as well, which we don't want, but
+        // the penalty is nominal.
+
+        // Note that we can't do this in-place.  Pity
+
+        if (m_aWindowSize > m_fftSize) {
+            m_afilter->cut(frame);
+        }
+
+        cutShiftAndFold(tmp, m_fftSize, frame, m_awindow);
+        v_copy(frame, tmp, m_fftSize);
+    }
+
+    fft->forwardMagnitude(frame, mag);
+}
+
+void
+R2Stretcher::studyCurves(const float *mag)
+{
+    float df = m_phaseResetAudioCurve->processFloat(mag, m_increment);
+    m_phaseResetDf.push_back(df);
+
+    df = m_silentAudioCurve->processFloat(mag, m_increment);
+    bool silent = (df > 0.f);
+    if (silent) {
+        m_log.log(2, "silence at", double(m_silence.size() * m_increment));
+    }
+    m_silence.push_back(silent);
+}
+
+void
+R2Stretcher::studyPendingChunks()
+{
+#ifndef NO_THREADING
+    if (m_studyPending == 0) return;
+
+    Profiler profiler("R2Stretcher::studyPendingChunks");
+
+    const size_t pending = m_studyPending;
+    const size_t frameSize = std::max(m_aWindowSize, m_fftSize);
+    const size_t magSize = m_fftSize/2 + 1;
+    const int segments = int(m_studyFFTs.size());
+
+    m_log.log(2, "studying held-back chunks", pending);
+    
+    // Each segment of consecutive chunks is windowed and transformed
+    // with its own FFT, in the process-wide worker pool. The audio
+    // curves carry state from one chunk to the next, so they are
+    // then run over the magnitudes in order, as if each chunk had
+    // been studied as it arrived
+
+    auto studySegment = [&](int s) {
+        std::vector<float> tmp(frameSize);
+        size_t from = (pending * s) / segments;
+        size_t to = (pending * (s + 1)) / segments;
+        for (size_t i = from; i < to; ++i) {
+            studyChunk(&m_studyFrames[i * frameSize], tmp.data(),
+                       m_studyFFTs[s], &m_studyMags[i * magSize]);
+        }
+    };
+
+    SharedWorkerPool::getInstance().run(segments, studySegment);
+
+    for (size_t i = 0; i < pending; ++i) {
+        studyCurves(&m_studyMags[i * magSize]);
+    }
+
+    // A short chunk at the end of the input is studied in
+    // cd.accumulator, over what the previous chunk left there
+    v_copy(m_channelData[0]->accumulator,
+           &m_studyFrames[(pending - 1) * frameSize], int(frameSize));
+
+    m_studyPending = 0;
+#endif
+}
+
 vector<int>
 R2Stretcher::getOutputIncrements() const
 {
@@ -1259,20 +1349,6 @@ R2Stretcher::process(const float *const *input, size_t samples, bool final)
             }
         }
 
-#ifndef NO_THREADING
-        if (m_threaded) {
-            MutexLocker locker(&m_threadSetMutex);
-
-            for (size_t c = 0; c < m_channels; ++c) {
-                ProcessThread *thread = new ProcessThread(this, c);
-                m_threadSet.insert(thread);
-                thread->start();
-            }
-
-            m_log.log(1, "created threads", m_channels);
-        }
-#endif
-        
         m_mode = Processing;
     }
 
@@ -1287,9 +1363,9 @@ R2Stretcher::process(const float *const *input, size_t samples, bool final)
 
         // In a threaded mode, our "consumed" counters only indicate
         // the number of samples that have been taken into the input
-        // ring buffers waiting to be processed by the process thread.
-        // In non-threaded mode, "consumed" counts the number that
-        // have actually been processed.
+        // ring buffers, which are then processed for all channels at
+        // once below. In non-threaded mode, "consumed" counts the
+        // number that have actually been processed.
 
         allConsumed = true;
 
@@ -1326,20 +1402,16 @@ R2Stretcher::process(const float *const *input, size_t samples, bool final)
             // When running in real time, we need to process both
             // channels in step because we will need to use the sum of
             // their frequency domain representations as the input to
-            // the realtime onset detector
-            processOneChunk();
+            // the realtime onset detector. Take every chunk the input
+            // so far allows, so that a long process block does not
+            // leave a backlog to be worked off one chunk per call
+            if (processReadyChunks() == 0) {
+                processOneChunk();
+            }
         }
 #ifndef NO_THREADING
         if (m_threaded) {
-            for (ThreadSet::iterator i = m_threadSet.begin();
-                 i != m_threadSet.end(); ++i) {
-                (*i)->signalDataAvailable();
-            }
-            m_spaceAvailable.lock();
-            if (!allConsumed) {
-                m_spaceAvailable.wait(500);
-            }
-            m_spaceAvailable.unlock();
+            processChunksForChannels(false);
         }
 #endif
 
@@ -29,11 +29,13 @@
 #include "../common/RingBuffer.h"
 #include "../common/Scavenger.h"
 #include "../common/Thread.h"
+#include "../common/WorkerPool.h"
 #include "../common/Log.h"
 #include "../common/sysutils.h"
 
 #include "SincWindow.h"
 #include "CompoundAudioCurve.h"
+#include "SilentAudioCurve.h"
 
 #include "../../rubberband/RubberBandStretcher.h"
 
@@ -43,7 +45,6 @@
 namespace RubberBand
 {
 
-class AudioCurveCalculator;
 class StretchCalculator;
 
 class R2Stretcher
@@ -111,15 +112,21 @@ protected:
     size_t consumeChannel(size_t channel, const float *const *inputs,
                           size_t offset, size_t samples, bool final);
     void processChunks(size_t channel, bool &any, bool &last);
+    void processChunksForChannels(bool onlyWithInput); // offline
     bool processOneChunk(); // across all channels, for real time use
+    size_t processReadyChunks(); // every full hop, for real time use
     bool processChunkForChannel(size_t channel, size_t phaseIncrement,
                                 size_t shiftIncrement, bool phaseReset);
     bool testInbufReadSpace(size_t channel);
-    void calculateIncrements(size_t &phaseIncrement,
+    void calculateIncrements(const process_t *const *mags, // per channel
+                             size_t &phaseIncrement,
                              size_t &shiftIncrement, bool &phaseReset);
     bool getIncrements(size_t channel, size_t &phaseIncrement,
                        size_t &shiftIncrement, bool &phaseReset);
     void analyseChunk(size_t channel);
+    void studyChunk(float *frame, float *tmp, FFT *fft, float *mag);
+    void studyCurves(const float *mag);
+    void studyPendingChunks(); // threaded offline study
     void modifyChunk(size_t channel, size_t outputIncrement, bool phaseReset);
     void formantShiftChunk(size_t channel);
     void synthesiseChunk(size_t channel, size_t shiftIncrement);
@@ -170,6 +177,7 @@ protected:
 
 #ifndef NO_THREADING    
     bool m_threaded;
+    bool m_threadedStudy; // across time, so also for a single channel
 #endif
 
     bool m_realtime;
@@ -192,28 +200,16 @@ protected:
     Window<float> *m_swindow;
     FFT *m_studyFFT;
 
-#ifndef NO_THREADING
-    Condition m_spaceAvailable;
-    
-    class ProcessThread : public Thread
-    {
-    public:
-        ProcessThread(R2Stretcher *s, size_t c);
-        void run();
-        void signalDataAvailable();
-        void abandon();
-        size_t channel() { return m_channel; }
-    private:
-        R2Stretcher *m_s;
-        size_t m_channel;
-        Condition m_dataAvailable;
-        bool m_abandoning;
-    };
-
-    mutable Mutex m_threadSetMutex;
-    typedef std::set<ProcessThread *> ThreadSet;
-    ThreadSet m_threadSet;
+    // Study chunks held back within a study() call to be analysed in
+    // parallel, in m_studyFrames, each with its magnitudes in
+    // m_studyMags and the FFT of whichever segment of them it falls
+    // into
+    std::vector<float> m_studyFrames;
+    std::vector<float> m_studyMags;
+    std::vector<FFT *> m_studyFFTs;
+    size_t m_studyPending;
 
+#ifndef NO_THREADING
 #if defined(HAVE_IPP) && !defined(NO_THREADING) && !defined(USE_BQRESAMPLER) && !defined(USE_SPEEX) && !defined(HAVE_LIBSAMPLERATE)
     // Exasperatingly, the IPP polyphase resampler does not appear to
     // be thread-safe as advertised -- a good reason to prefer any of
@@ -239,7 +235,7 @@ protected:
     Scavenger<RingBuffer<float> > m_emergencyScavenger;
 
     CompoundAudioCurve *m_phaseResetAudioCurve;
-    AudioCurveCalculator *m_silentAudioCurve;
+    SilentAudioCurve *m_silentAudioCurve;
     StretchCalculator *m_stretchCalculator;
 
     float m_freq0;
@@ -254,6 +250,7 @@ protected:
 
     static const size_t m_defaultIncrement;
     static const size_t m_defaultFftSize;
+    static const size_t m_studyBatchSize;
 };
 
 }
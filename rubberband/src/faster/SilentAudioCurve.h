@@ -29,7 +29,7 @@
 namespace RubberBand
 {
 
-class SilentAudioCurve : public AudioCurveCalculator
+class SilentAudioCurve final : public AudioCurveCalculator
 {
 public:
     SilentAudioCurve(Parameters parameters);
@@ -77,6 +77,14 @@ R2Stretcher::ChannelData::construct(const std::set<size_t> &sizes,
     prevError = allocate_and_zero<process_t>(realSize);
     unwrappedPhase = allocate_and_zero<process_t>(realSize);
     envelope = allocate_and_zero<process_t>(realSize);
+    errorChange = allocate_and_zero<process_t>(realSize);
+    advance = allocate_and_zero<process_t>(realSize);
+
+    for (int k = 0; k < batchHops; ++k) {
+        batchFrame[k] = allocate_and_zero<float>(maxSize);
+        batchMag[k] = allocate_and_zero<process_t>(realSize);
+        batchPhase[k] = allocate_and_zero<process_t>(realSize);
+    }
 
     fltbuf = allocate_and_zero<float>(maxSize);
     dblbuf = allocate_and_zero<process_t>(maxSize);
@@ -172,6 +180,13 @@ R2Stretcher::ChannelData::setSizes(size_t windowSize,
     prevError = reallocate_and_zero(prevError, oldReal, realSize);
     unwrappedPhase = reallocate_and_zero(unwrappedPhase, oldReal, realSize);
     envelope = reallocate_and_zero(envelope, oldReal, realSize);
+    errorChange = reallocate_and_zero(errorChange, oldReal, realSize);
+    advance = reallocate_and_zero(advance, oldReal, realSize);
+    for (int k = 0; k < batchHops; ++k) {
+        batchFrame[k] = reallocate_and_zero(batchFrame[k], oldMax, maxSize);
+        batchMag[k] = reallocate_and_zero(batchMag[k], oldReal, realSize);
+        batchPhase[k] = reallocate_and_zero(batchPhase[k], oldReal, realSize);
+    }
     fltbuf = reallocate_and_zero(fltbuf, oldMax, maxSize);
     dblbuf = reallocate_and_zero(dblbuf, oldMax, maxSize);
     ms = reallocate_and_zero(ms, oldMax, maxSize);
@@ -239,6 +254,13 @@ R2Stretcher::ChannelData::~ChannelData()
     deallocate(prevError);
     deallocate(unwrappedPhase);
     deallocate(envelope);
+    deallocate(errorChange);
+    deallocate(advance);
+    for (int k = 0; k < batchHops; ++k) {
+        deallocate(batchFrame[k]);
+        deallocate(batchMag[k]);
+        deallocate(batchPhase[k]);
+    }
     deallocate(interpolator);
     deallocate(ms);
     deallocate(accumulator);
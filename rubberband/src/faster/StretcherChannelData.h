@@ -118,8 +118,25 @@ public:
     float *fltbuf;
     process_t *dblbuf; // owned by FFT object, only used for time domain FFT i/o
     process_t *envelope; // for cepstral formant shift
+    process_t *errorChange; // per-bin scratch for modifyChunk
+    process_t *advance; // per-bin scratch for modifyChunk
     bool unchanged;
 
+    /**
+     * The most hops processReadyChunks analyses ahead of
+     * synthesising them.
+     */
+    static const int batchHops = 4;
+
+    // Analyses of the hops processReadyChunks has in hand: the
+    // windowed frame, which synthesis reuses for an unchanged chunk,
+    // and its spectrum. Each is swapped with fltbuf, mag and phase
+    // when its hop comes to be synthesised, so all are allocated at
+    // the same size as those
+    float *batchFrame[batchHops];
+    process_t *batchMag[batchHops];
+    process_t *batchPhase[batchHops];
+
     size_t prevIncrement; // only used in RT mode
 
     size_t chunkCount;
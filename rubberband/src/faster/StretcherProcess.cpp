@@ -42,73 +42,6 @@ using namespace RubberBand;
 
 namespace RubberBand {
 
-#ifndef NO_THREADING
-
-R2Stretcher::ProcessThread::ProcessThread(R2Stretcher *s, size_t c) :
-    m_s(s),
-    m_channel(c),
-    m_dataAvailable(std::string("data ") + char('A' + c)),
-    m_abandoning(false)
-{ }
-
-void
-R2Stretcher::ProcessThread::run()
-{
-    m_s->m_log.log(2, "thread getting going for channel", m_channel);
-
-    ChannelData &cd = *m_s->m_channelData[m_channel];
-
-    while (cd.inputSize == -1 ||
-           cd.inbuf->getReadSpace() > 0) {
-
-        bool any = false, last = false;
-        m_s->processChunks(m_channel, any, last);
-
-        if (last) break;
-
-        if (any) {
-            m_s->m_spaceAvailable.lock();
-            m_s->m_spaceAvailable.signal();
-            m_s->m_spaceAvailable.unlock();
-        }
-
-        m_dataAvailable.lock();
-        if (!m_s->testInbufReadSpace(m_channel) && !m_abandoning) {
-            m_dataAvailable.wait(50000); // bounded in case of abandonment
-        }
-        m_dataAvailable.unlock();
-
-        if (m_abandoning) {
-            m_s->m_log.log(2, "thread abandoning for channel", m_channel);
-            return;
-        }
-    }
-
-    bool any = false, last = false;
-    m_s->processChunks(m_channel, any, last);
-    m_s->m_spaceAvailable.lock();
-    m_s->m_spaceAvailable.signal();
-    m_s->m_spaceAvailable.unlock();
-    
-    m_s->m_log.log(2, "thread done for channel", m_channel);
-}
-
-void
-R2Stretcher::ProcessThread::signalDataAvailable()
-{
-    m_dataAvailable.lock();
-    m_dataAvailable.signal();
-    m_dataAvailable.unlock();
-}
-
-void
-R2Stretcher::ProcessThread::abandon()
-{
-    m_abandoning = true;
-}
-
-#endif
-
 bool
 R2Stretcher::resampleBeforeStretching() const
 {
@@ -321,6 +254,37 @@ R2Stretcher::processChunks(size_t c, bool &any, bool &last)
     if (tmp) deallocate(tmp);
 }
 
+void
+R2Stretcher::processChunksForChannels(bool onlyWithInput)
+{
+    // Process as many chunks as are available on every channel, in
+    // the process-wide worker pool if we are threaded, so that the
+    // channels are processed at once but the number of threads
+    // doesn't grow with the number of channels or stretchers. The
+    // channels are independent here, as each touches only its own
+    // ChannelData and the increments are calculated in advance
+    
+    auto processChannel = [this, onlyWithInput](int c) {
+        if (onlyWithInput && m_channelData[c]->inbuf->getReadSpace() == 0) {
+            return;
+        }
+        m_log.log(2, "processing chunks for channel", c);
+        bool any = false, last = false;
+        processChunks(c, any, last);
+    };
+
+#ifndef NO_THREADING
+    if (m_threaded) {
+        SharedWorkerPool::getInstance().run(int(m_channels), processChannel);
+        return;
+    }
+#endif
+
+    for (size_t c = 0; c < m_channels; ++c) {
+        processChannel(int(c));
+    }
+}
+
 bool
 R2Stretcher::processOneChunk()
 {
@@ -353,7 +317,12 @@ R2Stretcher::processOneChunk()
     bool phaseReset = false;
     size_t phaseIncrement, shiftIncrement;
     if (!getIncrements(0, phaseIncrement, shiftIncrement, phaseReset)) {
-        calculateIncrements(phaseIncrement, shiftIncrement, phaseReset);
+        const process_t **mags =
+            (const process_t **)alloca(m_channels * sizeof(process_t *));
+        for (size_t c = 0; c < m_channels; ++c) {
+            mags[c] = m_channelData[c]->mag;
+        }
+        calculateIncrements(mags, phaseIncrement, shiftIncrement, phaseReset);
     }
 
     bool last = false;
@@ -366,6 +335,99 @@ R2Stretcher::processOneChunk()
     return last;
 }
 
+size_t
+R2Stretcher::processReadyChunks()
+{
+    Profiler profiler("R2Stretcher::processReadyChunks");
+
+    // Process every hop for which each channel already has a full
+    // analysis window of input, returning the number of hops
+    // processed. testInbufReadSpace always holds for those, so none
+    // of its side effects can arise. Anything less than a full window
+    // (at the end of the input, or while draining) is left to a
+    // single processOneChunk per process call, as before.
+
+    // The hops are taken in batches, and each stage of a batch runs
+    // through all of its hops on one channel before moving to the
+    // next, so that the channel's buffers, window and FFT stay in
+    // cache: first the analysis of every hop, into the channel's
+    // batch buffers; then the increments for every hop, which need
+    // the magnitudes of all channels at that hop; then the synthesis
+    // of every hop, each swapping its analysis into place first. The
+    // order of work within a channel, and so the result, is the same
+    // as for one processOneChunk per hop. This is only used in real
+    // time, where there are never increments calculated in advance,
+    // so every hop takes its increments from calculateIncrements
+
+    const process_t **mags =
+        (const process_t **)alloca(m_channels * sizeof(process_t *));
+
+    size_t phaseIncrements[ChannelData::batchHops];
+    size_t shiftIncrements[ChannelData::batchHops];
+    bool phaseResets[ChannelData::batchHops];
+
+    const bool filter = (m_aWindowSize > m_fftSize);
+    size_t count = 0;
+
+    while (true) {
+
+        size_t hops = ChannelData::batchHops;
+        for (size_t c = 0; c < m_channels; ++c) {
+            const ChannelData &cd = *m_channelData[c];
+            size_t ready = cd.inbuf->getReadSpace();
+            if (cd.draining || ready < m_aWindowSize) {
+                hops = 0;
+                break;
+            }
+            hops = std::min(hops, (ready - m_aWindowSize) / m_increment + 1);
+        }
+
+        if (hops == 0) {
+            m_log.log(3, "R2Stretcher::processReadyChunks: chunks processed", count);
+            return count;
+        }
+
+        for (size_t c = 0; c < m_channels; ++c) {
+            ChannelData &cd = *m_channelData[c];
+            RingBuffer<float> &inbuf = *cd.inbuf;
+            FFT &fft = *cd.fft;
+            process_t *const R__ dblbuf = cd.dblbuf;
+            for (size_t k = 0; k < hops; ++k) {
+                float *const R__ frame = cd.batchFrame[k];
+                inbuf.peek(frame, int(m_aWindowSize));
+                inbuf.skip(int(m_increment));
+                if (filter) {
+                    m_afilter->cut(frame);
+                }
+                cutShiftAndFold(dblbuf, int(m_fftSize), frame, m_awindow);
+                fft.forwardPolar(dblbuf, cd.batchMag[k], cd.batchPhase[k]);
+            }
+        }
+
+        for (size_t k = 0; k < hops; ++k) {
+            for (size_t c = 0; c < m_channels; ++c) {
+                mags[c] = m_channelData[c]->batchMag[k];
+            }
+            calculateIncrements(mags, phaseIncrements[k],
+                                shiftIncrements[k], phaseResets[k]);
+        }
+
+        for (size_t c = 0; c < m_channels; ++c) {
+            ChannelData &cd = *m_channelData[c];
+            for (size_t k = 0; k < hops; ++k) {
+                std::swap(cd.fltbuf, cd.batchFrame[k]);
+                std::swap(cd.mag, cd.batchMag[k]);
+                std::swap(cd.phase, cd.batchPhase[k]);
+                processChunkForChannel(c, phaseIncrements[k],
+                                       shiftIncrements[k], phaseResets[k]);
+                cd.chunkCount++;
+            }
+        }
+
+        count += hops;
+    }
+}
+
 bool
 R2Stretcher::testInbufReadSpace(size_t c)
 {
@@ -513,7 +575,8 @@ R2Stretcher::processChunkForChannel(size_t c,
 }
 
 void
-R2Stretcher::calculateIncrements(size_t &phaseIncrementRtn,
+R2Stretcher::calculateIncrements(const process_t *const *mags,
+                                 size_t &phaseIncrementRtn,
                                  size_t &shiftIncrementRtn,
                                  bool &phaseReset)
 {
@@ -525,8 +588,8 @@ R2Stretcher::calculateIncrements(size_t &phaseIncrementRtn,
     // calculated in advance but can then return increments
     // corresponding to different chunks in different channels.
 
-    // Requires frequency domain representations of channel data in
-    // the mag and phase buffers in the channel.
+    // Requires the magnitude spectrum of the current chunk for each
+    // channel in mags.
 
     // This function is only used in real-time mode.
 
@@ -564,11 +627,11 @@ R2Stretcher::calculateIncrements(size_t &phaseIncrementRtn,
     if (m_channels == 1) {
 
         if (sizeof(process_t) == sizeof(double)) {
-            df = m_phaseResetAudioCurve->processDouble((double *)cd.mag, m_increment);
-            silent = (m_silentAudioCurve->processDouble((double *)cd.mag, m_increment) > 0.f);
+            df = m_phaseResetAudioCurve->processDouble((const double *)mags[0], m_increment);
+            silent = (m_silentAudioCurve->processDouble((const double *)mags[0], m_increment) > 0.f);
         } else {
-            df = m_phaseResetAudioCurve->processFloat((float *)cd.mag, m_increment);
-            silent = (m_silentAudioCurve->processFloat((float *)cd.mag, m_increment) > 0.f);
+            df = m_phaseResetAudioCurve->processFloat((const float *)mags[0], m_increment);
+            silent = (m_silentAudioCurve->processFloat((const float *)mags[0], m_increment) > 0.f);
         }
 
     } else {
@@ -577,7 +640,7 @@ R2Stretcher::calculateIncrements(size_t &phaseIncrementRtn,
 
         v_zero(tmp, hs);
         for (size_t c = 0; c < m_channels; ++c) {
-            v_add(tmp, m_channelData[c]->mag, hs);
+            v_add(tmp, mags[c], hs);
         }
 
         if (sizeof(process_t) == sizeof(double)) {
@@ -799,89 +862,103 @@ R2Stretcher::modifyChunk(size_t channel,
     if (limit1 < limit0) limit1 = limit0;
     if (limit2 < limit1) limit2 = limit1;
     
+    // Bins from "from" to "to" inclusive have their phases advanced;
+    // the rest, if any, are reset, i.e. left as they are. Only a
+    // band-limited reset leaves a range of bins to advance
+    
+    int from = 0, to = count;
+    if (phaseReset) {
+        if (bandlimited) {
+            from = std::max(bandlow + 1, 0);
+            to = std::min(bandhigh - 1, count);
+            if (from <= to) fullReset = false;
+        } else {
+            from = count + 1;
+        }
+    }
+
+    process_t *const R__ phase = cd.phase;
+    process_t *const R__ prevPhase = cd.prevPhase;
+    process_t *const R__ prevError = cd.prevError;
+    process_t *const R__ unwrappedPhase = cd.unwrappedPhase;
+    process_t *const R__ errorChange = cd.errorChange;
+    process_t *const R__ advance = cd.advance;
+
+    // The expected phase advance of bin i over one input increment
+    const process_t omegaFactor = (2 * M_PI * m_increment) / m_fftSize;
+
+    // First pass: the expected phase advance, phase error and change
+    // in phase error of every bin to be advanced, which are
+    // independent of one another
+
+    for (int i = from; i <= to; ++i) {
+        process_t p = phase[i];
+        process_t omega = omegaFactor * i;
+        process_t perr = princarg(p - (prevPhase[i] + omega));
+        errorChange[i] = perr - prevError[i];
+        advance[i] = outputIncrement * ((omega + perr) / m_increment);
+        prevError[i] = perr;
+        prevPhase[i] = p;
+    }
+
+    // Second pass: from the top down, decide for each bin whether to
+    // inherit its phase advance from the bin above, which depends on
+    // the decision just made for that bin
+    
     process_t prevInstability = 0.0;
     bool prevDirection = false;
 
     process_t distance = 0.0;
     const process_t maxdist = 8.0;
 
-    const int lookback = 1;
-
     process_t distacc = 0.0;
 
-    for (int i = count; i >= 0; i -= lookback) {
+    for (int i = count; i >= 0; --i) {
 
-        bool resetThis = phaseReset;
+        process_t p = phase[i];
 
-        if (bandlimited) {
-            if (resetThis) {
-                if (i > bandlow && i < bandhigh) {
-                    resetThis = false;
-                    fullReset = false;
-                }
-            }
+        if (i < from || i > to) {
+            prevError[i] = 0.0;
+            prevPhase[i] = p;
+            unwrappedPhase[i] = p;
+            distance = 0.0;
+            continue;
         }
 
-        process_t p = cd.phase[i];
-        process_t perr = 0.0;
-        process_t outphase = p;
-
         process_t mi = maxdist;
         if (i <= limit0) mi = 0.0;
         else if (i <= limit1) mi = 1.0;
         else if (i <= limit2) mi = 3.0;
 
-        if (!resetThis) {
+        process_t instability = fabs(errorChange[i]);
+        bool direction = (errorChange[i] > 0.0);
 
-            process_t omega = (2 * M_PI * m_increment * i) / (m_fftSize);
-
-            process_t pp = cd.prevPhase[i];
-            process_t ep = pp + omega;
-            perr = princarg(p - ep);
-
-            process_t instability = fabs(perr - cd.prevError[i]);
-            bool direction = (perr > cd.prevError[i]);
-
-            bool inherit = false;
-
-            if (laminar) {
-                if (distance >= mi || i == count) {
-                    inherit = false;
-                } else if (bandlimited && (i == bandhigh || i == bandlow)) {
-                    inherit = false;
-                } else if (instability > prevInstability &&
-                           direction == prevDirection) {
-                    inherit = true;
-                }
-            }
-
-            process_t advance = outputIncrement * ((omega + perr) / m_increment);
-
-            if (inherit) {
-                process_t inherited =
-                    cd.unwrappedPhase[i + lookback] - cd.prevPhase[i + lookback];
-                advance = ((advance * distance) +
-                           (inherited * (maxdist - distance)))
-                    / maxdist;
-                outphase = p + advance;
-                distacc += distance;
-                distance += 1.0;
-            } else {
-                outphase = cd.unwrappedPhase[i] + advance;
-                distance = 0.0;
-            }
-
-            prevInstability = instability;
-            prevDirection = direction;
+        bool inherit = (laminar &&
+                        distance < mi && i != count &&
+                        !(bandlimited && (i == bandhigh || i == bandlow)) &&
+                        instability > prevInstability &&
+                        direction == prevDirection);
 
+        process_t outphase;
+        
+        if (inherit) {
+            process_t inherited = unwrappedPhase[i + 1] - prevPhase[i + 1];
+            process_t adv = ((advance[i] * distance) +
+                             (inherited * (maxdist - distance)))
+                / maxdist;
+            outphase = p + adv;
+            distacc += distance;
+            distance += 1.0;
         } else {
+            outphase = unwrappedPhase[i] + advance[i];
             distance = 0.0;
         }
 
-        cd.prevError[i] = perr;
-        cd.prevPhase[i] = p;
-        cd.phase[i] = outphase;
-        cd.unwrappedPhase[i] = outphase;
+        prevInstability = instability;
+        prevDirection = direction;
+
+        phase[i] = outphase;
+        unwrappedPhase[i] = outphase;
     }
 
     m_log.log(3, "mean inheritance distance", distacc / count);
@@ -1189,42 +1266,24 @@ R2Stretcher::available() const
 
     m_log.log(3, "R2Stretcher::available");
     
-#ifndef NO_THREADING
-    if (m_threaded) {
-        MutexLocker locker(&m_threadSetMutex);
-        if (m_channelData.empty()) return 0;
-    } else {
-        if (m_channelData.empty()) return 0;
-    }
-#endif
-
-#ifndef NO_THREADING
-    if (!m_threaded) {
-#endif
-        if (m_channelData[0]->inputSize >= 0) {
-            //!!! do we ever actually do this? if so, this method should not be const
-            // ^^^ yes, we do sometimes -- e.g. when fed a very short file
-            if (m_realtime) {
-                while (m_channelData[0]->inbuf->getReadSpace() > 0 ||
-                       m_channelData[0]->draining) {
-                    m_log.log(2, "calling processOneChunk from available");
-                    if (((R2Stretcher *)this)->processOneChunk()) {
-                        break;
-                    }
-                }
-            } else {
-                for (size_t c = 0; c < m_channels; ++c) {
-                    if (m_channelData[c]->inbuf->getReadSpace() > 0) {
-                        m_log.log(2, "calling processChunks from available, channel" , c);
-                        bool any = false, last = false;
-                        ((R2Stretcher *)this)->processChunks(c, any, last);
-                    }
+    if (m_channelData.empty()) return 0;
+
+    if (m_channelData[0]->inputSize >= 0) {
+        //!!! do we ever actually do this? if so, this method should not be const
+        // ^^^ yes, we do sometimes -- e.g. when fed a very short file
+        if (m_realtime) {
+            while (m_channelData[0]->inbuf->getReadSpace() > 0 ||
+                   m_channelData[0]->draining) {
+                m_log.log(2, "calling processOneChunk from available");
+                if (((R2Stretcher *)this)->processOneChunk()) {
+                    break;
                 }
             }
+        } else {
+            m_log.log(2, "calling processChunksForChannels from available");
+            ((R2Stretcher *)this)->processChunksForChannels(true);
         }
-#ifndef NO_THREADING
     }
-#endif
 
     size_t min = 0;
     bool consumed = true;
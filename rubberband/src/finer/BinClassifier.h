@@ -63,9 +63,10 @@ public:
     
     BinClassifier(Parameters parameters) :
         m_parameters(parameters),
-        m_hFilters(new MovingMedianStack<process_t>(m_parameters.binCount,
+        m_hFilters(new MovingMedianBatch<process_t>(m_parameters.binCount,
                                                     m_parameters.horizontalFilterLength)),
-        m_vFilter(new MovingMedian<process_t>(m_parameters.verticalFilterLength)),
+        m_vFilter(new MovingMedianBatch<process_t>(verticalFilterLanes,
+                                                   m_parameters.verticalFilterLength)),
         m_vfQueue(parameters.horizontalFilterLag)
     {
         int n = m_parameters.binCount;
@@ -113,13 +114,10 @@ public:
         
         const int n = m_parameters.binCount;
 
-        for (int i = 0; i < n; ++i) {
-            m_hFilters->push(i, mag[i]);
-            m_hf[i] = m_hFilters->get(i);
-        }
+        m_hFilters->push(mag);
+        m_hFilters->get(m_hf);
 
-        v_copy(m_vf, mag, n);
-        MovingMedian<process_t>::filter(*m_vFilter, m_vf, n);
+        m_vFilter->filter(mag, m_vf, n);
 
         if (m_parameters.horizontalFilterLag > 0) {
             process_t *lagged = m_vfQueue.readOne();
@@ -145,9 +143,13 @@ public:
     }
 
 protected:
+    // The spectrum is filtered vertically in this many pieces at
+    // once, which measured best for the filter lengths we use
+    static constexpr int verticalFilterLanes = 16;
+    
     Parameters m_parameters;
-    std::unique_ptr<MovingMedianStack<process_t>> m_hFilters;
-    std::unique_ptr<MovingMedian<process_t>> m_vFilter;
+    std::unique_ptr<MovingMedianBatch<process_t>> m_hFilters;
+    std::unique_ptr<MovingMedianBatch<process_t>> m_vFilter;
     // We manage the queued frames through pointer swapping, hence
     // bare pointers here
     process_t *m_hf;
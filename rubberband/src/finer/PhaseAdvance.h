@@ -28,10 +28,12 @@
 
 #include "../common/Log.h"
 #include "../common/mathmisc.h"
+#include "../common/VectorOps.h"
 #include "../common/Profiler.h"
 
 #include <sstream>
 #include <functional>
+#include <algorithm>
 
 namespace RubberBand
 {
@@ -63,6 +65,16 @@ public:
         m_prevInPhase = allocate_and_zero_channels<process_t>(ch, m_binCount);
         m_prevOutPhase = allocate_and_zero_channels<process_t>(ch, m_binCount);
         m_unlocked = allocate_and_zero_channels<process_t>(ch, m_binCount);
+        m_binMode = allocate_and_zero_channels<unsigned char>(ch, m_binCount);
+        m_binBeta = allocate_and_zero_channels<process_t>(ch, m_binCount);
+        m_channelLockFrom = allocate_and_zero<int>(ch);
+        m_channelLockTo = allocate_and_zero<int>(ch);
+
+        m_binFrequency = allocate_and_zero<process_t>(m_binCount);
+        for (int i = 0; i < m_binCount; ++i) {
+            m_binFrequency[i] = frequencyForBin
+                (i, m_parameters.fftSize, m_parameters.sampleRate);
+        }
 
         for (int c = 0; c < ch; ++c) {
             for (int i = 0; i < m_binCount; ++i) {
@@ -79,6 +91,11 @@ public:
         deallocate_channels(m_prevInPhase, ch);
         deallocate_channels(m_prevOutPhase, ch);
         deallocate_channels(m_unlocked, ch);
+        deallocate_channels(m_binMode, ch);
+        deallocate_channels(m_binBeta, ch);
+        deallocate(m_channelLockFrom);
+        deallocate(m_channelLockTo);
+        deallocate(m_binFrequency);
     }
 
     void reset() {
@@ -176,43 +193,38 @@ public:
         process_t omegaFactor = 2.0 * M_PI * process_t(inhop) /
             process_t(m_parameters.fftSize);
         for (int c = 0; c < channels; ++c) {
-            for (int i = lowest; i <= highest; ++i) {
-                process_t omega = omegaFactor * process_t(i);
-                process_t expected = m_prevInPhase[c][i] + omega;
-                process_t error = princarg(phase[c][i] - expected);
-                process_t advance = ratio * (omega + error);
-                m_unlocked[c][i] = m_prevOutPhase[c][i] + advance;
-            }
+            v_advance_unlocked(m_unlocked[c], phase[c],
+                               m_prevInPhase[c], m_prevOutPhase[c],
+                               omegaFactor, ratio, lowest, highest);
+        }
+
+        for (int c = 0; c < channels; ++c) {
+            buildBinTables(c, guidance, usingMidSide, inhop == outhop,
+                           lowest, highest);
         }
 
+        // The unlocked and reset bins are straight copies; only the
+        // phase-locked ones need the peak lookups. Everything is
+        // wrapped together afterwards
+        
         for (int c = 0; c < channels; ++c) {
-            const Guide::Guidance *g = guidance[c];
-            int phaseLockBand = 0;
+            const unsigned char *mode = m_binMode[c];
+            const process_t *beta = m_binBeta[c];
             for (int i = lowest; i <= highest; ++i) {
-                process_t f = frequencyForBin
-                    (i, m_parameters.fftSize, m_parameters.sampleRate);
-                while (f > g->phaseLockBands[phaseLockBand].f1 &&
-                       phaseLockBand + 1 < g->phaseLockBandCount) {
-                    ++phaseLockBand;
-                }
                 process_t ph = 0.0;
-                if (inRange(f, g->phaseReset) || inRange(f, g->kick)) {
+                if (mode[i] == ResetBin) {
                     ph = phase[c][i];
-                } else if (usingMidSide && channels == 2 &&
-                           c == 0 && inRange(f, guidance[1]->phaseReset)) {
-                    ph = phase[c][i];
-                } else if (inhop == outhop) {
-                    ph = m_unlocked[c][i];
-                } else if (inRange (f, g->highUnlocked)) {
+                } else if (mode[i] == UnlockedBin) {
                     ph = m_unlocked[c][i];
                 } else {
                     int peak = m_currentPeaks[c][i];
                     int prevPeak = m_prevPeaks[c][peak];
                     int peakCh = c;
-                    if (inRange(f, g->channelLock)) {
+                    if (i >= m_channelLockFrom[c] && i < m_channelLockTo[c]) {
                         int other = m_greatestChannel[i];
                         if (other != c &&
-                            inRange(f, guidance[other]->channelLock)) {
+                            i >= m_channelLockFrom[other] &&
+                            i < m_channelLockTo[other]) {
                             int otherPeak = m_currentPeaks[other][i];
                             int otherPrevPeak = m_prevPeaks[other][otherPeak];
                             if (otherPrevPeak == prevPeak) {
@@ -226,12 +238,11 @@ public:
                         m_prevOutPhase[peakCh][prevPeak] + peakAdvance;
                     process_t diff =
                         process_t(phase[c][i]) - process_t(phase[peakCh][peak]);
-                    process_t beta =
-                        process_t(g->phaseLockBands[phaseLockBand].beta);
-                    ph = peakNew + beta * diff;
+                    ph = peakNew + beta[i] * diff;
                 }
-                outPhase[c][i] = princarg(ph);
+                outPhase[c][i] = ph;
             }
+            v_princarg(outPhase[c], lowest, highest);
         }
                 
         for (int c = 0; c < channels; ++c) {
@@ -259,10 +270,78 @@ protected:
     process_t **m_prevInPhase;
     process_t **m_prevOutPhase;
     process_t **m_unlocked;
+    process_t *m_binFrequency;
+    unsigned char **m_binMode;
+    process_t **m_binBeta;
+    int *m_channelLockFrom;
+    int *m_channelLockTo;
     bool m_reported;
 
-    bool inRange(process_t f, const Guide::Range &r) {
-        return r.present && f >= r.f0 && f < r.f1;
+    enum BinMode : unsigned char {
+        LockedBin = 0,
+        UnlockedBin,
+        ResetBin
+    };
+
+    // Convert a frequency range into the bins within [lowest,
+    // highest] whose frequencies are in it, i.e. those for which
+    // f0 <= f < f1. The range from-to (exclusive) may be empty
+    void binRange(const Guide::Range &r, int lowest, int highest,
+                  int &from, int &to) {
+        from = to = lowest;
+        if (!r.present) return;
+        const process_t *f = m_binFrequency;
+        from = int(std::lower_bound(f + lowest, f + highest + 1, r.f0) - f);
+        to = int(std::lower_bound(f + lowest, f + highest + 1, r.f1) - f);
+        if (to < from) to = from;
+    }
+
+    // Fill in, for each bin of channel c, how its phase is to be
+    // obtained and which phase-lock band's beta applies, from the
+    // frequency ranges in this hop's guidance. Later fills take
+    // priority over earlier ones
+    void buildBinTables(int c, const Guide::Guidance *const *guidance,
+                        bool usingMidSide, bool unityRatio,
+                        int lowest, int highest) {
+
+        const Guide::Guidance *g = guidance[c];
+        unsigned char *mode = m_binMode[c];
+        process_t *beta = m_binBeta[c];
+        int from, to;
+
+        if (unityRatio) {
+            std::fill(mode + lowest, mode + highest + 1, UnlockedBin);
+        } else {
+            std::fill(mode + lowest, mode + highest + 1, LockedBin);
+            binRange(g->highUnlocked, lowest, highest, from, to);
+            std::fill(mode + from, mode + to, UnlockedBin);
+        }
+        if (usingMidSide && m_parameters.channels == 2 && c == 0) {
+            binRange(guidance[1]->phaseReset, lowest, highest, from, to);
+            std::fill(mode + from, mode + to, ResetBin);
+        }
+        binRange(g->kick, lowest, highest, from, to);
+        std::fill(mode + from, mode + to, ResetBin);
+        binRange(g->phaseReset, lowest, highest, from, to);
+        std::fill(mode + from, mode + to, ResetBin);
+
+        binRange(g->channelLock, lowest, highest,
+                 m_channelLockFrom[c], m_channelLockTo[c]);
+
+        // Each phase-lock band runs up to and including its f1, and
+        // the last one takes whatever is left over
+        const process_t *f = m_binFrequency;
+        int start = lowest;
+        int band = 0;
+        for (; band + 1 < g->phaseLockBandCount; ++band) {
+            int end = int(std::upper_bound(f + start, f + highest + 1,
+                                           g->phaseLockBands[band].f1) - f);
+            std::fill(beta + start, beta + end,
+                      process_t(g->phaseLockBands[band].beta));
+            start = end;
+        }
+        std::fill(beta + start, beta + highest + 1,
+                  process_t(g->phaseLockBands[band].beta));
     }
 
     GuidedPhaseAdvance(const GuidedPhaseAdvance &) =delete;
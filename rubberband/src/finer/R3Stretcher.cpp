@@ -26,6 +26,7 @@
 #include "../common/VectorOpsComplex.h"
 #include "../common/Profiler.h"
 
+#include <algorithm>
 #include <array>
 
 namespace RubberBand {
@@ -40,6 +41,7 @@ R3Stretcher::R3Stretcher(Parameters parameters,
     m_timeRatio(initialTimeRatio),
     m_pitchScale(initialPitchScale),
     m_formantScale(0.0),
+    m_threaded(false),
     m_guide(Guide::Parameters
             (m_parameters.sampleRate,
              m_parameters.options & RubberBandStretcher::OptionWindowShort),
@@ -51,6 +53,11 @@ R3Stretcher::R3Stretcher(Parameters parameters,
     m_prevInhop(1),
     m_prevOuthop(1),
     m_unityCount(0),
+    m_formantInterval(1),
+    m_formantAge(-1),
+    m_formantLookupScale(0.0),
+    m_analyseFormant(false),
+    m_adjustFormant(false),
     m_startSkip(0),
     m_studyInputDuration(0),
     m_suppliedInputDuration(0),
@@ -108,25 +115,40 @@ R3Stretcher::initialise()
     int hopBufferSize =
         2 * std::max(m_limits.maxInhop, m_limits.maxPreferredOuthop);
     
+    m_threaded = useThreads();
+
+    if (m_threaded) {
+        m_log.log(1, "R3Stretcher::R3Stretcher: going multithreaded, threads",
+                  SharedWorkerPool::getInstance().getThreadCount() + 1);
+    }
+    
     m_channelData.clear();
     
     for (int c = 0; c < m_parameters.channels; ++c) {
         m_channelData.push_back(std::make_shared<ChannelData>
-                                (segmenterParameters,
+                                (m_guideConfiguration,
+                                 segmenterParameters,
                                  classifierParameters,
                                  getWindowSourceSize(),
                                  inRingBufferSize,
                                  outRingBufferSize,
                                  hopBufferSize));
-        for (int b = 0; b < m_guideConfiguration.fftBandLimitCount; ++b) {
-            const auto &band = m_guideConfiguration.fftBandLimits[b];
-            int fftSize = band.fftSize;
-            m_channelData[c]->scales[fftSize] =
-                std::make_shared<ChannelScaleData>
-                (fftSize, m_guideConfiguration.longestFftSize);
+        if (m_threaded) {
+            for (auto &scale : m_channelData[c]->scales) {
+                scale->fft.reset(new FFT(scale->fftSize));
+            }
         }
     }
 
+    m_sharedAnalysis.reset();
+
+    if (useSharedAnalysis()) {
+        m_log.log(1, "R3Stretcher::R3Stretcher: sharing analysis across channels", m_parameters.channels);
+        m_sharedAnalysis = std::unique_ptr<SharedAnalysisData>
+            (new SharedAnalysisData(segmenterParameters,
+                                    classifierParameters));
+    }
+
     m_scaleData.clear();
     
     for (int b = 0; b < m_guideConfiguration.fftBandLimitCount; ++b) {
@@ -135,8 +157,66 @@ R3Stretcher::initialise()
         GuidedPhaseAdvance::Parameters guidedParameters
             (fftSize, m_parameters.sampleRate, m_parameters.channels,
              isSingleWindowed());
-        m_scaleData[fftSize] = std::make_shared<ScaleData>
-            (guidedParameters, m_log);
+        m_scaleData.push_back(std::unique_ptr<ScaleData>
+                              (new ScaleData(guidedParameters, m_log)));
+    }
+
+    // The bands are not in order of FFT size (see Guide), so we work
+    // out once here which is which, rather than looking scales up by
+    // size on every hop
+    m_classifyScale = 0;
+    m_longestScale = 0;
+    m_scalesBySize.clear();
+    for (int b = 0; b < m_guideConfiguration.fftBandLimitCount; ++b) {
+        int fftSize = m_guideConfiguration.fftBandLimits[b].fftSize;
+        if (fftSize == m_guideConfiguration.classificationFftSize) {
+            m_classifyScale = b;
+        }
+        if (fftSize == m_guideConfiguration.longestFftSize) {
+            m_longestScale = b;
+        }
+        m_scalesBySize.push_back(b);
+    }
+    std::sort(m_scalesBySize.begin(), m_scalesBySize.end(),
+              [&](int a, int b) {
+                  return m_scaleData[a]->fftSize < m_scaleData[b]->fftSize;
+              });
+
+    // The formant target lookups and bin ranges depend only on the
+    // scale, while the source lookups are recalculated whenever the
+    // formant scale changes, in prepareFormant
+    int formantFftSize = m_guideConfiguration.classificationFftSize;
+    for (int b = 0; b < m_guideConfiguration.fftBandLimitCount; ++b) {
+        const auto &band = m_guideConfiguration.fftBandLimits[b];
+        auto &sd = m_scaleData[b];
+        int highBin = int(floor(sd->fftSize * 10000.0 / m_parameters.sampleRate));
+        sd->formantFrom = band.b0min;
+        sd->formantTo = std::max(std::min(band.b1max, highBin), band.b0min);
+        sd->formantTarget.calculate
+            (sd->formantFrom, sd->formantTo,
+             process_t(formantFftSize) / process_t(sd->fftSize),
+             formantFftSize);
+    }
+    m_formantLookupScale = 0.0;
+    m_formantAge = -1;
+
+    // The envelope is taken from a whole classification frame, so
+    // frames closer together than this share one
+    m_formantInterval = formantFftSize / 8;
+
+    // Each scale's phase advance sees the same per-channel arrays
+    // every hop, so its argument pointers can be filled in now
+    for (int b = 0; b < m_guideConfiguration.fftBandLimitCount; ++b) {
+        auto &assembly = m_scaleData[b]->assembly;
+        for (int c = 0; c < m_parameters.channels; ++c) {
+            auto &cd = m_channelData.at(c);
+            auto &scale = cd->scales[b];
+            assembly.mag[c] = scale->mag.data();
+            assembly.phase[c] = scale->phase.data();
+            assembly.prevMag[c] = scale->prevMag.data();
+            assembly.guidance[c] = &cd->guidance;
+            assembly.outPhase[c] = scale->advancedPhase.data();
+        }
     }
 
     m_calculator = std::unique_ptr<StretchCalculator>
@@ -162,6 +242,38 @@ R3Stretcher::initialise()
     }
 }
 
+bool
+R3Stretcher::useThreads() const
+{
+#ifdef NO_THREADING
+    return false;
+#else
+    // As with R2, work is handed out to separate threads in offline
+    // mode only, unless threading is explicitly asked for. The units
+    // of work are the individual FFT scales of each channel, so even
+    // a mono stretcher has some to share out, unless it is
+    // single-windowed
+    
+    if (m_parameters.channels < 2 &&
+        m_guideConfiguration.fftBandLimitCount < 2) {
+        return false;
+    }
+    
+    auto options = m_parameters.options;
+    
+    if (options & RubberBandStretcher::OptionThreadingNever) {
+        return false;
+    }
+    if (options & RubberBandStretcher::OptionThreadingAlways) {
+        return true;
+    }
+    if (isRealTime()) {
+        return false;
+    }
+    return system_is_multiprocessor();
+#endif
+}
+
 WindowType
 R3Stretcher::ScaleData::analysisWindowShape()
 {
@@ -551,6 +663,7 @@ R3Stretcher::reset()
     m_prevInhop = 1;
     m_prevOuthop = 1;
     m_unityCount = 0;
+    m_formantAge = -1;
     m_startSkip = 0;
     m_studyInputDuration = 0;
     m_suppliedInputDuration = 0;
@@ -568,14 +681,18 @@ R3Stretcher::reset()
         m_resampler->reset();
     }
 
-    for (auto &it : m_scaleData) {
-        it.second->guided.reset();
+    for (auto &sd : m_scaleData) {
+        sd->guided.reset();
     }
 
     for (auto &cd : m_channelData) {
         cd->reset();
     }
 
+    if (m_sharedAnalysis) {
+        m_sharedAnalysis->reset();
+    }
+
     calculateHop();
 }
 
@@ -668,7 +785,8 @@ R3Stretcher::ensureInbuf(int required, bool warn)
     m_log.log(warn ? 0 : 2, "R3Stretcher::ensureInbuf: old and new sizes", oldSize, newSize);
     for (int c = 0; c < m_parameters.channels; ++c) {
         auto newBuf = m_channelData[c]->inbuf->resized(newSize);
-        m_channelData[c]->inbuf = std::unique_ptr<RingBuffer<float>>(newBuf);
+        m_channelData[c]->inbuf =
+            std::unique_ptr<MirroredRingBuffer<float>>(newBuf);
         // mixdown is used for mid-side mixing as well as the single
         // hop output mix, so it needs to be enough to match the inbuf
         m_channelData[c]->mixdown.resize(newSize, 0.f);
@@ -993,10 +1111,9 @@ R3Stretcher::consume(bool final)
 
     m_log.log(2, "consume: write space and outhop", cd0->outbuf->getWriteSpace(), outhop);
         
-    // NB our ChannelData, ScaleData, and ChannelScaleData maps
-    // contain shared_ptrs; whenever we retain one of them in a
-    // variable, we do so by reference to avoid copying the shared_ptr
-    // (as that is not realtime safe). Same goes for the map iterators
+    // NB our ChannelData vector contains shared_ptrs; whenever we
+    // retain one of them in a variable, we do so by reference to
+    // avoid copying the shared_ptr (as that is not realtime safe)
 
     while (true) {
 
@@ -1008,7 +1125,7 @@ R3Stretcher::consume(bool final)
         if (readSpace < getWindowSourceSize()) {
             if (final) {
                 if (readSpace == 0) {
-                    int fill = cd0->scales.at(longest)->accumulatorFill;
+                    int fill = cd0->scales[m_longestScale]->accumulatorFill;
                     if (fill == 0) {
                         break;
                     } else {
@@ -1023,46 +1140,57 @@ R3Stretcher::consume(bool final)
 
         ensureOutbuf(outhop);
         
-        // Analysis
+        // Analysis. Each channel's input frame is fetched first, then
+        // every scale of every channel is analysed as a separate
+        // task, before the per-channel formant and guidance steps
+        
+        int bands = m_guideConfiguration.fftBandLimitCount;
         
         for (int c = 0; c < channels; ++c) {
-            analyseChannel(c, inhop, m_prevInhop, m_prevOuthop);
+            prepareAnalysis(c, inhop, m_prevInhop);
         }
 
-        // Phase update. This is synchronised across all channels
+        runTasks(channels * bands, [&](int i) {
+            analyseScale(i / bands, i % bands, inhop);
+        });
+
+        prepareFormant(m_prevInhop);
+
+        // The unity count is in hops, the same whether the guidance
+        // is worked out per channel or shared. It is moved on here,
+        // before either, so that the channels only read it
         
-        for (auto &it : m_channelData[0]->scales) {
-            int fftSize = it.first;
-            for (int c = 0; c < channels; ++c) {
-                auto &cd = m_channelData.at(c);
-                auto &scale = cd->scales.at(fftSize);
-                m_channelAssembly.mag[c] = scale->mag.data();
-                m_channelAssembly.phase[c] = scale->phase.data();
-                m_channelAssembly.prevMag[c] = scale->prevMag.data();
-                m_channelAssembly.guidance[c] = &cd->guidance;
-                m_channelAssembly.outPhase[c] = scale->advancedPhase.data();
-            }
-            m_scaleData.at(fftSize)->guided.advance
-                (m_channelAssembly.outPhase.data(),
-                 m_channelAssembly.mag.data(),
-                 m_channelAssembly.phase.data(),
-                 m_channelAssembly.prevMag.data(),
-                 m_guideConfiguration,
-                 m_channelAssembly.guidance.data(),
-                 useMidSide(),
-                 m_prevInhop,
-                 m_prevOuthop);
+        if (fabs(getEffectiveRatio() - 1.0) < 1.0e-7) {
+            ++m_unityCount;
+        } else {
+            m_unityCount = 0;
         }
 
-        for (int c = 0; c < channels; ++c) {
-            adjustPreKick(c);
+        runTasks(channels, [&](int c) {
+            completeAnalysis(c, m_prevOuthop);
+        });
+
+        if (m_sharedAnalysis) {
+            updateSharedGuidance(m_prevOuthop);
         }
+
+        // Phase update. This is synchronised across all channels,
+        // one task per scale
         
-        // Resynthesis
+        runTasks(bands, [&](int b) {
+            advanceScale(b);
+        });
+
+        // Resynthesis, one task per scale per channel, and then the
+        // scales of each channel are mixed
         
-        for (int c = 0; c < channels; ++c) {
-            synthesiseChannel(c, outhop, readSpace == 0);
-        }
+        runTasks(channels * bands, [&](int i) {
+            synthesiseScale(i / bands, i % bands, outhop);
+        });
+
+        runTasks(channels, [&](int c) {
+            mixChannel(c, outhop, readSpace == 0);
+        });
         
         // Resample
 
@@ -1076,7 +1204,7 @@ R3Stretcher::consume(bool final)
 
             bool finalHop = (final &&
                              readSpace < inhop &&
-                             cd0->scales.at(longest)->accumulatorFill <= outhop);
+                             cd0->scales[m_longestScale]->accumulatorFill <= outhop);
             
             resampledCount = m_resampler->resample
                 (m_channelAssembly.resampled.data(),
@@ -1153,74 +1281,104 @@ R3Stretcher::consume(bool final)
     m_log.log(2, "consume: write space reduced to", cd0->outbuf->getWriteSpace());
 }
 
+FFT &
+R3Stretcher::getFFT(int band, ChannelScaleData &scale)
+{
+    if (scale.fft) {
+        return *scale.fft;
+    } else {
+        return m_scaleData[band]->fft;
+    }
+}
+
 void
-R3Stretcher::analyseChannel(int c, int inhop, int prevInhop, int prevOuthop)
+R3Stretcher::prepareAnalysis(int c, int inhop, int prevInhop)
 {
-    Profiler profiler("R3Stretcher::analyseChannel");
+    Profiler profiler("R3Stretcher::prepareAnalysis");
     
     auto &cd = m_channelData.at(c);
 
     int sourceSize = cd->windowSource.size();
-    process_t *buf = cd->windowSource.data();
+
+    // Use the frame in place in inbuf, unless we are at the end of
+    // the input and it is short, when it must be padded out
 
     int readSpace = cd->inbuf->getReadSpace();
     if (readSpace < sourceSize) {
+        float *buf = cd->windowSource.data();
         cd->inbuf->peek(buf, readSpace);
         v_zero(buf + readSpace, sourceSize - readSpace);
+        cd->windowFrame = buf;
     } else {
-        cd->inbuf->peek(buf, sourceSize);
+        cd->windowFrame = cd->inbuf->view(sourceSize);
     }
-    
-    // We have an unwindowed time-domain frame in buf that is as long
-    // as required for the union of all FFT sizes and readahead
-    // hops. Populate the various sizes from it with aligned centres,
-    // windowing as we copy. The classification scale is handled
-    // separately because it has readahead, so skip it here. (In
-    // single-window mode that means we do nothing here, since the
-    // classification scale is the only one.)
 
-    int longest = m_guideConfiguration.longestFftSize;
-    int classify = m_guideConfiguration.classificationFftSize;
-
-    for (auto &it: cd->scales) {
-        int fftSize = it.first;
-        if (fftSize == classify) continue;
-        int offset = (longest - fftSize) / 2;
-        m_scaleData.at(fftSize)->analysisWindow.cut
-            (buf + offset, it.second->timeDomain.data());
-    }
+    // We now have an unwindowed time-domain frame that is as long as
+    // required for the union of all FFT sizes and readahead hops,
+    // from which analyseScale populates each scale. It remains valid
+    // until inbuf is advanced at the end of the hop
 
-    auto &classifyScale = cd->scales.at(classify);
-    ClassificationReadaheadData &readahead = cd->readahead;
-    bool copyFromReadahead = false;
+    cd->copyFromReadahead = false;
     
     if (m_useReadahead) {
-        
-        // The classification scale has a one-hop readahead, so
-        // populate the readahead from further down the long
-        // unwindowed frame.
-
-        m_scaleData.at(classify)->analysisWindow.cut
-            (buf + (longest - classify) / 2 + inhop,
-             readahead.timeDomain.data());
 
         // If inhop has changed since the previous frame, we must
         // populate the classification scale (but for
         // analysis/resynthesis rather than classification) anew
         // rather than reuse the previous frame's readahead.
 
-        copyFromReadahead = cd->haveReadahead;
-        if (inhop != prevInhop) copyFromReadahead = false;
+        cd->copyFromReadahead = cd->haveReadahead;
+        if (inhop != prevInhop) cd->copyFromReadahead = false;
     }
+}
+
+void
+R3Stretcher::analyseScale(int c, int b, int inhop)
+{
+    Profiler profiler("R3Stretcher::analyseScale");
+
+    // Window, FFT shift, forward FFT, and carry out cartesian-polar
+    // conversion for the FFT size of band b. This touches nothing
+    // belonging to any other channel or scale, so the scales of all
+    // channels can be analysed in any order or all at once
     
-    if (!copyFromReadahead) {
-        m_scaleData.at(classify)->analysisWindow.cut
-            (buf + (longest - classify) / 2,
-             classifyScale->timeDomain.data());
-    }
+    auto &cd = m_channelData.at(c);
+    const auto &band = m_guideConfiguration.fftBandLimits[b];
+    int fftSize = band.fftSize;
+    
+    const float *buf = cd->windowFrame;
+
+    int longest = m_guideConfiguration.longestFftSize;
+    int classify = m_guideConfiguration.classificationFftSize;
 
-    // FFT shift, forward FFT, and carry out cartesian-polar
-    // conversion for each FFT size.
+    auto &scale = cd->scales[b];
+    auto &scaleData = m_scaleData[b];
+    bool copyFromReadahead = cd->copyFromReadahead;
+
+    // Populate the scale from the long unwindowed frame with aligned
+    // centres, windowing and fft-shifting as we copy. The
+    // classification scale has a one-hop readahead, which is
+    // populated from further down the frame
+    
+    if (fftSize != classify) {
+        
+        scaleData->analysisWindow.cutShifted
+            (buf + (longest - fftSize) / 2, scale->timeDomain.data());
+        
+    } else {
+
+        if (m_useReadahead) {
+            scaleData->analysisWindow.cutShifted
+                (buf + (longest - classify) / 2 + inhop,
+                 cd->readahead.timeDomain.data());
+        }
+
+        if (!copyFromReadahead) {
+            scaleData->analysisWindow.cutShifted
+                (buf + (longest - classify) / 2,
+                 scale->timeDomain.data());
+        }
+    }
 
     // For the classification scale we need magnitudes for the full
     // range (polar only in a subset) and we operate in the readahead,
@@ -1228,109 +1386,118 @@ R3Stretcher::analyseChannel(int c, int inhop, int prevInhop, int prevOuthop)
     // where the inhop has changed as above, in which case we need to
     // do both readahead and current)
 
-    if (m_useReadahead) {
+    if (fftSize == classify && m_useReadahead) {
+
+        ClassificationReadaheadData &readahead = cd->readahead;
+        
+        // The readahead magnitudes are kept unnormalised, as the
+        // classifier is given them as they are, so the copy in the
+        // scale is normalised separately. If we aren't copying, the
+        // scale is analysed in full below
 
         if (copyFromReadahead) {
-            v_copy(classifyScale->mag.data(),
+            v_copy(scale->mag.data(),
                    readahead.mag.data(),
-                   classifyScale->bufSize);
-            v_copy(classifyScale->phase.data(),
+                   scale->bufSize);
+            v_scale(scale->mag.data(),
+                    1.0 / double(classify),
+                    scale->mag.size());
+            v_copy(scale->phase.data(),
                    readahead.phase.data(),
-                   classifyScale->bufSize);
+                   scale->bufSize);
         }
 
-        v_fftshift(readahead.timeDomain.data(), classify);
-        m_scaleData.at(classify)->fft.forward(readahead.timeDomain.data(),
-                                              classifyScale->real.data(),
-                                              classifyScale->imag.data());
-
-        for (int b = 0; b < m_guideConfiguration.fftBandLimitCount; ++b) {
-            const auto &band = m_guideConfiguration.fftBandLimits[b];
-            if (band.fftSize == classify) {
-                ToPolarSpec spec;
-                spec.magFromBin = 0;
-                spec.magBinCount = classify/2 + 1;
-                spec.polarFromBin = band.b0min;
-                spec.polarBinCount = band.b1max - band.b0min + 1;
-                convertToPolar(readahead.mag.data(),
-                               readahead.phase.data(),
-                               classifyScale->real.data(),
-                               classifyScale->imag.data(),
-                               spec);
-                    
-                v_scale(classifyScale->mag.data(),
-                        1.0 / double(classify),
-                        classifyScale->mag.size());
-                break;
-            }
-        }
+        getFFT(b, *scale).forward(readahead.timeDomain.data(),
+                               scale->real.data(),
+                               scale->imag.data());
+
+        ToPolarSpec spec;
+        spec.magFromBin = 0;
+        spec.magBinCount = classify/2 + 1;
+        spec.polarFromBin = band.b0min;
+        spec.polarBinCount = band.b1max - band.b0min + 1;
+        spec.magGain = 1.0;
+        convertToPolar(readahead.mag.data(),
+                       readahead.phase.data(),
+                       scale->real.data(),
+                       scale->imag.data(),
+                       spec);
 
         cd->haveReadahead = true;
+
+        if (copyFromReadahead) {
+            return;
+        }
     }
 
     // For the others (and the classify as well, if the inhop has
     // changed or we aren't using readahead or haven't filled the
     // readahead yet) we operate directly in the scale data and
     // restrict the range for cartesian-polar conversion
-            
-    for (auto &it: cd->scales) {
-        int fftSize = it.first;
-        if (fftSize == classify && copyFromReadahead) {
-            continue;
-        }
-        
-        auto &scale = it.second;
-        
-        v_fftshift(scale->timeDomain.data(), fftSize);
-
-        m_scaleData.at(fftSize)->fft.forward(scale->timeDomain.data(),
-                                             scale->real.data(),
-                                             scale->imag.data());
-
-        for (int b = 0; b < m_guideConfiguration.fftBandLimitCount; ++b) {
-            const auto &band = m_guideConfiguration.fftBandLimits[b];
-            if (band.fftSize == fftSize) {
-
-                ToPolarSpec spec;
-
-                // For the classify scale we always want the full
-                // range, as all the magnitudes (though not
-                // necessarily all phases) are potentially relevant to
-                // classification and formant analysis. But this case
-                // here only happens if we don't copyFromReadahead -
-                // the normal case is above and, er, copies from the
-                // previous readahead.
-                if (fftSize == classify) {
-                    spec.magFromBin = 0;
-                    spec.magBinCount = classify/2 + 1;
-                    spec.polarFromBin = band.b0min;
-                    spec.polarBinCount = band.b1max - band.b0min + 1;
-                } else {
-                    spec.magFromBin = band.b0min;
-                    spec.magBinCount = band.b1max - band.b0min + 1;
-                    spec.polarFromBin = spec.magFromBin;
-                    spec.polarBinCount = spec.magBinCount;
-                }
 
-                convertToPolar(scale->mag.data(),
-                               scale->phase.data(),
-                               scale->real.data(),
-                               scale->imag.data(),
-                               spec);
+    getFFT(b, *scale).forward(scale->timeDomain.data(),
+                           scale->real.data(),
+                           scale->imag.data());
+
+    ToPolarSpec spec;
+
+    // For the classify scale we always want the full range, as all
+    // the magnitudes (though not necessarily all phases) are
+    // potentially relevant to classification and formant
+    // analysis. But this case here only happens if we don't
+    // copyFromReadahead - the normal case is above and, er, copies
+    // from the previous readahead.
+    if (fftSize == classify) {
+        spec.magFromBin = 0;
+        spec.magBinCount = classify/2 + 1;
+        spec.polarFromBin = band.b0min;
+        spec.polarBinCount = band.b1max - band.b0min + 1;
+    } else {
+        spec.magFromBin = band.b0min;
+        spec.magBinCount = band.b1max - band.b0min + 1;
+        spec.polarFromBin = spec.magFromBin;
+        spec.polarBinCount = spec.magBinCount;
+    }
 
-                v_scale(scale->mag.data() + spec.magFromBin,
-                        1.0 / double(fftSize),
-                        spec.magBinCount);
-                
-                break;
-            }
+    // Normalise the magnitudes as we convert
+    spec.magGain = 1.0 / double(fftSize);
+
+    convertToPolar(scale->mag.data(),
+                   scale->phase.data(),
+                   scale->real.data(),
+                   scale->imag.data(),
+                   spec);
+}
+
+void
+R3Stretcher::completeAnalysis(int c, int prevOuthop)
+{
+    Profiler profiler("R3Stretcher::completeAnalysis");
+    
+    if (m_adjustFormant) {
+        if (m_analyseFormant) {
+            analyseFormant(c);
         }
+        adjustFormant(c);
     }
 
-    if (m_parameters.options & RubberBandStretcher::OptionFormantPreserved) {
-        analyseFormant(c);
-        adjustFormant(c);
+    // With shared analysis, the guidance is calculated once all
+    // channels have been analysed, in updateSharedGuidance
+    
+    if (!m_sharedAnalysis) {
+        updateChannelGuidance(c, prevOuthop);
     }
+}
+
+void
+R3Stretcher::updateChannelGuidance(int c, int prevOuthop)
+{
+    Profiler profiler("R3Stretcher::updateChannelGuidance");
+
+    auto &cd = m_channelData.at(c);
+    int classify = m_guideConfiguration.classificationFftSize;
+    auto &classifyScale = cd->scales[m_classifyScale];
+    ClassificationReadaheadData &readahead = cd->readahead;
         
     // Use the classification scale to get a bin segmentation and
     // calculate the adaptive frequency guide for this channel
@@ -1375,12 +1542,6 @@ R3Stretcher::analyseChannel(int c, int inhop, int prevInhop, int prevOuthop)
 
     double ratio = getEffectiveRatio();
 
-    if (fabs(ratio - 1.0) < 1.0e-7) {
-        ++m_unityCount;
-    } else {
-        m_unityCount = 0;
-    }
-
     bool tighterChannelLock =
         m_parameters.options & RubberBandStretcher::OptionChannelsTogether;
 
@@ -1440,6 +1601,174 @@ R3Stretcher::analyseChannel(int c, int inhop, int prevInhop, int prevOuthop)
 */
 }
 
+void
+R3Stretcher::updateSharedGuidance(int prevOuthop)
+{
+    Profiler profiler("R3Stretcher::updateSharedGuidance");
+
+    // As updateChannelGuidance, but for the mean magnitude spectrum
+    // of all channels, with the result copied to every channel. The
+    // per-channel classification-scale magnitudes are already in
+    // place from analyseScale, and any formant adjustment from
+    // completeAnalysis.
+
+    auto &sa = m_sharedAnalysis;
+    int channels = m_parameters.channels;
+    int classify = m_guideConfiguration.classificationFftSize;
+    int bufSize = classify/2 + 1;
+    process_t scale = process_t(1.0) / process_t(channels);
+
+    v_zero(sa->mag.data(), bufSize);
+    if (m_useReadahead) {
+        v_zero(sa->readaheadMag.data(), bufSize);
+    }
+    for (int c = 0; c < channels; ++c) {
+        auto &cd = m_channelData.at(c);
+        v_add(sa->mag.data(), cd->scales[m_classifyScale]->mag.data(), bufSize);
+        if (m_useReadahead) {
+            v_add(sa->readaheadMag.data(), cd->readahead.mag.data(), bufSize);
+        }
+    }
+    v_scale(sa->mag.data(), scale, bufSize);
+    if (m_useReadahead) {
+        v_scale(sa->readaheadMag.data(), scale, bufSize);
+    }
+
+    v_copy(sa->classification.data(), sa->nextClassification.data(),
+           sa->classification.size());
+
+    if (m_useReadahead) {
+        sa->classifier->classify(sa->readaheadMag.data(),
+                                 sa->nextClassification.data());
+    } else {
+        sa->classifier->classify(sa->mag.data(),
+                                 sa->nextClassification.data());
+    }
+
+    sa->prevSegmentation = sa->segmentation;
+    sa->segmentation = sa->nextSegmentation;
+    sa->nextSegmentation = sa->segmenter->segment(sa->nextClassification.data());
+
+    double ratio = getEffectiveRatio();
+
+    bool tighterChannelLock =
+        m_parameters.options & RubberBandStretcher::OptionChannelsTogether;
+
+    double magMean = v_mean(sa->mag.data() + 1, classify/2);
+
+    if (m_useReadahead) {
+        m_guide.updateGuidance(ratio,
+                               prevOuthop,
+                               sa->mag.data(),
+                               sa->prevMag.data(),
+                               sa->readaheadMag.data(),
+                               sa->segmentation,
+                               sa->prevSegmentation,
+                               sa->nextSegmentation,
+                               magMean,
+                               m_unityCount,
+                               isRealTime(),
+                               tighterChannelLock,
+                               true,
+                               sa->guidance);
+    } else {
+        m_guide.updateGuidance(ratio,
+                               prevOuthop,
+                               sa->prevMag.data(),
+                               sa->prevMag.data(),
+                               sa->mag.data(),
+                               sa->segmentation,
+                               sa->prevSegmentation,
+                               sa->nextSegmentation,
+                               magMean,
+                               m_unityCount,
+                               isRealTime(),
+                               tighterChannelLock,
+                               true,
+                               sa->guidance);
+    }
+
+    v_copy(sa->prevMag.data(), sa->mag.data(), bufSize);
+
+    for (int c = 0; c < channels; ++c) {
+        auto &cd = m_channelData.at(c);
+        cd->prevSegmentation = sa->prevSegmentation;
+        cd->segmentation = sa->segmentation;
+        cd->nextSegmentation = sa->nextSegmentation;
+        cd->guidance = sa->guidance;
+    }
+}
+
+void
+R3Stretcher::advanceScale(int b)
+{
+    Profiler profiler("R3Stretcher::advanceScale");
+
+    // Phase update. This is synchronised across all channels, but
+    // each scale is independent of the others. The assembly always
+    // refers to the same arrays, so was filled in on construction
+    
+    auto &scaleData = m_scaleData[b];
+    auto &assembly = scaleData->assembly;
+    
+    scaleData->guided.advance(assembly.outPhase.data(),
+                              assembly.mag.data(),
+                              assembly.phase.data(),
+                              assembly.prevMag.data(),
+                              m_guideConfiguration,
+                              assembly.guidance.data(),
+                              useMidSide(),
+                              m_prevInhop,
+                              m_prevOuthop);
+}
+
+void
+R3Stretcher::prepareFormant(int prevInhop)
+{
+    m_analyseFormant = false;
+    m_adjustFormant = false;
+    
+    if (!(m_parameters.options & RubberBandStretcher::OptionFormantPreserved)) {
+        m_formantAge = -1;
+        return;
+    }
+
+    double formantScale = m_formantScale;
+    if (formantScale == 0.0) formantScale = 1.0 / m_pitchScale;
+
+    // At unity the source and target envelope positions are the
+    // same, so there is nothing to adjust and nothing to analyse
+    if (fabs(formantScale - 1.0) < 1.0e-7) {
+        m_formantAge = -1;
+        return;
+    }
+
+    if (formantScale != m_formantLookupScale) {
+        int formantFftSize = m_guideConfiguration.classificationFftSize;
+        for (auto &sd : m_scaleData) {
+            process_t targetFactor =
+                process_t(formantFftSize) / process_t(sd->fftSize);
+            sd->formantSource.calculate
+                (sd->formantFrom, sd->formantTo,
+                 targetFactor / process_t(formantScale),
+                 formantFftSize);
+        }
+        m_formantLookupScale = formantScale;
+    }
+
+    // Frames that advance by less than the interval keep the
+    // envelope of the last frame analysed, until the input has moved
+    // on by the interval in total
+    if (m_formantAge < 0 || m_formantAge + prevInhop >= m_formantInterval) {
+        m_analyseFormant = true;
+        m_formantAge = 0;
+    } else {
+        m_formantAge += prevInhop;
+    }
+
+    m_adjustFormant = true;
+}
+
 void
 R3Stretcher::analyseFormant(int c)
 {
@@ -1451,10 +1780,10 @@ R3Stretcher::analyseFormant(int c)
     int fftSize = f.fftSize;
     int binCount = fftSize/2 + 1;
     
-    auto &scale = cd->scales.at(fftSize);
-    auto &scaleData = m_scaleData.at(fftSize);
+    auto &scale = cd->scales[m_classifyScale];
+    FFT &fft = getFFT(m_classifyScale, *scale);
 
-    scaleData->fft.inverseCepstral(scale->mag.data(), f.cepstra.data());
+    fft.inverseCepstral(scale->mag.data(), f.cepstra.data());
     
     int cutoff = int(floor(m_parameters.sampleRate / 650.0));
     if (cutoff < 1) cutoff = 1;
@@ -1466,7 +1795,7 @@ R3Stretcher::analyseFormant(int c)
     }
     v_scale(f.cepstra.data(), 1.0 / double(fftSize), cutoff);
 
-    scaleData->fft.forward(f.cepstra.data(), f.envelope.data(), f.spare.data());
+    fft.forward(f.cepstra.data(), f.envelope.data(), f.spare.data());
 
     v_exp(f.envelope.data(), binCount);
     v_square(f.envelope.data(), binCount);
@@ -1482,33 +1811,37 @@ R3Stretcher::adjustFormant(int c)
     Profiler profiler("R3Stretcher::adjustFormant");
 
     auto &cd = m_channelData.at(c);
+    const process_t *const R__ envelope = cd->formant->envelope.data();
+    
+    const process_t maxRatio = 60.0;
+    const process_t minRatio = 1.0 / maxRatio;
         
-    for (auto &it : cd->scales) {
+    for (int b = 0; b < m_guideConfiguration.fftBandLimitCount; ++b) {
         
-        int fftSize = it.first;
-        auto &scale = it.second;
-
-        int highBin = int(floor(fftSize * 10000.0 / m_parameters.sampleRate));
-        process_t targetFactor = process_t(cd->formant->fftSize) / process_t(fftSize);
-        process_t formantScale = m_formantScale;
-        if (formantScale == 0.0) formantScale = 1.0 / m_pitchScale;
-        process_t sourceFactor = targetFactor / formantScale;
-        process_t maxRatio = 60.0;
-        process_t minRatio = 1.0 / maxRatio;
-
-        for (int b = 0; b < m_guideConfiguration.fftBandLimitCount; ++b) {
-            const auto &band = m_guideConfiguration.fftBandLimits[b];
-            if (band.fftSize != fftSize) continue;
-            for (int i = band.b0min; i < band.b1max && i < highBin; ++i) {
-                process_t source = cd->formant->envelopeAt(i * sourceFactor);
-                process_t target = cd->formant->envelopeAt(i * targetFactor);
-                if (target > 0.0) {
-                    process_t ratio = source / target;
-                    if (ratio < minRatio) ratio = minRatio;
-                    if (ratio > maxRatio) ratio = maxRatio;
-                    scale->mag[i] *= ratio;
-                }
-            }
+        const auto &sd = m_scaleData[b];
+        const auto &source = sd->formantSource;
+        const auto &target = sd->formantTarget;
+        const int *const R__ s0 = source.bin0.data();
+        const int *const R__ s1 = source.bin1.data();
+        const process_t *const R__ sw0 = source.weight0.data();
+        const process_t *const R__ sw1 = source.weight1.data();
+        const int *const R__ t0 = target.bin0.data();
+        const int *const R__ t1 = target.bin1.data();
+        const process_t *const R__ tw0 = target.weight0.data();
+        const process_t *const R__ tw1 = target.weight1.data();
+        process_t *const R__ mag = cd->scales[b]->mag.data();
+        const int from = sd->formantFrom, to = sd->formantTo;
+
+        // Written without branches, so that it can vectorise on
+        // instruction sets that have gathers
+        for (int i = from; i < to; ++i) {
+            process_t s = envelope[s0[i]] * sw0[i] + envelope[s1[i]] * sw1[i];
+            process_t t = envelope[t0[i]] * tw0[i] + envelope[t1[i]] * tw1[i];
+            process_t ratio = s / t;
+            process_t above = (ratio < minRatio ? minRatio : ratio);
+            process_t clamped = (above > maxRatio ? maxRatio : above);
+            process_t factor = (t > 0.0 ? clamped : 1.0);
+            mag[i] *= factor;
         }
     }
 }
@@ -1523,7 +1856,7 @@ R3Stretcher::adjustPreKick(int c)
     auto &cd = m_channelData.at(c);
     auto fftSize = cd->guidance.fftBands[0].fftSize;
     if (cd->guidance.preKick.present) {
-        auto &scale = cd->scales.at(fftSize);
+        auto &scale = cd->scales[0];
         int from = binForFrequency(cd->guidance.preKick.f0,
                                    fftSize, m_parameters.sampleRate);
         int to = binForFrequency(cd->guidance.preKick.f1,
@@ -1536,7 +1869,7 @@ R3Stretcher::adjustPreKick(int c)
             }
         }
     } else if (cd->guidance.kick.present) {
-        auto &scale = cd->scales.at(fftSize);
+        auto &scale = cd->scales[0];
         int from = binForFrequency(cd->guidance.preKick.f0,
                                    fftSize, m_parameters.sampleRate);
         int to = binForFrequency(cd->guidance.preKick.f1,
@@ -1549,90 +1882,106 @@ R3Stretcher::adjustPreKick(int c)
 }
 
 void
-R3Stretcher::synthesiseChannel(int c, int outhop, bool draining)
+R3Stretcher::synthesiseScale(int c, int b, int outhop)
 {
-    Profiler profiler("R3Stretcher::synthesiseChannel");
+    Profiler profiler("R3Stretcher::synthesiseScale");
     
     int longest = m_guideConfiguration.longestFftSize;
 
     auto &cd = m_channelData.at(c);
 
-    for (int b = 0; b < cd->guidance.fftBandCount; ++b) {
+    if (b >= cd->guidance.fftBandCount) return;
 
-        const auto &band = cd->guidance.fftBands[b];
-        int fftSize = band.fftSize;
+    // The pre-kick adjustment only ever touches the scale for the
+    // first band, so it is carried out here with that band rather
+    // than separately
+    if (b == 0) {
+        adjustPreKick(c);
+    }
+    
+    const auto &band = cd->guidance.fftBands[b];
+    int fftSize = band.fftSize;
         
-        auto &scale = cd->scales.at(fftSize);
-        auto &scaleData = m_scaleData.at(fftSize);
+    auto &scale = cd->scales[b];
+    auto &scaleData = m_scaleData[b];
 
-        // copy to prevMag before filtering
-        v_copy(scale->prevMag.data(),
-               scale->mag.data(),
-               scale->bufSize);
+    // copy to prevMag before filtering
+    v_copy(scale->prevMag.data(),
+           scale->mag.data(),
+           scale->bufSize);
 
-        process_t winscale = process_t(outhop) / scaleData->windowScaleFactor;
+    process_t winscale = process_t(outhop) / scaleData->windowScaleFactor;
 
-        // The frequency filter is applied naively in the frequency
-        // domain. Aliasing is reduced by the shorter resynthesis
-        // window. We resynthesise each scale individually, then sum -
-        // it's easier to manage scaling for in situations with a
-        // varying resynthesis hop
+    // The frequency filter is applied naively in the frequency
+    // domain. Aliasing is reduced by the shorter resynthesis
+    // window. We resynthesise each scale individually, then sum in
+    // mixChannel - it's easier to manage scaling for in situations
+    // with a varying resynthesis hop
             
-        int lowBin = binForFrequency(band.f0, fftSize, m_parameters.sampleRate);
-        int highBin = binForFrequency(band.f1, fftSize, m_parameters.sampleRate);
-        if (highBin % 2 == 0 && highBin > 0) --highBin;
-
-        int n = scale->mag.size();
-        if (lowBin >= n) lowBin = n - 1;
-        if (highBin >= n) highBin = n - 1;
-        if (highBin < lowBin) highBin = lowBin;
+    int lowBin = binForFrequency(band.f0, fftSize, m_parameters.sampleRate);
+    int highBin = binForFrequency(band.f1, fftSize, m_parameters.sampleRate);
+    if (highBin % 2 == 0 && highBin > 0) --highBin;
+
+    int n = scale->mag.size();
+    if (lowBin >= n) lowBin = n - 1;
+    if (highBin >= n) highBin = n - 1;
+    if (highBin < lowBin) highBin = lowBin;
         
-        if (lowBin > 0) {
-            v_zero(scale->real.data(), lowBin);
-            v_zero(scale->imag.data(), lowBin);
-        }
+    if (lowBin > 0) {
+        v_zero(scale->real.data(), lowBin);
+        v_zero(scale->imag.data(), lowBin);
+    }
 
-        v_scale(scale->mag.data() + lowBin, winscale, highBin - lowBin);
+    v_scale(scale->mag.data() + lowBin, winscale, highBin - lowBin);
 
-        v_polar_to_cartesian(scale->real.data() + lowBin,
-                             scale->imag.data() + lowBin,
-                             scale->mag.data() + lowBin,
-                             scale->advancedPhase.data() + lowBin,
-                             highBin - lowBin);
+    v_polar_to_cartesian(scale->real.data() + lowBin,
+                         scale->imag.data() + lowBin,
+                         scale->mag.data() + lowBin,
+                         scale->advancedPhase.data() + lowBin,
+                         highBin - lowBin);
         
-        if (highBin < scale->bufSize) {
-            v_zero(scale->real.data() + highBin, scale->bufSize - highBin);
-            v_zero(scale->imag.data() + highBin, scale->bufSize - highBin);
-        }
+    if (highBin < scale->bufSize) {
+        v_zero(scale->real.data() + highBin, scale->bufSize - highBin);
+        v_zero(scale->imag.data() + highBin, scale->bufSize - highBin);
+    }
 
-        scaleData->fft.inverse(scale->real.data(),
-                               scale->imag.data(),
-                               scale->timeDomain.data());
+    getFFT(b, *scale).inverse(scale->real.data(),
+                           scale->imag.data(),
+                           scale->timeDomain.data());
         
-        v_fftshift(scale->timeDomain.data(), fftSize);
+    v_fftshift(scale->timeDomain.data(), fftSize);
 
-        // Synthesis window may be shorter than analysis window, so
-        // copy and cut only from the middle of the time-domain frame;
-        // and the accumulator length always matches the longest FFT
-        // size, so as to make mixing straightforward, so there is an
-        // additional offset needed for the target
+    // Synthesis window may be shorter than analysis window, so copy
+    // and cut only from the middle of the time-domain frame; and the
+    // accumulator length always matches the longest FFT size, so as
+    // to make mixing straightforward, so there is an additional
+    // offset needed for the target
                 
-        int synthesisWindowSize = scaleData->synthesisWindow.getSize();
-        int fromOffset = (fftSize - synthesisWindowSize) / 2;
-        int toOffset = (longest - synthesisWindowSize) / 2;
+    int synthesisWindowSize = scaleData->synthesisWindow.getSize();
+    int fromOffset = (fftSize - synthesisWindowSize) / 2;
+    int toOffset = (longest - synthesisWindowSize) / 2;
 
-        scaleData->synthesisWindow.cutAndAdd
-            (scale->timeDomain.data() + fromOffset,
-             scale->accumulator.data() + toOffset);
-    }
+    scaleData->synthesisWindow.cutAndAdd
+        (scale->timeDomain.data() + fromOffset,
+         scale->accumulator.data() + toOffset);
+}
+
+void
+R3Stretcher::mixChannel(int c, int outhop, bool draining)
+{
+    Profiler profiler("R3Stretcher::mixChannel");
+
+    auto &cd = m_channelData.at(c);
 
     // Mix this channel and move the accumulator along
             
     float *mixptr = cd->mixdown.data();
     v_zero(mixptr, outhop);
 
-    for (auto &it : cd->scales) {
-        auto &scale = it.second;
+    // Summed in ascending order of FFT size, always the same order
+    // whichever thread gets here, so that the result is repeatable
+    for (int b : m_scalesBySize) {
+        auto &scale = cd->scales[b];
 
         process_t *accptr = scale->accumulator.data();
         for (int i = 0; i < outhop; ++i) {
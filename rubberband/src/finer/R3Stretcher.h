@@ -33,10 +33,12 @@
 #include "../common/Resampler.h"
 #include "../common/FFT.h"
 #include "../common/FixedVector.h"
+#include "../common/MirroredRingBuffer.h"
 #include "../common/Allocators.h"
 #include "../common/Window.h"
 #include "../common/VectorOpsComplex.h"
 #include "../common/Log.h"
+#include "../common/WorkerPool.h"
 
 #include "../../rubberband/RubberBandStretcher.h"
 
@@ -97,7 +99,7 @@ public:
     void setDebugLevel(int level) {
         m_log.setDebugLevel(level);
         for (auto &sd : m_scaleData) {
-            sd.second->guided.setDebugLevel(level);
+            sd->guided.setDebugLevel(level);
         }
         m_guide.setDebugLevel(level);
         m_calculator->setDebugLevel(level);
@@ -144,35 +146,69 @@ protected:
         ClassificationReadaheadData &operator=(const ClassificationReadaheadData &) =delete;
     };
     
+    // A fixed-size array within a channel's scale arena (see
+    // ChannelData), with the part of the FixedVector interface that
+    // the scale code uses
+    struct ArenaArray {
+        process_t *ptr;
+        int n;
+        ArenaArray(process_t *&arena, int _n) : ptr(arena), n(_n) {
+            arena += paddedSize(n);
+        }
+        process_t *data() const { return ptr; }
+        int size() const { return n; }
+        process_t &operator[](int i) const { return ptr[i]; }
+
+        // Each array starts on a cache line of its own
+        static int paddedSize(int n) {
+            const int line = 64 / int(sizeof(process_t));
+            return ((n + line - 1) / line) * line;
+        }
+    };
+    
     struct ChannelScaleData {
         int fftSize;
         int bufSize; // size of every freq-domain array here: fftSize/2 + 1
-        FixedVector<process_t> timeDomain;
-        FixedVector<process_t> real;
-        FixedVector<process_t> imag;
-        FixedVector<process_t> mag;
-        FixedVector<process_t> phase;
-        FixedVector<process_t> advancedPhase;
-        FixedVector<process_t> prevMag;
-        FixedVector<process_t> pendingKick;
-        FixedVector<process_t> accumulator;
+        ArenaArray timeDomain;
+        ArenaArray real;
+        ArenaArray imag;
+        ArenaArray mag;
+        ArenaArray phase;
+        ArenaArray advancedPhase;
+        ArenaArray prevMag;
+        ArenaArray pendingKick;
+        ArenaArray accumulator;
         int accumulatorFill;
 
-        ChannelScaleData(int _fftSize, int _longestFftSize) :
+        // Present only when channels are processed in parallel, as
+        // an FFT object cannot be shared between threads. Otherwise
+        // the one in ScaleData is used
+        std::unique_ptr<FFT> fft;
+
+        // The arrays are taken in order from the zero-filled arena,
+        // which is advanced past them
+        ChannelScaleData(int _fftSize, int _longestFftSize,
+                         process_t *&arena) :
             fftSize(_fftSize),
             bufSize(fftSize/2 + 1),
-            timeDomain(fftSize, 0.f),
-            real(bufSize, 0.f),
-            imag(bufSize, 0.f),
-            mag(bufSize, 0.f),
-            phase(bufSize, 0.f),
-            advancedPhase(bufSize, 0.f),
-            prevMag(bufSize, 0.f),
-            pendingKick(bufSize, 0.f),
-            accumulator(_longestFftSize, 0.f),
+            timeDomain(arena, fftSize),
+            real(arena, bufSize),
+            imag(arena, bufSize),
+            mag(arena, bufSize),
+            phase(arena, bufSize),
+            advancedPhase(arena, bufSize),
+            prevMag(arena, bufSize),
+            pendingKick(arena, bufSize),
+            accumulator(arena, _longestFftSize),
             accumulatorFill(0)
         { }
 
+        static int arenaSize(int fftSize, int longestFftSize) {
+            return ArenaArray::paddedSize(fftSize) +
+                ArenaArray::paddedSize(fftSize/2 + 1) * 7 +
+                ArenaArray::paddedSize(longestFftSize);
+        }
+
         void reset() {
             v_zero(prevMag.data(), prevMag.size());
             v_zero(pendingKick.data(), pendingKick.size());
@@ -196,25 +232,64 @@ protected:
             cepstra(_fftSize, 0.0),
             envelope(_fftSize/2 + 1, 0.0),
             spare(_fftSize/2 + 1, 0.0) { }
+    };
 
-        process_t envelopeAt(process_t bin) const {
-            int b0 = int(floor(bin)), b1 = int(ceil(bin));
-            if (b0 < 0 || b0 > fftSize/2) {
-                return 0.0;
-            } else if (b1 == b0 || b1 > fftSize/2) {
-                return envelope.at(b0);
-            } else {
-                process_t diff = bin - process_t(b0);
-                return envelope.at(b0) * (1.0 - diff) + envelope.at(b1) * diff;
+    struct FormantLookup {
+        // For each bin of a scale, the two formant envelope bins to
+        // interpolate between and their weights. A position past the
+        // end of the envelope has zero weights, and one with nothing
+        // to interpolate toward has the same bin twice
+        FixedVector<int> bin0;
+        FixedVector<int> bin1;
+        FixedVector<process_t> weight0;
+        FixedVector<process_t> weight1;
+
+        FormantLookup(int binCount) :
+            bin0(binCount, 0),
+            bin1(binCount, 0),
+            weight0(binCount, 0.0),
+            weight1(binCount, 0.0) { }
+
+        void calculate(int from, int to, process_t factor,
+                       int envelopeFftSize) {
+            int last = envelopeFftSize/2;
+            for (int i = from; i < to; ++i) {
+                process_t bin = i * factor;
+                int b0 = int(floor(bin)), b1 = int(ceil(bin));
+                if (b0 < 0 || b0 > last) {
+                    bin0[i] = 0;
+                    bin1[i] = 0;
+                    weight0[i] = 0.0;
+                    weight1[i] = 0.0;
+                } else if (b1 == b0 || b1 > last) {
+                    bin0[i] = b0;
+                    bin1[i] = b0;
+                    weight0[i] = 1.0;
+                    weight1[i] = 0.0;
+                } else {
+                    process_t diff = bin - process_t(b0);
+                    bin0[i] = b0;
+                    bin1[i] = b1;
+                    weight0[i] = 1.0 - diff;
+                    weight1[i] = diff;
+                }
             }
         }
     };
 
     struct ChannelData {
-        std::map<int, std::shared_ptr<ChannelScaleData>> scales;
-        FixedVector<process_t> windowSource;
+        // One per FFT band of the guide configuration, in the same
+        // order, with all their arrays in the one scaleArena
+        std::vector<std::unique_ptr<ChannelScaleData>> scales;
+        process_t *scaleArena;
+        // The unwindowed frame for the current hop, which is usually
+        // viewed in place in inbuf, but is copied out and padded
+        // into windowSource when inbuf has less than a full frame
+        FixedVector<float> windowSource;
+        const float *windowFrame;
         ClassificationReadaheadData readahead;
         bool haveReadahead;
+        bool copyFromReadahead; // for the current frame
         std::unique_ptr<BinClassifier> classifier;
         FixedVector<BinClassifier::Classification> classification;
         FixedVector<BinClassifier::Classification> nextClassification;
@@ -225,19 +300,23 @@ protected:
         Guide::Guidance guidance;
         FixedVector<float> mixdown;
         FixedVector<float> resampled;
-        std::unique_ptr<RingBuffer<float>> inbuf;
+        std::unique_ptr<MirroredRingBuffer<float>> inbuf;
         std::unique_ptr<RingBuffer<float>> outbuf;
         std::unique_ptr<FormantData> formant;
-        ChannelData(BinSegmenter::Parameters segmenterParameters,
+        ChannelData(const Guide::Configuration &guideConfiguration,
+                    BinSegmenter::Parameters segmenterParameters,
                     BinClassifier::Parameters classifierParameters,
                     int windowSourceSize,
                     int inRingBufferSize,
                     int outRingBufferSize,
                     int hopBufferSize) :
             scales(),
-            windowSource(windowSourceSize, 0.0),
+            scaleArena(nullptr),
+            windowSource(windowSourceSize, 0.f),
+            windowFrame(windowSource.data()),
             readahead(segmenterParameters.fftSize),
             haveReadahead(false),
+            copyFromReadahead(false),
             classifier(new BinClassifier(classifierParameters)),
             classification(classifierParameters.binCount,
                            BinClassifier::Classification::Residual),
@@ -247,11 +326,32 @@ protected:
             segmentation(), prevSegmentation(), nextSegmentation(),
             mixdown(inRingBufferSize, 0.f),
             resampled(hopBufferSize, 0.f),
-            inbuf(new RingBuffer<float>(inRingBufferSize)),
+            inbuf(new MirroredRingBuffer<float>(inRingBufferSize,
+                                                windowSourceSize)),
             outbuf(new RingBuffer<float>(outRingBufferSize)),
-            formant(new FormantData(segmenterParameters.fftSize)) { }
+            formant(new FormantData(segmenterParameters.fftSize)) {
+            int longest = guideConfiguration.longestFftSize;
+            int arenaSize = 0;
+            for (int b = 0; b < guideConfiguration.fftBandLimitCount; ++b) {
+                arenaSize += ChannelScaleData::arenaSize
+                    (guideConfiguration.fftBandLimits[b].fftSize, longest);
+            }
+            scaleArena = allocate_and_zero<process_t>(arenaSize);
+            process_t *arena = scaleArena;
+            for (int b = 0; b < guideConfiguration.fftBandLimitCount; ++b) {
+                scales.push_back(std::unique_ptr<ChannelScaleData>
+                                 (new ChannelScaleData
+                                  (guideConfiguration.fftBandLimits[b].fftSize,
+                                   longest, arena)));
+            }
+        }
+        ~ChannelData() {
+            scales.clear();
+            deallocate(scaleArena);
+        }
         void reset() {
             haveReadahead = false;
+            copyFromReadahead = false;
             classifier->reset();
             segmentation = BinSegmenter::Segmentation();
             prevSegmentation = BinSegmenter::Segmentation();
@@ -262,7 +362,51 @@ protected:
             inbuf->reset();
             outbuf->reset();
             for (auto &s : scales) {
-                s.second->reset();
+                s->reset();
+            }
+        }
+
+    private:
+        ChannelData(const ChannelData &) =delete;
+        ChannelData &operator=(const ChannelData &) =delete;
+    };
+
+    struct SharedAnalysisData {
+        // Classification and guidance worked out once per hop from
+        // the mean magnitudes of all channels, then handed to every
+        // channel, when they are linked or when they are processed
+        // together and there are more than two of them
+        FixedVector<process_t> mag;
+        FixedVector<process_t> prevMag;
+        FixedVector<process_t> readaheadMag;
+        std::unique_ptr<BinClassifier> classifier;
+        FixedVector<BinClassifier::Classification> classification;
+        FixedVector<BinClassifier::Classification> nextClassification;
+        std::unique_ptr<BinSegmenter> segmenter;
+        BinSegmenter::Segmentation segmentation;
+        BinSegmenter::Segmentation prevSegmentation;
+        BinSegmenter::Segmentation nextSegmentation;
+        Guide::Guidance guidance;
+        SharedAnalysisData(BinSegmenter::Parameters segmenterParameters,
+                           BinClassifier::Parameters classifierParameters) :
+            mag(segmenterParameters.fftSize/2 + 1, 0.f),
+            prevMag(segmenterParameters.fftSize/2 + 1, 0.f),
+            readaheadMag(segmenterParameters.fftSize/2 + 1, 0.f),
+            classifier(new BinClassifier(classifierParameters)),
+            classification(classifierParameters.binCount,
+                           BinClassifier::Classification::Residual),
+            nextClassification(classifierParameters.binCount,
+                               BinClassifier::Classification::Residual),
+            segmenter(new BinSegmenter(segmenterParameters)),
+            segmentation(), prevSegmentation(), nextSegmentation() { }
+        void reset() {
+            v_zero(prevMag.data(), prevMag.size());
+            classifier->reset();
+            segmentation = BinSegmenter::Segmentation();
+            prevSegmentation = BinSegmenter::Segmentation();
+            nextSegmentation = BinSegmenter::Segmentation();
+            for (size_t i = 0; i < nextClassification.size(); ++i) {
+                nextClassification[i] = BinClassifier::Classification::Residual;
             }
         }
     };
@@ -294,6 +438,12 @@ protected:
         Window<process_t> synthesisWindow;
         process_t windowScaleFactor;
         GuidedPhaseAdvance guided;
+        ChannelAssembly assembly; // for guided, one per scale so
+                                  // that scales can run in parallel
+        int formantFrom; // bins adjusted for formant preservation
+        int formantTo;
+        FormantLookup formantSource; // depends on the formant scale
+        FormantLookup formantTarget;
 
         ScaleData(GuidedPhaseAdvance::Parameters guidedParameters,
                   Log log) :
@@ -305,7 +455,12 @@ protected:
             synthesisWindow(synthesisWindowShape(),
                             synthesisWindowLength()),
             windowScaleFactor(0.0),
-            guided(guidedParameters, log)
+            guided(guidedParameters, log),
+            assembly(guidedParameters.channels),
+            formantFrom(0),
+            formantTo(0),
+            formantSource(fftSize/2 + 1),
+            formantTarget(fftSize/2 + 1)
         {
             int asz = analysisWindow.getSize(), ssz = synthesisWindow.getSize();
             int off = (asz - ssz) / 2;
@@ -330,7 +485,12 @@ protected:
     std::atomic<double> m_formantScale;
     
     std::vector<std::shared_ptr<ChannelData>> m_channelData;
-    std::map<int, std::shared_ptr<ScaleData>> m_scaleData;
+    std::unique_ptr<SharedAnalysisData> m_sharedAnalysis;
+    bool m_threaded;
+    std::vector<std::unique_ptr<ScaleData>> m_scaleData; // per FFT band
+    int m_classifyScale; // index in m_scaleData and ChannelData::scales
+    int m_longestScale;
+    std::vector<int> m_scalesBySize; // indices in ascending size order
     Guide m_guide;
     Guide::Configuration m_guideConfiguration;
     ChannelAssembly m_channelAssembly;
@@ -341,6 +501,11 @@ protected:
     int m_prevInhop;
     int m_prevOuthop;
     uint32_t m_unityCount;
+    int m_formantInterval; // input between formant envelope analyses
+    int m_formantAge; // input since the last analysis, or -1 if stale
+    double m_formantLookupScale; // formant scale of the source lookups
+    bool m_analyseFormant; // for the current frame
+    bool m_adjustFormant; // for the current frame
     int m_startSkip;
 
     size_t m_studyInputDuration;
@@ -367,17 +532,26 @@ protected:
     void ensureOutbuf(int, bool warn = true);
     void calculateHop();
     void updateRatioFromMap();
-    void analyseChannel(int channel, int inhop, int prevInhop, int prevOuthop);
+    FFT &getFFT(int band, ChannelScaleData &scale);
+    void prepareAnalysis(int channel, int inhop, int prevInhop);
+    void analyseScale(int channel, int band, int inhop);
+    void completeAnalysis(int channel, int prevOuthop);
+    void updateChannelGuidance(int channel, int prevOuthop);
+    void updateSharedGuidance(int prevOuthop);
+    void advanceScale(int band);
+    void prepareFormant(int prevInhop);
     void analyseFormant(int channel);
     void adjustFormant(int channel);
     void adjustPreKick(int channel);
-    void synthesiseChannel(int channel, int outhop, bool draining);
+    void synthesiseScale(int channel, int band, int outhop);
+    void mixChannel(int channel, int outhop, bool draining);
 
     struct ToPolarSpec {
         int magFromBin;
         int magBinCount;
         int polarFromBin;
         int polarBinCount;
+        process_t magGain;
     };
 
     Parameters validateSampleRate(const Parameters &params) {
@@ -398,23 +572,27 @@ protected:
     void convertToPolar(process_t *mag, process_t *phase,
                         const process_t *real, const process_t *imag,
                         const ToPolarSpec &s) const {
-        v_cartesian_to_polar(mag + s.polarFromBin,
-                             phase + s.polarFromBin,
-                             real + s.polarFromBin,
-                             imag + s.polarFromBin,
-                             s.polarBinCount);
+        v_cartesian_to_polar_scaled(mag + s.polarFromBin,
+                                    phase + s.polarFromBin,
+                                    real + s.polarFromBin,
+                                    imag + s.polarFromBin,
+                                    s.magGain,
+                                    s.polarBinCount);
         if (s.magFromBin < s.polarFromBin) {
-            v_cartesian_to_magnitudes(mag + s.magFromBin,
-                                      real + s.magFromBin,
-                                      imag + s.magFromBin,
-                                      s.polarFromBin - s.magFromBin);
+            v_cartesian_to_magnitudes_scaled(mag + s.magFromBin,
+                                             real + s.magFromBin,
+                                             imag + s.magFromBin,
+                                             s.magGain,
+                                             s.polarFromBin - s.magFromBin);
         }
         if (s.magFromBin + s.magBinCount > s.polarFromBin + s.polarBinCount) {
-            v_cartesian_to_magnitudes(mag + s.polarFromBin + s.polarBinCount,
-                                      real + s.polarFromBin + s.polarBinCount,
-                                      imag + s.polarFromBin + s.polarBinCount,
-                                      s.magFromBin + s.magBinCount -
-                                      s.polarFromBin - s.polarBinCount);
+            v_cartesian_to_magnitudes_scaled
+                (mag + s.polarFromBin + s.polarBinCount,
+                 real + s.polarFromBin + s.polarBinCount,
+                 imag + s.polarFromBin + s.polarBinCount,
+                 s.magGain,
+                 s.magFromBin + s.magBinCount -
+                 s.polarFromBin - s.polarBinCount);
         }
     }
     
@@ -488,6 +666,33 @@ protected:
              RubberBandStretcher::OptionChannelsTogether);
     }
     
+    bool useThreads() const;
+
+    // Run f(i) for i in [0, count), across the shared worker pool
+    // if threaded. Tasks must be independent, so the result is the
+    // same either way
+    template <typename F>
+    void runTasks(int count, F &&f) {
+#ifndef NO_THREADING
+        if (m_threaded) {
+            SharedWorkerPool::getInstance().run(count, f);
+            return;
+        }
+#endif
+        for (int i = 0; i < count; ++i) {
+            f(i);
+        }
+    }
+
+    bool useSharedAnalysis() const {
+        if (m_parameters.channels < 2 || useMidSide()) {
+            return false;
+        }
+        return m_parameters.options &
+            (RubberBandStretcher::OptionChannelsTogether |
+             RubberBandStretcher::OptionChannelsLinked);
+    }
+
     bool isSingleWindowed() const {
         return m_parameters.options &
             RubberBandStretcher::OptionWindowShort;
@@ -0,0 +1,253 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Rubber Band Library
+    An audio time-stretching and pitch-shifting library.
+    Copyright 2007-2023 Particular Programs Ltd.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+
+    Alternatively, if you have a valid commercial licence for the
+    Rubber Band Library obtained by agreement with the copyright
+    holders, you may redistribute and/or modify it under the terms
+    described in that licence.
+
+    If you wish to distribute code using the Rubber Band Library
+    under terms other than those of the GNU General Public License,
+    you must obtain a valid commercial licence before doing so.
+*/
+
+#ifndef BOOST_TEST_DYN_LINK
+#define BOOST_TEST_DYN_LINK
+#endif
+#include <boost/test/unit_test.hpp>
+
+#include "../faster/PercussiveAudioCurve.h"
+#include "../faster/HighFrequencyAudioCurve.h"
+#include "../faster/CompoundAudioCurve.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+using namespace RubberBand;
+
+using std::vector;
+
+// The percussive curve as it was written before it was made
+// branch-free, to compare the vector versions against
+
+template <typename T>
+class ReferencePercussiveCurve
+{
+public:
+    ReferencePercussiveCurve(int lastPerceivedBin) :
+        m_sz(lastPerceivedBin),
+        m_prevMag(lastPerceivedBin + 1, 0.0) { }
+
+    T process(const T *mag) {
+        const T threshold = (sizeof(T) == sizeof(float) ?
+                             T(powf(10.f, 0.15f)) : T(pow(10., 0.15)));
+        const T zeroThresh = (sizeof(T) == sizeof(float) ?
+                              T(powf(10.f, -8)) : T(pow(10., -8)));
+        int count = 0;
+        int nonZeroCount = 0;
+        for (int n = 1; n <= m_sz; ++n) {
+            T v = 0;
+            if (m_prevMag[n] > zeroThresh) v = mag[n] / m_prevMag[n];
+            else if (mag[n] > zeroThresh) v = threshold;
+            bool above = (v >= threshold);
+            if (above) ++count;
+            if (mag[n] > zeroThresh) ++nonZeroCount;
+        }
+        for (int n = 0; n <= m_sz; ++n) {
+            m_prevMag[n] = mag[n];
+        }
+        if (nonZeroCount == 0) return 0;
+        else return T(count) / T(nonZeroCount);
+    }
+
+private:
+    int m_sz;
+    vector<double> m_prevMag;
+};
+
+// Magnitude columns that rise and fall, with silent and near-silent
+// bins and some columns repeated exactly, so as to reach each case
+// of the comparisons
+
+template <typename T>
+static vector<vector<T>> make_columns(int bins, int count)
+{
+    vector<vector<T>> columns;
+    srand(7);
+    for (int i = 0; i < count; ++i) {
+        if (i % 5 == 4) {
+            columns.push_back(columns.back());
+            continue;
+        }
+        vector<T> column(bins);
+        for (int j = 0; j < bins; ++j) {
+            int r = rand() % 20;
+            if (r == 0) column[j] = 0;
+            else if (r == 1) column[j] = T(1.0e-9);
+            else column[j] = T(rand()) / T(RAND_MAX);
+        }
+        if (i % 7 == 3) {
+            for (int j = 0; j < bins; ++j) column[j] = 0;
+        }
+        columns.push_back(column);
+    }
+    return columns;
+}
+
+template <typename T>
+static T process(PercussiveAudioCurve &curve, const T *mag);
+
+template <>
+float process(PercussiveAudioCurve &curve, const float *mag)
+{
+    return curve.processFloat(mag, 256);
+}
+
+template <>
+double process(PercussiveAudioCurve &curve, const double *mag)
+{
+    return curve.processDouble(mag, 256);
+}
+
+template <typename T>
+static T process(HighFrequencyAudioCurve &curve, const T *mag);
+
+template <>
+float process(HighFrequencyAudioCurve &curve, const float *mag)
+{
+    return curve.processFloat(mag, 256);
+}
+
+template <>
+double process(HighFrequencyAudioCurve &curve, const double *mag)
+{
+    return curve.processDouble(mag, 256);
+}
+
+template <typename T>
+static void percussive_matches_reference(int sampleRate, int fftSize)
+{
+    AudioCurveCalculator::Parameters parameters(sampleRate, fftSize);
+    PercussiveAudioCurve curve(parameters);
+
+    // As AudioCurveCalculator, which looks no higher than 16kHz
+    int bins = fftSize / 2 + 1;
+    int sz = std::min((16000 * fftSize) / sampleRate, fftSize / 2);
+
+    ReferencePercussiveCurve<T> reference(sz);
+
+    auto columns = make_columns<T>(bins, 40);
+    for (const auto &column : columns) {
+        T expected = reference.process(column.data());
+        T actual = process(curve, column.data());
+        BOOST_TEST(actual == expected);
+    }
+}
+
+template <typename T>
+static void fused_matches_separate(int sampleRate, int fftSize)
+{
+    AudioCurveCalculator::Parameters parameters(sampleRate, fftSize);
+    PercussiveAudioCurve fused(parameters);
+    PercussiveAudioCurve percussive(parameters);
+    HighFrequencyAudioCurve hf(parameters);
+
+    auto columns = make_columns<T>(fftSize / 2 + 1, 40);
+    for (const auto &column : columns) {
+        T fusedHf = 0;
+        T fusedPercussive = fused.processWithHighFrequency
+            (column.data(), fusedHf);
+        BOOST_TEST(fusedPercussive == process(percussive, column.data()));
+        BOOST_TEST(fusedHf == process(hf, column.data()));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(TestAudioCurves)
+
+BOOST_AUTO_TEST_CASE(percussive_matches_reference_float)
+{
+    percussive_matches_reference<float>(44100, 2048);
+    percussive_matches_reference<float>(48000, 1024);
+    percussive_matches_reference<float>(22050, 512);
+}
+
+BOOST_AUTO_TEST_CASE(percussive_matches_reference_double)
+{
+    percussive_matches_reference<double>(44100, 2048);
+    percussive_matches_reference<double>(48000, 1024);
+    percussive_matches_reference<double>(22050, 512);
+}
+
+BOOST_AUTO_TEST_CASE(percussive_with_hf_matches_separate_float)
+{
+    fused_matches_separate<float>(44100, 2048);
+    fused_matches_separate<float>(48000, 1024);
+    fused_matches_separate<float>(22050, 512);
+}
+
+BOOST_AUTO_TEST_CASE(percussive_with_hf_matches_separate_double)
+{
+    fused_matches_separate<double>(44100, 2048);
+    fused_matches_separate<double>(48000, 1024);
+    fused_matches_separate<double>(22050, 512);
+}
+
+// Disabled by default, as it takes a while and checks nothing; run
+// with --run_test=TestAudioCurves/benchmark_compound --log_level=message
+
+BOOST_AUTO_TEST_CASE(benchmark_compound,
+                     * boost::unit_test::disabled())
+{
+    int fftSize = 2048;
+    int iterations = 200;
+    CompoundAudioCurve curve
+        (AudioCurveCalculator::Parameters(44100, fftSize));
+
+    auto doubles = make_columns<double>(fftSize / 2 + 1, 400);
+    auto floats = make_columns<float>(fftSize / 2 + 1, 400);
+
+    double total = 0.0;
+
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        for (const auto &column : doubles) {
+            total += curve.processDouble(column.data(), 512);
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+    BOOST_TEST_MESSAGE("compound curve, double: "
+                       << ns / (iterations * doubles.size())
+                       << " ns per column");
+
+    curve.reset();
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        for (const auto &column : floats) {
+            total += curve.processFloat(column.data(), 512);
+        }
+    }
+    end = std::chrono::steady_clock::now();
+    ns = std::chrono::duration<double, std::nano>(end - start).count();
+    BOOST_TEST_MESSAGE("compound curve, float: "
+                       << ns / (iterations * floats.size())
+                       << " ns per column");
+
+    BOOST_TEST(total >= 0.0);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -31,6 +31,10 @@
 #include "../finer/BinSegmenter.h"
 
 #include "../common/sysutils.h"
+#include "../common/MovingMedian.h"
+
+#include <chrono>
+#include <cstdlib>
 
 using namespace RubberBand;
 
@@ -188,6 +192,111 @@ BOOST_AUTO_TEST_CASE(segment_classification)
     }
 }
 
-BOOST_AUTO_TEST_SUITE_END()
+// Benchmarks. These are disabled by default, as they take a while and
+// check little; run one explicitly with e.g.
+// --run_test=TestBinClassifier/benchmark_horizontal_median --log_level=message
+
+static vector<vector<process_t>> benchmark_columns(int bins, int count)
+{
+    vector<vector<process_t>> columns(count, vector<process_t>(bins));
+    srand(0);
+    for (auto &col : columns) {
+        for (auto &v : col) {
+            v = process_t(rand()) / process_t(RAND_MAX);
+        }
+    }
+    return columns;
+}
+
+static double elapsed_ms(std::chrono::steady_clock::time_point start)
+{
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+BOOST_AUTO_TEST_CASE(benchmark_horizontal_median,
+                     * boost::unit_test::disabled())
+{
+    // One channel's classification bins at 48kHz, for about a
+    // minute of hops
+    int bins = 1025, len = 9, hops = 10000;
+    auto columns = benchmark_columns(bins, 64);
+    vector<process_t> stackOut(bins), batchOut(bins);
 
+    MovingMedianStack<process_t> stack(bins, len);
+    auto start = std::chrono::steady_clock::now();
+    for (int h = 0; h < hops; ++h) {
+        const auto &col = columns[h % columns.size()];
+        for (int i = 0; i < bins; ++i) {
+            stack.push(i, col[i]);
+            stackOut[i] = stack.get(i);
+        }
+    }
+    double stackMs = elapsed_ms(start);
+
+    MovingMedianBatch<process_t> batch(bins, len);
+    start = std::chrono::steady_clock::now();
+    for (int h = 0; h < hops; ++h) {
+        batch.push(columns[h % columns.size()].data());
+        batch.get(batchOut.data());
+    }
+    double batchMs = elapsed_ms(start);
+
+    BOOST_TEST(batchOut == stackOut, tt::per_element());
+    BOOST_TEST_MESSAGE("horizontal median, " << bins << " bins, length "
+                       << len << ", " << hops << " hops: per-bin stack "
+                       << stackMs << " ms, batch " << batchMs << " ms");
+}
 
+BOOST_AUTO_TEST_CASE(benchmark_vertical_median,
+                     * boost::unit_test::disabled())
+{
+    int bins = 1025, hops = 10000;
+    auto columns = benchmark_columns(bins, 64);
+    vector<process_t> singleOut(bins), batchOut(bins);
+
+    for (int len : { 10, 16, 32 }) {
+
+        MovingMedian<process_t> single(len);
+        auto start = std::chrono::steady_clock::now();
+        for (int h = 0; h < hops; ++h) {
+            const auto &col = columns[h % columns.size()];
+            v_copy(singleOut.data(), col.data(), bins);
+            MovingMedian<process_t>::filter(single, singleOut.data(), bins);
+        }
+        double singleMs = elapsed_ms(start);
+
+        MovingMedianBatch<process_t> batch(16, len);
+        start = std::chrono::steady_clock::now();
+        for (int h = 0; h < hops; ++h) {
+            const auto &col = columns[h % columns.size()];
+            batch.filter(col.data(), batchOut.data(), bins);
+        }
+        double batchMs = elapsed_ms(start);
+
+        BOOST_TEST(batchOut == singleOut, tt::per_element());
+        BOOST_TEST_MESSAGE("vertical median, " << bins << " bins, length "
+                           << len << ", " << hops << " hops: single "
+                           << singleMs << " ms, batch " << batchMs << " ms");
+    }
+}
+
+BOOST_AUTO_TEST_CASE(benchmark_classify,
+                     * boost::unit_test::disabled())
+{
+    int bins = 1025, hops = 10000;
+    auto columns = benchmark_columns(bins, 64);
+    vector<BinClassifier::Classification> classification(bins);
+
+    BinClassifier::Parameters params(bins, 9, 1, 10, 2.0, 2.0);
+    BinClassifier classifier(params);
+    auto start = std::chrono::steady_clock::now();
+    for (int h = 0; h < hops; ++h) {
+        classifier.classify(columns[h % columns.size()].data(),
+                            classification.data());
+    }
+    BOOST_TEST_MESSAGE("classify, " << bins << " bins, " << hops
+                       << " hops: " << elapsed_ms(start) << " ms");
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -27,8 +27,12 @@
 #include <boost/test/unit_test.hpp>
 
 #include "../common/FFT.h"
+#include "../common/Window.h"
+#include "../common/VectorOpsComplex.h"
 
 #include <iostream>
+#include <vector>
+#include <chrono>
 
 #include <cstdio>
 #include <cmath>
@@ -722,4 +726,90 @@ ALL_IMPL_AUTO_TEST_CASE(random)
     delete[] in;
 }
 
+/* The analysis step of the R3 engine, done in separate passes as it
+ * used to be and fused as it is now. The two must give identical
+ * results with any implementation, as the fused version only folds
+ * the fftshift into the windowing and the normalisation into the
+ * cartesian-polar conversion */
+
+struct AnalysisFixture
+{
+    int n;
+    int from;
+    int count;
+    FFT fft;
+    Window<double> window;
+    std::vector<float> src;
+    std::vector<double> td, re, im, mag, phase;
+
+    AnalysisFixture(int n_) :
+        n(n_), from(n/16), count(n/4), fft(n), window(HannWindow, n),
+        src(n), td(n), re(n/2 + 1), im(n/2 + 1),
+        mag(n/2 + 1, 0.0), phase(n/2 + 1, 0.0) {
+        srand(0);
+        for (int i = 0; i < n; ++i) {
+            src[i] = (float(rand()) / float(RAND_MAX)) * 2.f - 1.f;
+        }
+    }
+
+    void separate() {
+        v_convert(td.data(), src.data(), n);
+        window.cut(td.data());
+        v_fftshift(td.data(), n);
+        fft.forward(td.data(), re.data(), im.data());
+        v_cartesian_to_polar(mag.data() + from, phase.data() + from,
+                             re.data() + from, im.data() + from, count);
+        v_scale(mag.data() + from, 1.0 / double(n), count);
+    }
+
+    void fused() {
+        window.cutShifted(src.data(), td.data());
+        fft.forward(td.data(), re.data(), im.data());
+        v_cartesian_to_polar_scaled(mag.data() + from, phase.data() + from,
+                                    re.data() + from, im.data() + from,
+                                    1.0 / double(n), count);
+    }
+};
+
+ALL_IMPL_AUTO_TEST_CASE(fused_analysis)
+{
+    AnalysisFixture f(2048);
+    f.separate();
+    std::vector<double> mag(f.mag), phase(f.phase);
+    v_zero(f.mag.data(), f.n/2 + 1);
+    v_zero(f.phase.data(), f.n/2 + 1);
+    f.fused();
+    BOOST_TEST(f.mag == mag, boost::test_tools::per_element());
+    BOOST_TEST(f.phase == phase, boost::test_tools::per_element());
+}
+
+BOOST_AUTO_TEST_CASE(benchmark_fused_analysis,
+                     * boost::unit_test::disabled())
+{
+    std::set<std::string> impls = FFT::getImplementations();
+    int sizes[] = { 1024, 2048, 4096 };
+    for (const auto &impl : all_implementations) {
+        if (impls.find(impl) == impls.end() || impl == "dft") continue;
+        FFT::setDefaultImplementation(impl);
+        for (int n : sizes) {
+            AnalysisFixture f(n);
+            f.count = n/2 + 1 - f.from;
+            int iterations = 4000000 / n;
+            auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < iterations; ++i) f.separate();
+            auto mid = std::chrono::steady_clock::now();
+            for (int i = 0; i < iterations; ++i) f.fused();
+            auto end = std::chrono::steady_clock::now();
+            double separate = std::chrono::duration<double, std::micro>
+                (mid - start).count() / iterations;
+            double fused = std::chrono::duration<double, std::micro>
+                (end - mid).count() / iterations;
+            BOOST_TEST_MESSAGE(impl << " n = " << n << ": separate "
+                               << separate << " us, fused " << fused
+                               << " us per frame");
+        }
+        FFT::setDefaultImplementation("");
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
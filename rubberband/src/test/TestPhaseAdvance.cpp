@@ -0,0 +1,418 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Rubber Band Library
+    An audio time-stretching and pitch-shifting library.
+    Copyright 2007-2023 Particular Programs Ltd.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+
+    Alternatively, if you have a valid commercial licence for the
+    Rubber Band Library obtained by agreement with the copyright
+    holders, you may redistribute and/or modify it under the terms
+    described in that licence.
+
+    If you wish to distribute code using the Rubber Band Library
+    under terms other than those of the GNU General Public License,
+    you must obtain a valid commercial licence before doing so.
+*/
+
+#ifndef BOOST_TEST_DYN_LINK
+#define BOOST_TEST_DYN_LINK
+#endif
+#include <boost/test/unit_test.hpp>
+
+// PhaseAdvance.h and the Guide.h it includes rely on these coming first
+#include "../finer/BinSegmenter.h"
+#include "../finer/Peak.h"
+#include "../finer/PhaseAdvance.h"
+
+#include "../common/sysutils.h"
+
+#include <iostream>
+
+#include <cmath>
+#include <cstdlib>
+
+using namespace RubberBand;
+
+using std::vector;
+using std::cerr;
+
+static Log cerrLog(
+    [](const char *message) {
+        cerr << message << "\n";
+    },
+    [](const char *message, double arg) {
+        cerr << message << ": " << arg << "\n";
+    },
+    [](const char *message, double arg0, double arg1) {
+        cerr << message << ": (" << arg0 << ", " << arg1 << ")\n";
+    }
+    );
+
+// A straightforward per-bin phase advance, written the way
+// GuidedPhaseAdvance::advance worked before it was split into table
+// lookups and vector passes, to compare that against
+
+class ReferencePhaseAdvance
+{
+public:
+    ReferencePhaseAdvance(int fftSize, double sampleRate, int channels) :
+        m_fftSize(fftSize),
+        m_sampleRate(sampleRate),
+        m_channels(channels),
+        m_binCount(fftSize / 2 + 1),
+        m_peakPicker(m_binCount),
+        m_currentPeaks(channels, vector<int>(m_binCount, 0)),
+        m_prevPeaks(channels, vector<int>(m_binCount, 0)),
+        m_greatestChannel(m_binCount, 0),
+        m_prevInPhase(channels, vector<process_t>(m_binCount, 0.0)),
+        m_prevOutPhase(channels, vector<process_t>(m_binCount, 0.0)),
+        m_unlocked(channels, vector<process_t>(m_binCount, 0.0)) {
+        for (int c = 0; c < channels; ++c) {
+            for (int i = 0; i < m_binCount; ++i) {
+                m_prevPeaks[c][i] = i;
+            }
+        }
+    }
+
+    void advance(process_t *const *outPhase,
+                 const process_t *const *mag,
+                 const process_t *const *phase,
+                 const process_t *const *prevMag,
+                 int lowest, int highest,
+                 const Guide::Guidance *const *guidance,
+                 bool usingMidSide,
+                 int inhop,
+                 int outhop) {
+
+        int channels = m_channels;
+        double ratio = double(outhop) / double(inhop);
+
+        for (int c = 0; c < channels; ++c) {
+            for (int i = lowest; i <= highest; ++i) {
+                m_currentPeaks[c][i] = i;
+            }
+            for (int i = 0; i < guidance[c]->phaseLockBandCount; ++i) {
+                const auto &band = guidance[c]->phaseLockBands[i];
+                int startBin = binForFrequency(band.f0, m_fftSize, m_sampleRate);
+                int endBin = binForFrequency(band.f1, m_fftSize, m_sampleRate);
+                if (startBin > highest || endBin < lowest) continue;
+                if (endBin > highest) endBin = highest;
+                int count = endBin - startBin + 1;
+                if (count < 1) continue;
+                m_peakPicker.findNearestAndNextPeaks
+                    (mag[c], startBin, count, band.p,
+                     m_currentPeaks[c].data(), nullptr);
+            }
+            m_peakPicker.findNearestAndNextPeaks
+                (prevMag[c], lowest, highest - lowest + 1, 1,
+                 m_prevPeaks[c].data(), nullptr);
+        }
+
+        for (int i = lowest; i <= highest; ++i) {
+            int gc = 0;
+            float gmag = mag[0][i];
+            for (int c = 1; c < channels; ++c) {
+                if (mag[c][i] > gmag) {
+                    gmag = mag[c][i];
+                    gc = c;
+                }
+            }
+            m_greatestChannel[i] = gc;
+        }
+
+        process_t omegaFactor = 2.0 * M_PI * process_t(inhop) /
+            process_t(m_fftSize);
+        for (int c = 0; c < channels; ++c) {
+            for (int i = lowest; i <= highest; ++i) {
+                process_t omega = omegaFactor * process_t(i);
+                process_t expected = m_prevInPhase[c][i] + omega;
+                process_t error = princarg(phase[c][i] - expected);
+                process_t advance = ratio * (omega + error);
+                m_unlocked[c][i] = m_prevOutPhase[c][i] + advance;
+            }
+        }
+
+        for (int c = 0; c < channels; ++c) {
+            const Guide::Guidance *g = guidance[c];
+            int phaseLockBand = 0;
+            for (int i = lowest; i <= highest; ++i) {
+                process_t f = frequencyForBin(i, m_fftSize, m_sampleRate);
+                while (f > g->phaseLockBands[phaseLockBand].f1 &&
+                       phaseLockBand + 1 < g->phaseLockBandCount) {
+                    ++phaseLockBand;
+                }
+                process_t ph = 0.0;
+                if (inRange(f, g->phaseReset) || inRange(f, g->kick)) {
+                    ph = phase[c][i];
+                } else if (usingMidSide && channels == 2 &&
+                           c == 0 && inRange(f, guidance[1]->phaseReset)) {
+                    ph = phase[c][i];
+                } else if (inhop == outhop) {
+                    ph = m_unlocked[c][i];
+                } else if (inRange(f, g->highUnlocked)) {
+                    ph = m_unlocked[c][i];
+                } else {
+                    int peak = m_currentPeaks[c][i];
+                    int prevPeak = m_prevPeaks[c][peak];
+                    int peakCh = c;
+                    if (inRange(f, g->channelLock)) {
+                        int other = m_greatestChannel[i];
+                        if (other != c &&
+                            inRange(f, guidance[other]->channelLock)) {
+                            int otherPeak = m_currentPeaks[other][i];
+                            int otherPrevPeak = m_prevPeaks[other][otherPeak];
+                            if (otherPrevPeak == prevPeak) {
+                                peakCh = other;
+                            }
+                        }
+                    }
+                    process_t peakAdvance =
+                        m_unlocked[peakCh][peak] - m_prevOutPhase[peakCh][peak];
+                    process_t peakNew =
+                        m_prevOutPhase[peakCh][prevPeak] + peakAdvance;
+                    process_t diff =
+                        process_t(phase[c][i]) - process_t(phase[peakCh][peak]);
+                    process_t beta =
+                        process_t(g->phaseLockBands[phaseLockBand].beta);
+                    ph = peakNew + beta * diff;
+                }
+                outPhase[c][i] = princarg(ph);
+            }
+        }
+
+        for (int c = 0; c < channels; ++c) {
+            for (int i = lowest; i <= highest; ++i) {
+                m_prevInPhase[c][i] = phase[c][i];
+                m_prevOutPhase[c][i] = outPhase[c][i];
+            }
+        }
+    }
+
+private:
+    int m_fftSize;
+    double m_sampleRate;
+    int m_channels;
+    int m_binCount;
+    Peak<process_t> m_peakPicker;
+    vector<vector<int>> m_currentPeaks;
+    vector<vector<int>> m_prevPeaks;
+    vector<int> m_greatestChannel;
+    vector<vector<process_t>> m_prevInPhase;
+    vector<vector<process_t>> m_prevOutPhase;
+    vector<vector<process_t>> m_unlocked;
+
+    bool inRange(process_t f, const Guide::Range &r) {
+        return r.present && f >= r.f0 && f < r.f1;
+    }
+};
+
+static process_t random_in(double lo, double hi)
+{
+    return process_t(lo + (hi - lo) * (double(rand()) / double(RAND_MAX)));
+}
+
+// Phases are compared modulo 2pi and with an absolute tolerance, as
+// a compiler is free to fuse multiply-adds in the scalar code, which
+// can make for very slightly different results (that then feed back
+// through the following hops)
+
+static double phase_distance(process_t a, process_t b)
+{
+    return fabs(princarg(double(a) - double(b)));
+}
+
+// Guidance with every kind of range present, at frequencies that
+// move about a little from one hop to the next and that fall both on
+// and between bin centres
+
+static Guide::Guidance make_guidance(int fftSize, int hop, int channel)
+{
+    Guide::Guidance g;
+    double nyquist = 22050.0;
+    double wobble = 10.0 * hop + 37.0 * channel;
+
+    g.fftBandCount = 1;
+    g.fftBands[0] = Guide::FftBand(fftSize, 0.0, nyquist);
+
+    g.phaseLockBandCount = 4;
+    g.phaseLockBands[0] = Guide::PhaseLockBand(1, 1.0, 0.0, 500.0 + wobble);
+    g.phaseLockBands[1] = Guide::PhaseLockBand(2, 0.8, 500.0 + wobble, 4000.0);
+    g.phaseLockBands[2] = Guide::PhaseLockBand(3, 0.6, 4000.0, 9000.0 + wobble);
+    g.phaseLockBands[3] = Guide::PhaseLockBand(4, 0.4, 9000.0 + wobble, nyquist);
+
+    g.highUnlocked = Guide::Range(true, 15000.0 - wobble, nyquist);
+    g.channelLock = Guide::Range(true, 0.0, 3000.0 + wobble);
+    g.kick = Guide::Range(hop % 3 == 0, 40.0, 180.0 + wobble);
+    g.preKick = Guide::Range(false, 0.0, 0.0);
+    g.phaseReset = Guide::Range(hop % 4 == 1 || channel == 1,
+                                5000.0 + wobble, 7000.0);
+    return g;
+}
+
+static void compare_with_reference(int channels, bool usingMidSide,
+                                   int inhop, int outhop)
+{
+    int fftSize = 1024;
+    int bins = fftSize / 2 + 1;
+    double rate = 44100.0;
+
+    Guide::Configuration config;
+    config.longestFftSize = fftSize;
+    config.shortestFftSize = fftSize;
+    config.classificationFftSize = fftSize;
+    config.fftBandLimitCount = 1;
+    config.fftBandLimits[0] = Guide::BandLimits(fftSize, rate, 0.0, 20000.0);
+    int lowest = config.fftBandLimits[0].b0min;
+    int highest = config.fftBandLimits[0].b1max;
+
+    GuidedPhaseAdvance::Parameters params(fftSize, rate, channels, false);
+    GuidedPhaseAdvance actual(params, cerrLog);
+    ReferencePhaseAdvance expected(fftSize, rate, channels);
+
+    vector<vector<process_t>> mag(channels, vector<process_t>(bins));
+    vector<vector<process_t>> prevMag(channels, vector<process_t>(bins));
+    vector<vector<process_t>> phase(channels, vector<process_t>(bins));
+    vector<vector<process_t>> outActual(channels, vector<process_t>(bins, 0.0));
+    vector<vector<process_t>> outExpected(channels, vector<process_t>(bins, 0.0));
+    vector<Guide::Guidance> guidance(channels);
+
+    vector<process_t *> outActualPtrs, outExpectedPtrs;
+    vector<const process_t *> magPtrs, prevMagPtrs, phasePtrs;
+    vector<const Guide::Guidance *> guidancePtrs;
+    for (int c = 0; c < channels; ++c) {
+        outActualPtrs.push_back(outActual[c].data());
+        outExpectedPtrs.push_back(outExpected[c].data());
+        magPtrs.push_back(mag[c].data());
+        prevMagPtrs.push_back(prevMag[c].data());
+        phasePtrs.push_back(phase[c].data());
+        guidancePtrs.push_back(&guidance[c]);
+    }
+
+    srand(42);
+
+    for (int hop = 0; hop < 12; ++hop) {
+
+        for (int c = 0; c < channels; ++c) {
+            prevMag[c] = mag[c];
+            for (int i = 0; i < bins; ++i) {
+                mag[c][i] = random_in(0.0, 1.0);
+                phase[c][i] = random_in(-M_PI, M_PI);
+            }
+            guidance[c] = make_guidance(fftSize, hop, c);
+        }
+
+        actual.advance(outActualPtrs.data(), magPtrs.data(),
+                       phasePtrs.data(), prevMagPtrs.data(),
+                       config, guidancePtrs.data(),
+                       usingMidSide, inhop, outhop);
+
+        expected.advance(outExpectedPtrs.data(), magPtrs.data(),
+                         phasePtrs.data(), prevMagPtrs.data(),
+                         lowest, highest, guidancePtrs.data(),
+                         usingMidSide, inhop, outhop);
+
+        for (int c = 0; c < channels; ++c) {
+            for (int i = lowest; i <= highest; ++i) {
+                BOOST_TEST(phase_distance(outActual[c][i],
+                                          outExpected[c][i]) < 1.0e-9);
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(TestPhaseAdvance)
+
+BOOST_AUTO_TEST_CASE(princarg_matches_scalar)
+{
+    vector<process_t> values {
+        0.0, M_PI, -M_PI, 2.0 * M_PI, -2.0 * M_PI, 1.0e-12, -1.0e-12,
+        3.0, -3.0, 100.0, -100.0, 12345.678, -12345.678,
+        3.0e9, -3.0e9, 1.0e15, -1.0e15
+    };
+    srand(1);
+    for (int i = 0; i < 200; ++i) {
+        values.push_back(random_in(-1000.0, 1000.0));
+    }
+
+    vector<process_t> wrapped(values);
+    v_princarg(wrapped.data(), 0, int(wrapped.size()) - 1);
+
+    for (int i = 0; i < int(values.size()); ++i) {
+        BOOST_TEST(phase_distance(wrapped[i], princarg(values[i])) < 1.0e-9);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(princarg_partial_range)
+{
+    vector<process_t> values { 7.0, 7.0, 7.0, 7.0, 7.0, 7.0, 7.0 };
+    v_princarg(values.data(), 2, 4);
+    BOOST_TEST(values[0] == 7.0);
+    BOOST_TEST(values[1] == 7.0);
+    BOOST_TEST(phase_distance(values[2], princarg(7.0)) < 1.0e-12);
+    BOOST_TEST(phase_distance(values[4], princarg(7.0)) < 1.0e-12);
+    BOOST_TEST(values[5] == 7.0);
+    BOOST_TEST(values[6] == 7.0);
+}
+
+BOOST_AUTO_TEST_CASE(advance_unlocked_matches_scalar)
+{
+    int n = 515;
+    vector<process_t> phase(n), prevIn(n), prevOut(n);
+    srand(2);
+    for (int i = 0; i < n; ++i) {
+        phase[i] = random_in(-M_PI, M_PI);
+        prevIn[i] = random_in(-M_PI, M_PI);
+        prevOut[i] = random_in(-M_PI, M_PI);
+    }
+    process_t omegaFactor = 2.0 * M_PI * 256.0 / 1024.0;
+    double ratio = 1.7;
+
+    vector<process_t> unlocked(n, 0.0);
+    v_advance_unlocked(unlocked.data(), phase.data(),
+                       prevIn.data(), prevOut.data(),
+                       omegaFactor, ratio, 3, n - 2);
+
+    BOOST_TEST(unlocked[0] == 0.0);
+    BOOST_TEST(unlocked[n-1] == 0.0);
+    for (int i = 3; i <= n - 2; ++i) {
+        process_t omega = omegaFactor * process_t(i);
+        process_t expected = prevIn[i] + omega;
+        process_t error = princarg(phase[i] - expected);
+        process_t advance = ratio * (omega + error);
+        BOOST_TEST(phase_distance(unlocked[i], prevOut[i] + advance) < 1.0e-9);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(advance_matches_reference_mono)
+{
+    compare_with_reference(1, false, 256, 512);
+}
+
+BOOST_AUTO_TEST_CASE(advance_matches_reference_stereo)
+{
+    compare_with_reference(2, false, 256, 384);
+}
+
+BOOST_AUTO_TEST_CASE(advance_matches_reference_midside)
+{
+    compare_with_reference(2, true, 300, 256);
+}
+
+BOOST_AUTO_TEST_CASE(advance_matches_reference_multichannel)
+{
+    compare_with_reference(5, false, 256, 700);
+}
+
+BOOST_AUTO_TEST_CASE(advance_matches_reference_unity)
+{
+    compare_with_reference(2, false, 256, 256);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -28,8 +28,14 @@
 
 #include "../common/MovingMedian.h"
 #include "../common/HistogramFilter.h"
+#include "../common/MirroredRingBuffer.h"
 #include "../finer/Peak.h"
 
+#include <algorithm>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+
 using namespace RubberBand;
 
 using std::vector;
@@ -92,6 +98,61 @@ BOOST_AUTO_TEST_CASE(moving_median_n_1)
     BOOST_TEST(arr == expected, tt::per_element());
 }
 
+// Values from a small set, so that there are plenty of duplicates
+static vector<double> repetitive_sequence(int n, int seed)
+{
+    vector<double> v(n);
+    srand(seed);
+    for (int i = 0; i < n; ++i) {
+        v[i] = double(rand() % 23) * 0.5;
+    }
+    return v;
+}
+
+BOOST_AUTO_TEST_CASE(moving_median_batch)
+{
+    int filters = 37, len = 9, pushes = 60;
+    MovingMedianStack<double> stack(filters, len);
+    MovingMedianBatch<double> batch(filters, len);
+    vector<double> medians(filters);
+
+    for (int round = 0; round < 2; ++round) {
+        for (int p = 0; p < pushes; ++p) {
+            vector<double> column = repetitive_sequence(filters, p + round);
+            if (p == 17) {
+                column[5] = std::numeric_limits<double>::quiet_NaN();
+            }
+            batch.push(column.data());
+            batch.get(medians.data());
+            for (int i = 0; i < filters; ++i) {
+                stack.push(i, column[i]);
+                BOOST_TEST(medians[i] == stack.get(i));
+            }
+        }
+        batch.reset();
+        stack.reset();
+    }
+}
+
+BOOST_AUTO_TEST_CASE(moving_median_batch_filter)
+{
+    for (int len = 1; len <= 12; ++len) {
+        for (int n : { 1, 2, 5, len - 1, len, len + 1, 40 }) {
+            if (n < 1) continue;
+            vector<double> input = repetitive_sequence(n, len * 100 + n);
+            vector<double> expected = input;
+            MovingMedian<double> mm(len);
+            MovingMedian<double>::filter(mm, expected);
+            for (int lanes : { 1, 3, 16 }) {
+                vector<double> actual(n, -1.0);
+                MovingMedianBatch<double> batch(lanes, len);
+                batch.filter(input.data(), actual.data(), n);
+                BOOST_TEST(actual == expected, tt::per_element());
+            }
+        }
+    }
+}
+
 BOOST_AUTO_TEST_CASE(histogram_median_simple_3)
 {
     HistogramFilter hf(5, 3); // nValues, filterLength
@@ -346,5 +407,69 @@ BOOST_AUTO_TEST_CASE(troughpick_next_2_12)
     BOOST_TEST(out == expected, tt::per_element());
 }
 
+BOOST_AUTO_TEST_CASE(mirrored_ringbuffer_view_wraps)
+{
+    // Read views of 5 from a buffer of 11, in hops of 3, writing
+    // in odd-sized chunks so that both writes and views wrap at
+    // every possible offset
+    MirroredRingBuffer<float> rb(11, 5);
+    BOOST_TEST(rb.getSize() == 11);
+    BOOST_TEST(rb.getViewSize() == 5);
+
+    int written = 0, read = 0;
+    for (int hop = 0; hop < 40; ++hop) {
+        while (rb.getWriteSpace() >= 4) {
+            vector<double> in { double(written), double(written + 1),
+                                double(written + 2), double(written + 3) };
+            BOOST_TEST(rb.write(in.data(), 4) == 4);
+            written += 4;
+        }
+        const float *v = rb.view(5);
+        BOOST_REQUIRE(v != nullptr);
+        vector<float> peeked(5);
+        BOOST_TEST(rb.peek(peeked.data(), 5) == 5);
+        for (int i = 0; i < 5; ++i) {
+            BOOST_TEST(v[i] == float(read + i));
+            BOOST_TEST(peeked[i] == float(read + i));
+        }
+        BOOST_TEST(rb.skip(3) == 3);
+        read += 3;
+    }
+}
+
+BOOST_AUTO_TEST_CASE(mirrored_ringbuffer_view_limits)
+{
+    MirroredRingBuffer<float> rb(7, 4);
+    vector<float> in { 1.f, 2.f, 3.f };
+    rb.write(in.data(), 3);
+    BOOST_TEST(rb.view(3) != nullptr);
+    BOOST_TEST(rb.view(4) == nullptr); // more than available
+    rb.write(in.data(), 3);
+    BOOST_TEST(rb.view(5) == nullptr); // more than the view size
+}
+
+BOOST_AUTO_TEST_CASE(mirrored_ringbuffer_zero_and_resize)
+{
+    MirroredRingBuffer<float> rb(7, 4);
+    vector<float> in { 1.f, 2.f, 3.f, 4.f, 5.f, 6.f };
+    rb.write(in.data(), 6);
+    rb.skip(5);
+    rb.zero(3);
+    const float *v = rb.view(4);
+    BOOST_REQUIRE(v != nullptr);
+    vector<float> actual(v, v + 4);
+    vector<float> expected { 6.f, 0.f, 0.f, 0.f };
+    BOOST_TEST(actual == expected, tt::per_element());
+
+    std::unique_ptr<MirroredRingBuffer<float>> bigger(rb.resized(15));
+    BOOST_TEST(bigger->getSize() == 15);
+    BOOST_TEST(bigger->getViewSize() == 4);
+    BOOST_TEST(bigger->getReadSpace() == 4);
+    v = bigger->view(4);
+    BOOST_REQUIRE(v != nullptr);
+    actual = vector<float>(v, v + 4);
+    BOOST_TEST(actual == expected, tt::per_element());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 
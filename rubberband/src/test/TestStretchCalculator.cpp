@@ -28,6 +28,7 @@
 
 #include "../common/StretchCalculator.h"
 
+#include <cstdlib>
 #include <iostream>
 
 using namespace RubberBand;
@@ -129,5 +130,30 @@ BOOST_AUTO_TEST_CASE(offline_onep_nohp)
     BOOST_TEST(out == expected, tt::per_element());
 }
 
+BOOST_AUTO_TEST_CASE(offline_threaded_peaks)
+{
+    // Long enough for the peak search to be split into segments,
+    // with some flat stretches and some isolated onsets
+    vector<float> df(50000);
+    srand(42);
+    for (size_t i = 0; i < df.size(); ++i) {
+        if ((i / 3000) % 4 == 3) df[i] = 0.f;
+        else df[i] = float(rand() % 1000) / 2000.f;
+        if (i % 701 == 0) df[i] = 1.f;
+    }
+
+    for (double ratio : { 0.5, 1.3, 2.0 }) {
+        
+        StretchCalculator unthreaded(44100, 512, true, cerrLog);
+        vector<int> expected = unthreaded.calculate(ratio, df.size() * 512, df);
+
+        StretchCalculator threaded(44100, 512, true, cerrLog);
+        threaded.setUseThreads(true);
+        vector<int> out = threaded.calculate(ratio, df.size() * 512, df);
+
+        BOOST_TEST(out == expected, tt::per_element());
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 
@@ -28,7 +28,14 @@
 
 #include "../../rubberband/RubberBandStretcher.h"
 
+#include "../common/FFT.h"
+#include "../common/Profiler.h"
+
 #include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <algorithm>
+#include <thread>
 
 #include <cmath>
 
@@ -740,6 +747,50 @@ BOOST_AUTO_TEST_CASE(sinusoid_realtime_long_blocksize_finer_shift)
                       80000, true);
 }
 
+BOOST_AUTO_TEST_CASE(realtime_block_size_independent_faster)
+{
+    // A long process block should produce the same chunks, and so
+    // the same output, as feeding just what getSamplesRequired asks
+    // for, and should leave none of them waiting for a later call
+
+    int n = 44100;
+    int rate = 44100;
+    double timeRatio = 1.5;
+    int nOut = int(n * timeRatio);
+
+    vector<float> in(n);
+    for (int i = 0; i < n; ++i) {
+        in[i] = 0.5f * sinf(float(i) * 440.f * M_PI * 2.f / float(rate));
+        if (i % 5000 == 0) in[i] = 1.f;
+    }
+
+    RubberBandStretcher::Options options =
+        RubberBandStretcher::OptionEngineFaster |
+        RubberBandStretcher::OptionProcessRealTime;
+
+    RubberBandStretcher small(rate, 1, options, timeRatio);
+    small.setMaxProcessSize(8192);
+    auto smallOut = process_realtime(small, in, nOut, 512, false, false);
+
+    RubberBandStretcher large(rate, 1, options, timeRatio);
+    large.setMaxProcessSize(8192);
+    auto largeOut = process_realtime(large, in, nOut, 8192, true, false);
+
+    for (int i = 0; i < nOut; ++i) {
+        if (smallOut[i] != largeOut[i]) {
+            BOOST_TEST(smallOut[i] == largeOut[i]);
+            BOOST_TEST_MESSAGE("first difference at sample " << i);
+            break;
+        }
+    }
+
+    RubberBandStretcher stretcher(rate, 1, options, timeRatio);
+    stretcher.setMaxProcessSize(8192);
+    const float *source = in.data();
+    stretcher.process(&source, 8192, false);
+    BOOST_TEST(stretcher.getSamplesRequired() > 0);
+}
+
 BOOST_AUTO_TEST_CASE(impulses_2x_offline_faster)
 {
     int n = 10000;
@@ -1514,4 +1565,736 @@ BOOST_AUTO_TEST_CASE(with_resets_2x_5up_realtime_faster)
     with_resets(RubberBandStretcher::OptionProcessRealTime | RubberBandStretcher::OptionEngineFaster, 2.0, 1.5);
 }
 
+
+static vector<vector<float>> stretch_offline(RubberBandStretcher::Options options,
+                                             const vector<vector<float>> &in,
+                                             double timeRatio,
+                                             double pitchScale)
+{
+    int channels = int(in.size());
+    int n = int(in[0].size());
+    int rate = 44100;
+
+    RubberBandStretcher stretcher(rate, channels, options,
+                                  timeRatio, pitchScale);
+
+    vector<const float *> inp(channels);
+    for (int c = 0; c < channels; ++c) {
+        inp[c] = in[c].data();
+    }
+
+    stretcher.setMaxProcessSize(n);
+    stretcher.setExpectedInputDuration(n);
+    stretcher.study(inp.data(), n, true);
+    stretcher.process(inp.data(), n, true);
+
+    int nOut = stretcher.available();
+    BOOST_TEST(nOut > 0);
+
+    vector<vector<float>> out(channels, vector<float>(nOut));
+    vector<float *> outp(channels);
+    for (int c = 0; c < channels; ++c) {
+        outp[c] = out[c].data();
+    }
+    
+    int got = (int)stretcher.retrieve(outp.data(), nOut);
+    BOOST_TEST(got == nOut);
+
+    return out;
+}
+
+static vector<vector<float>> multichannel_offline(RubberBandStretcher::Options options,
+                                                  int channels,
+                                                  double timeRatio,
+                                                  double pitchScale)
+{
+    int n = 20000;
+    int rate = 44100;
+
+    vector<vector<float>> in(channels, vector<float>(n));
+    for (int c = 0; c < channels; ++c) {
+        float freq = 220.f * float(c + 1);
+        for (int i = 0; i < n; ++i) {
+            in[c][i] = 0.5f * sinf(float(i) * freq * M_PI * 2.f / float(rate));
+            if (i % 5000 == 0) in[c][i] = 1.f;
+        }
+    }
+
+    return stretch_offline(options, in, timeRatio, pitchScale);
+}
+
+static void threaded_matches_unthreaded(RubberBandStretcher::Options options,
+                                        int channels,
+                                        double timeRatio,
+                                        double pitchScale)
+{
+    auto expected = multichannel_offline
+        (options | RubberBandStretcher::OptionThreadingNever,
+         channels, timeRatio, pitchScale);
+
+    auto actual = multichannel_offline
+        (options | RubberBandStretcher::OptionThreadingAlways,
+         channels, timeRatio, pitchScale);
+
+    BOOST_TEST(actual.size() == expected.size());
+    
+    for (int c = 0; c < channels; ++c) {
+        BOOST_TEST(actual[c].size() == expected[c].size());
+        BOOST_TEST(actual[c] == expected[c], tt::per_element());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(threaded_2x_5up_offline_finer)
+{
+    threaded_matches_unthreaded(RubberBandStretcher::OptionEngineFiner,
+                                4, 2.0, 1.5);
+}
+
+BOOST_AUTO_TEST_CASE(threaded_2x_5up_offline_finer_together)
+{
+    threaded_matches_unthreaded(RubberBandStretcher::OptionEngineFiner |
+                                RubberBandStretcher::OptionChannelsTogether,
+                                4, 2.0, 1.5);
+}
+
+BOOST_AUTO_TEST_CASE(threaded_2x_5up_offline_finer_mono)
+{
+    threaded_matches_unthreaded(RubberBandStretcher::OptionEngineFiner,
+                                1, 2.0, 1.5);
+}
+
+BOOST_AUTO_TEST_CASE(threaded_2x_5up_offline_finer_formant)
+{
+    threaded_matches_unthreaded(RubberBandStretcher::OptionEngineFiner |
+                                RubberBandStretcher::OptionFormantPreserved,
+                                2, 2.0, 1.5);
+}
+
+BOOST_AUTO_TEST_CASE(threaded_1x_0up_offline_finer_short)
+{
+    threaded_matches_unthreaded(RubberBandStretcher::OptionEngineFiner |
+                                RubberBandStretcher::OptionWindowShort,
+                                3, 1.0, 1.0);
+}
+
+BOOST_AUTO_TEST_CASE(threaded_2x_5up_offline_faster)
+{
+    threaded_matches_unthreaded(RubberBandStretcher::OptionEngineFaster,
+                                4, 2.0, 1.5);
+}
+
+BOOST_AUTO_TEST_CASE(threaded_2x_5up_offline_faster_together)
+{
+    threaded_matches_unthreaded(RubberBandStretcher::OptionEngineFaster |
+                                RubberBandStretcher::OptionChannelsTogether,
+                                4, 2.0, 1.5);
+}
+
+static void threaded_study_matches_unthreaded(RubberBandStretcher::Options options,
+                                              int channels)
+{
+    // Long enough for the study to be analysed in several batches,
+    // and fed in blocks that don't line up with them
+
+    int n = 200000, bs = 30000;
+    int rate = 44100;
+
+    vector<vector<float>> in(channels, vector<float>(n));
+    for (int c = 0; c < channels; ++c) {
+        float freq = 220.f * float(c + 1);
+        for (int i = 0; i < n; ++i) {
+            in[c][i] = 0.5f * sinf(float(i) * freq * M_PI * 2.f / float(rate));
+            if (i % 5000 == 0) in[c][i] = 1.f;
+            if (i > 80000 && i < 90000) in[c][i] = 0.f;
+        }
+    }
+
+    RubberBandStretcher::Options threading[] = {
+        RubberBandStretcher::OptionThreadingNever,
+        RubberBandStretcher::OptionThreadingAlways
+    };
+
+    vector<vector<float>> curves;
+    vector<vector<int>> increments;
+    vector<vector<vector<float>>> outputs;
+    
+    for (auto t : threading) {
+
+        RubberBandStretcher stretcher(rate, channels, options | t, 1.5, 1.0);
+
+        vector<const float *> inp(channels);
+        for (int i = 0; i < n; i += bs) {
+            for (int c = 0; c < channels; ++c) {
+                inp[c] = in[c].data() + i;
+            }
+            int count = std::min(bs, n - i);
+            stretcher.study(inp.data(), count, i + count >= n);
+        }
+
+        curves.push_back(stretcher.getPhaseResetCurve());
+        
+        for (int c = 0; c < channels; ++c) {
+            inp[c] = in[c].data();
+        }
+        stretcher.setMaxProcessSize(n);
+        stretcher.process(inp.data(), n, true);
+
+        increments.push_back(stretcher.getOutputIncrements());
+        
+        int nOut = stretcher.available();
+        vector<vector<float>> out(channels, vector<float>(nOut));
+        vector<float *> outp(channels);
+        for (int c = 0; c < channels; ++c) {
+            outp[c] = out[c].data();
+        }
+        BOOST_TEST((int)stretcher.retrieve(outp.data(), nOut) == nOut);
+        outputs.push_back(out);
+    }
+
+    BOOST_TEST(curves[0].size() > 256);
+    BOOST_TEST(curves[1] == curves[0], tt::per_element());
+    BOOST_TEST(increments[1] == increments[0], tt::per_element());
+
+    for (int c = 0; c < channels; ++c) {
+        BOOST_TEST(outputs[1][c].size() == outputs[0][c].size());
+        BOOST_TEST(outputs[1][c] == outputs[0][c], tt::per_element());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(threaded_study_offline_faster_mono)
+{
+    threaded_study_matches_unthreaded(RubberBandStretcher::OptionEngineFaster,
+                                      1);
+}
+
+BOOST_AUTO_TEST_CASE(threaded_study_offline_faster_long)
+{
+    threaded_study_matches_unthreaded(RubberBandStretcher::OptionEngineFaster |
+                                      RubberBandStretcher::OptionWindowLong,
+                                      2);
+}
+
+BOOST_AUTO_TEST_CASE(threaded_study_offline_faster_short)
+{
+    threaded_study_matches_unthreaded(RubberBandStretcher::OptionEngineFaster |
+                                      RubberBandStretcher::OptionWindowShort,
+                                      2);
+}
+
+BOOST_AUTO_TEST_CASE(threaded_concurrent_offline_faster)
+{
+    // Several threaded stretchers at once, from separate threads,
+    // all sharing the one worker pool. Boost.Test assertions are not
+    // thread-safe, so the threads only stretch and the results are
+    // checked once they have all finished
+    
+    int instances = 4, channels = 3, n = 20000;
+    auto options = RubberBandStretcher::OptionEngineFaster;
+
+    auto expected = multichannel_offline
+        (options | RubberBandStretcher::OptionThreadingNever,
+         channels, 2.0, 1.5);
+
+    vector<vector<float>> in(channels, vector<float>(n));
+    for (int c = 0; c < channels; ++c) {
+        float freq = 220.f * float(c + 1);
+        for (int i = 0; i < n; ++i) {
+            in[c][i] = 0.5f * sinf(float(i) * freq * M_PI * 2.f / 44100.f);
+            if (i % 5000 == 0) in[c][i] = 1.f;
+        }
+    }
+
+    vector<vector<vector<float>>> actual(instances);
+    vector<std::thread> threads;
+    
+    for (int k = 0; k < instances; ++k) {
+        threads.push_back(std::thread([&, k]() {
+            RubberBandStretcher stretcher
+                (44100, channels,
+                 options | RubberBandStretcher::OptionThreadingAlways,
+                 2.0, 1.5);
+            vector<const float *> inp(channels);
+            for (int c = 0; c < channels; ++c) inp[c] = in[c].data();
+            stretcher.setMaxProcessSize(n);
+            stretcher.setExpectedInputDuration(n);
+            stretcher.study(inp.data(), n, true);
+            stretcher.process(inp.data(), n, true);
+            int nOut = std::max(stretcher.available(), 0);
+            actual[k] = vector<vector<float>>(channels, vector<float>(nOut));
+            vector<float *> outp(channels);
+            for (int c = 0; c < channels; ++c) outp[c] = actual[k][c].data();
+            stretcher.retrieve(outp.data(), nOut);
+        }));
+    }
+
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    for (int k = 0; k < instances; ++k) {
+        BOOST_TEST(actual[k].size() == expected.size());
+        for (int c = 0; c < channels; ++c) {
+            BOOST_TEST(actual[k][c] == expected[c], tt::per_element());
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(unity_formant_offline_finer)
+{
+    // With no formant shift to undo, preserving formants should
+    // change nothing at all
+    auto expected = multichannel_offline
+        (RubberBandStretcher::OptionEngineFiner, 2, 1.5, 1.0);
+
+    auto actual = multichannel_offline
+        (RubberBandStretcher::OptionEngineFiner |
+         RubberBandStretcher::OptionFormantPreserved, 2, 1.5, 1.0);
+
+    BOOST_TEST(actual.size() == expected.size());
+    
+    for (int c = 0; c < 2; ++c) {
+        BOOST_TEST(actual[c].size() == expected[c].size());
+        BOOST_TEST(actual[c] == expected[c], tt::per_element());
+    }
+}
+BOOST_AUTO_TEST_CASE(linked_identical_channels_finer)
+{
+    // Linking channels with the same content has nothing to share
+    // that they would not have worked out alike anyway
+    int n = 20000;
+    vector<vector<float>> in(2, vector<float>(n));
+    for (int i = 0; i < n; ++i) {
+        in[0][i] = 0.5f * sinf(float(i) * 330.f * M_PI * 2.f / 44100.f);
+        if (i % 5000 == 0) in[0][i] = 1.f;
+    }
+    in[1] = in[0];
+    
+    auto expected = stretch_offline
+        (RubberBandStretcher::OptionEngineFiner, in, 1.5, 1.2);
+
+    auto actual = stretch_offline
+        (RubberBandStretcher::OptionEngineFiner |
+         RubberBandStretcher::OptionChannelsLinked, in, 1.5, 1.2);
+
+    BOOST_TEST(actual.size() == expected.size());
+    
+    for (int c = 0; c < 2; ++c) {
+        BOOST_TEST(actual[c].size() == expected[c].size());
+        BOOST_TEST(actual[c] == expected[c], tt::per_element());
+    }
+}
+
+BOOST_AUTO_TEST_CASE(threaded_2x_5up_offline_finer_linked)
+{
+    threaded_matches_unthreaded(RubberBandStretcher::OptionEngineFiner |
+                                RubberBandStretcher::OptionChannelsLinked,
+                                2, 2.0, 1.5);
+}
+// Real-time sine through a stretcher at unity pitch, except for a
+// second of pitch shift in the middle, fed and retrieved a block at
+// a time. Returns the output and the output count after each block.
+
+static vector<float> realtime_with_shift(RubberBandStretcher::Options options,
+                                         const vector<float> &in,
+                                         vector<int> &counts)
+{
+    int rate = 44100;
+    int bs = 512;
+    int n = int(in.size());
+
+    RubberBandStretcher stretcher(rate, 1, options |
+                                  RubberBandStretcher::OptionProcessRealTime);
+    stretcher.setMaxProcessSize(bs);
+
+    vector<float> out, block(bs * 4);
+    float *outp = block.data();
+    
+    for (int i = 0; i + bs <= n; i += bs) {
+        double t = double(i) / double(rate);
+        stretcher.setPitchScale((t >= 3.0 && t < 4.0) ? 1.3 : 1.0);
+        const float *inp = in.data() + i;
+        stretcher.process(&inp, bs, false);
+        int avail = stretcher.available();
+        while (avail > 0) {
+            int got = int(stretcher.retrieve(&outp, std::min(avail, bs * 4)));
+            out.insert(out.end(), block.begin(), block.begin() + got);
+            avail = stretcher.available();
+        }
+        counts.push_back(int(out.size()));
+    }
+
+    return out;
+}
+
+static double largest_step(const vector<float> &v, int from, int to)
+{
+    double step = 0.0;
+    for (int i = std::max(from, 1); i < to && i < int(v.size()); ++i) {
+        step = std::max(step, double(fabs(v[i] - v[i-1])));
+    }
+    return step;
+}
+
+static double relative_error(const vector<float> &v, const vector<float> &in,
+                             int from, int to)
+{
+    double err = 0.0, total = 0.0;
+    for (int i = from; i < to && i < int(v.size()); ++i) {
+        double d = v[i] - in[i];
+        err += d * d;
+        total += in[i] * in[i];
+    }
+    return sqrt(err / total);
+}
+
+static void unity_bypass(RubberBandStretcher::Options options)
+{
+    int rate = 44100;
+    int n = rate * 6;
+    vector<float> in(n);
+    for (int i = 0; i < n; ++i) {
+        in[i] = 0.5f * sinf(float(i) * 440.f * M_PI * 2.f / float(rate));
+    }
+
+    vector<int> plainCounts, bypassCounts;
+    auto plain = realtime_with_shift(options, in, plainCounts);
+    auto bypass = realtime_with_shift
+        (options | RubberBandStretcher::OptionProcessUnityBypass,
+         in, bypassCounts);
+
+    // Output keeps pace with the plain stretcher, to within a hop or
+    // two: the history goes on playing while the stretcher restarts,
+    // where the plain stretcher may hold back output as the ratio
+    // changes, and the change itself reaches the stretcher a few
+    // blocks later
+    BOOST_TEST(plainCounts.size() == bypassCounts.size());
+    for (int i = 0; i < int(plainCounts.size()); ++i) {
+        BOOST_TEST(abs(plainCounts[i] - bypassCounts[i]) <= 1024);
+    }
+
+    // Well after settling, the output is the input
+    BOOST_TEST(int(bypass.size()) > 2 * rate);
+    for (int i = rate; i < 2 * rate; ++i) {
+        if (bypass[i] != in[i]) {
+            BOOST_TEST(bypass[i] == in[i]);
+            break;
+        }
+    }
+
+    // Going in and out of the bypass makes no larger a step in the
+    // signal than the plain stretcher does
+    double plainStep = largest_step(plain, rate / 4, 5 * rate);
+    double bypassStep = largest_step(bypass, rate / 4, 5 * rate);
+    BOOST_TEST(bypassStep < plainStep * 1.1);
+
+    // Just before the shift, the restarted stretcher is fading in
+    // over the history, and both should still be the input, as they
+    // are with the plain stretcher
+    int from = int(rate * 2.85), to = int(rate * 2.98);
+    double plainError = relative_error(plain, in, from, to);
+    double bypassError = relative_error(bypass, in, from, to);
+    BOOST_TEST(bypassError <= std::max(0.05, plainError * 1.5));
+}
+
+BOOST_AUTO_TEST_CASE(unity_bypass_realtime_faster)
+{
+    unity_bypass(RubberBandStretcher::OptionEngineFaster);
+}
+
+BOOST_AUTO_TEST_CASE(unity_bypass_realtime_finer)
+{
+    unity_bypass(RubberBandStretcher::OptionEngineFiner);
+}
+
+BOOST_AUTO_TEST_CASE(unity_bypass_realtime_finer_consistency)
+{
+    unity_bypass(RubberBandStretcher::OptionEngineFiner |
+                 RubberBandStretcher::OptionPitchHighConsistency);
+}
+
+// Benchmarks. These are disabled by default, as they take a while and
+// check nothing; run one explicitly with e.g.
+// --run_test=TestStretcher/benchmark_offline_finer --log_level=message
+
+static void benchmark_offline(RubberBandStretcher::Options options,
+                              int channels)
+{
+    int seconds = 20;
+    int rate = 44100;
+    int n = seconds * rate;
+    int bs = 1024;
+
+    RubberBandStretcher stretcher(rate, channels, options, 1.5, 1.2);
+
+    vector<vector<float>> in(channels, vector<float>(n));
+    vector<float *> inp(channels);
+    for (int c = 0; c < channels; ++c) {
+        float freq = 220.f * float(c + 1);
+        for (int i = 0; i < n; ++i) {
+            in[c][i] = 0.5f * sinf(float(i) * freq * M_PI * 2.f / float(rate));
+            if (i % 5000 == 0) in[c][i] = 1.f;
+        }
+    }
+
+    vector<vector<float>> out(channels, vector<float>(bs * 4));
+    vector<float *> outp(channels);
+    for (int c = 0; c < channels; ++c) {
+        outp[c] = out[c].data();
+    }
+
+    stretcher.setMaxProcessSize(bs);
+    stretcher.setExpectedInputDuration(n);
+
+    for (int i = 0; i < n; i += bs) {
+        for (int c = 0; c < channels; ++c) inp[c] = in[c].data() + i;
+        stretcher.study(inp.data(), std::min(bs, n - i), i + bs >= n);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+
+    int nOut = 0;
+    for (int i = 0; i < n; i += bs) {
+        for (int c = 0; c < channels; ++c) inp[c] = in[c].data() + i;
+        stretcher.process(inp.data(), std::min(bs, n - i), i + bs >= n);
+        int avail;
+        while ((avail = stretcher.available()) > 0) {
+            nOut += int(stretcher.retrieve
+                        (outp.data(), std::min(avail, int(out[0].size()))));
+        }
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    double ms = std::chrono::duration<double, std::milli>(end - start).count();
+
+    BOOST_TEST(nOut > 0);
+    BOOST_TEST_MESSAGE("benchmark: " << channels << " channel(s), "
+                       << seconds << "s of input: " << ms << " ms, "
+                       << (ms / seconds) << " ms per second of input");
+
+#ifndef NO_TIMING
+    // Only if built with WANT_TIMING
+    BOOST_TEST_MESSAGE(Profiler::getReport());
+#endif
+}
+
+BOOST_AUTO_TEST_CASE(benchmark_offline_finer,
+                     * boost::unit_test::disabled())
+{
+    benchmark_offline(RubberBandStretcher::OptionEngineFiner |
+                      RubberBandStretcher::OptionThreadingNever, 2);
+}
+
+BOOST_AUTO_TEST_CASE(benchmark_offline_finer_multichannel,
+                     * boost::unit_test::disabled())
+{
+    benchmark_offline(RubberBandStretcher::OptionEngineFiner |
+                      RubberBandStretcher::OptionThreadingNever, 6);
+}
+
+BOOST_AUTO_TEST_CASE(benchmark_offline_faster,
+                     * boost::unit_test::disabled())
+{
+    benchmark_offline(RubberBandStretcher::OptionEngineFaster |
+                      RubberBandStretcher::OptionThreadingNever, 2);
+}
+
+BOOST_AUTO_TEST_CASE(benchmark_offline_faster_long,
+                     * boost::unit_test::disabled())
+{
+    benchmark_offline(RubberBandStretcher::OptionEngineFaster |
+                      RubberBandStretcher::OptionWindowLong |
+                      RubberBandStretcher::OptionThreadingNever, 2);
+}
+
+BOOST_AUTO_TEST_CASE(benchmark_offline_faster_multichannel,
+                     * boost::unit_test::disabled())
+{
+    benchmark_offline(RubberBandStretcher::OptionEngineFaster |
+                      RubberBandStretcher::OptionThreadingNever, 6);
+}
+
+BOOST_AUTO_TEST_CASE(benchmark_offline_faster_multichannel_threaded,
+                     * boost::unit_test::disabled())
+{
+    benchmark_offline(RubberBandStretcher::OptionEngineFaster |
+                      RubberBandStretcher::OptionThreadingAlways, 6);
+}
+
+BOOST_AUTO_TEST_CASE(benchmark_offline_finer_formant,
+                     * boost::unit_test::disabled())
+{
+    benchmark_offline(RubberBandStretcher::OptionEngineFiner |
+                      RubberBandStretcher::OptionFormantPreserved |
+                      RubberBandStretcher::OptionThreadingNever, 2);
+}
+
+// The slowest real-time process and retrieve call in the blocks
+// either side of leaving the unity bypass, against the slowest and
+// mean of the blocks before it settled, with the bypass and without
+
+static void benchmark_bypass_restart(RubberBandStretcher::Options options)
+{
+    int rate = 44100;
+    int channels = 2;
+    int bs = 256;
+    int n = 3 * rate;
+    int change = 2 * rate;
+
+    vector<vector<float>> in(channels, vector<float>(n));
+    vector<float *> inp(channels);
+    for (int c = 0; c < channels; ++c) {
+        float freq = 220.f * float(c + 1);
+        for (int i = 0; i < n; ++i) {
+            in[c][i] = 0.5f * sinf(float(i) * freq * M_PI * 2.f / float(rate));
+        }
+    }
+
+    vector<vector<float>> out(channels, vector<float>(bs * 4));
+    vector<float *> outp(channels);
+    for (int c = 0; c < channels; ++c) {
+        outp[c] = out[c].data();
+    }
+
+    for (bool bypass : { false, true }) {
+
+        RubberBandStretcher stretcher
+            (rate, channels, options |
+             RubberBandStretcher::OptionProcessRealTime |
+             (bypass ? RubberBandStretcher::OptionProcessUnityBypass : 0));
+        stretcher.setMaxProcessSize(bs);
+
+        double early = 0.0, earlyTotal = 0.0, around = 0.0;
+        int earlyCount = 0;
+
+        for (int i = 0; i + bs <= n; i += bs) {
+            stretcher.setPitchScale(i >= change ? 1.5 : 1.0);
+            for (int c = 0; c < channels; ++c) inp[c] = in[c].data() + i;
+            auto start = std::chrono::steady_clock::now();
+            stretcher.process(inp.data(), bs, false);
+            int avail;
+            while ((avail = stretcher.available()) > 0) {
+                stretcher.retrieve(outp.data(),
+                                   std::min(avail, int(out[0].size())));
+            }
+            std::chrono::duration<double, std::milli> t =
+                std::chrono::steady_clock::now() - start;
+            if (i >= rate / 4 && i < rate / 2) {
+                early = std::max(early, t.count());
+                earlyTotal += t.count();
+                ++earlyCount;
+            } else if (i >= change - 4 * bs && i < change + 64 * bs) {
+                around = std::max(around, t.count());
+            }
+        }
+
+        BOOST_TEST_MESSAGE("benchmark: " << (bypass ? "bypass" : "plain")
+                           << ", " << channels << " channels, block size "
+                           << bs << " (" << (1000.0 * bs / rate)
+                           << " ms): settling mean "
+                           << (earlyTotal / earlyCount) << " ms, max "
+                           << early << " ms; max around restart "
+                           << around << " ms");
+    }
+}
+
+BOOST_AUTO_TEST_CASE(benchmark_bypass_restart_finer,
+                     * boost::unit_test::disabled())
+{
+    benchmark_bypass_restart(RubberBandStretcher::OptionEngineFiner);
+}
+
+BOOST_AUTO_TEST_CASE(benchmark_bypass_restart_faster,
+                     * boost::unit_test::disabled())
+{
+    benchmark_bypass_restart(RubberBandStretcher::OptionEngineFaster);
+}
+
+// Mean log-spectral distance in dB between two signals, over
+// Hann-windowed frames
+static double spectral_difference(const vector<float> &a,
+                                  const vector<float> &b)
+{
+    int size = 2048;
+    int hop = 512;
+    int bins = size/2 + 1;
+    int n = int(std::min(a.size(), b.size()));
+    
+    FFT fft(size);
+    vector<double> window(size), frame(size), ma(bins), mb(bins);
+    for (int i = 0; i < size; ++i) {
+        window[i] = 0.5 - 0.5 * cos(2.0 * M_PI * i / size);
+    }
+
+    double total = 0.0;
+    int frames = 0;
+    for (int start = 0; start + size <= n; start += hop) {
+        for (int i = 0; i < size; ++i) frame[i] = a[start + i] * window[i];
+        fft.forwardMagnitude(frame.data(), ma.data());
+        for (int i = 0; i < size; ++i) frame[i] = b[start + i] * window[i];
+        fft.forwardMagnitude(frame.data(), mb.data());
+        double sum = 0.0;
+        for (int i = 0; i < bins; ++i) {
+            double d = 20.0 * log10((ma[i] + 1.0e-6) / (mb[i] + 1.0e-6));
+            sum += d * d;
+        }
+        total += sqrt(sum / bins);
+        ++frames;
+    }
+
+    return frames > 0 ? total / frames : 0.0;
+}
+
+// Run with e.g.
+// --run_test=TestStretcher/compare_linked_finer --log_level=message
+
+BOOST_AUTO_TEST_CASE(compare_linked_finer,
+                     * boost::unit_test::disabled())
+{
+    // A stereo mix of shared drums and tones with a different part
+    // in each channel, as with a typical music stem
+    int rate = 44100;
+    int n = 10 * rate;
+    vector<vector<float>> in(2, vector<float>(n));
+    srand(1);
+    for (int i = 0; i < n; ++i) {
+        float t = float(i) / float(rate);
+        float common = 0.2f * sinf(t * 220.f * M_PI * 2.f) +
+            0.1f * sinf(t * 330.f * M_PI * 2.f);
+        if (i % 11025 < 400) {
+            common += 0.3f * (float(rand()) / float(RAND_MAX) * 2.f - 1.f);
+        }
+        in[0][i] = common + 0.15f * sinf(t * 523.f * M_PI * 2.f);
+        in[1][i] = common + 0.15f * sinf(t * 784.f * M_PI * 2.f) *
+            (i % 22050 < 11025 ? 1.f : 0.f);
+    }
+
+    for (double pitch : { 1.0, 1.5, 0.7 }) {
+
+        RubberBandStretcher::Options options =
+            RubberBandStretcher::OptionEngineFiner |
+            RubberBandStretcher::OptionThreadingNever;
+
+        auto start = std::chrono::steady_clock::now();
+        auto apart = stretch_offline(options, in, 1.2, pitch);
+        std::chrono::duration<double, std::milli> apartTime =
+            std::chrono::steady_clock::now() - start;
+
+        start = std::chrono::steady_clock::now();
+        auto linked = stretch_offline
+            (options | RubberBandStretcher::OptionChannelsLinked,
+             in, 1.2, pitch);
+        std::chrono::duration<double, std::milli> linkedTime =
+            std::chrono::steady_clock::now() - start;
+
+        BOOST_TEST_MESSAGE("linked vs apart, time ratio 1.2, pitch scale "
+                           << pitch << ": apart " << apartTime.count()
+                           << " ms, linked " << linkedTime.count()
+                           << " ms; spectral difference "
+                           << spectral_difference(apart[0], linked[0])
+                           << " dB (left), "
+                           << spectral_difference(apart[1], linked[1])
+                           << " dB (right)");
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
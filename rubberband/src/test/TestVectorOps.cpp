@@ -63,6 +63,36 @@ BOOST_AUTO_TEST_CASE(add_with_gain)
     COMPARE_N(a, expected, 3);
 }
 
+BOOST_AUTO_TEST_CASE(mix_with_gains)
+{
+    double a[] = { 1.0, 2.0, 3.0 };
+    double b[] = { -1.0, 3.0, -4.5 };
+    double ga[] = { 0.5, 1.0, 0.0 };
+    double gb[] = { 2.0, 0.0, -1.0 };
+    double expected[] = { -1.5, 2.0, 4.5 };
+    v_mix_with_gains(a, b, ga, gb, 3);
+    COMPARE_N(a, expected, 3);
+}
+
+BOOST_AUTO_TEST_CASE(mix_with_gains_float)
+{
+    // Long and odd enough to go through both the vector body and the
+    // scalar tail of any specialised version
+    const int n = 37;
+    float a[n], b[n], ga[n], gb[n], expected[n];
+    for (int i = 0; i < n; ++i) {
+        a[i] = float(i) * 0.25f - 3.f;
+        b[i] = float(n - i) * 0.5f;
+        ga[i] = float(i) / float(n);
+        gb[i] = 1.f - ga[i];
+        expected[i] = a[i] * ga[i] + b[i] * gb[i];
+    }
+    v_mix_with_gains(a, b, ga, gb, n);
+    for (int i = 0; i < n; ++i) {
+        BOOST_CHECK_SMALL(a[i] - expected[i], 1e-5f);
+    }
+}
+
 BOOST_AUTO_TEST_CASE(subtract)
 {
     double a[] = { 1.0, 2.0, 3.0 };